@@ -0,0 +1,61 @@
+#include "AliasTable.h"
+
+using namespace std;
+
+
+void AliasTable::build(const vector<double>& weights)
+{
+    size_t n = weights.size();
+    _prob.assign(n, 1);
+    _alias.resize(n);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += weights[i];
+    if (n == 0 || sum <= 0) {
+        for (size_t i = 0; i < n; i++)
+            _alias[i] = i;
+        return;
+    }
+
+    // scaled so the average slot holds 1; slots below 1 are topped up by one slot above 1
+    vector<double> scaled(n);
+    vector<int> small, large;
+    for (size_t i = 0; i < n; i++) {
+        scaled[i] = weights[i] * n / sum;
+        _alias[i] = i;
+        if (scaled[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        _prob[s] = scaled[s];
+        _alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // what is left is 1 up to rounding
+    for (size_t k = 0; k < small.size(); k++)
+        _prob[small[k]] = 1;
+    for (size_t k = 0; k < large.size(); k++)
+        _prob[large[k]] = 1;
+}
+
+
+int AliasTable::sample(CounterRng& rng) const
+{
+    int slot = rng() % _prob.size();
+    float coin = (rng() >> 8) * (1.0f / 16777216);
+    return coin < _prob[slot] ? slot : _alias[slot];
+}
+
+
+size_t AliasTable::size() const
+{
+    return _prob.size();
+}
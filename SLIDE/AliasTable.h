@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include "Random.h"
+
+/*
+*  Walker/Vose alias table: after an O(n) build from n non-negative weights, sample() draws index i
+*  with probability weight[i] / sum in O(1), from one uniform slot and one coin.
+*  Used for the Mode 4 negatives of a softmax layer (Negatives config key, see Layer::rebuildNegatives).
+*/
+enum NegativeSampling { NEGATIVES_UNIFORM, NEGATIVES_FREQUENCY, NEGATIVES_POWER };
+
+class AliasTable
+{
+private:
+    std::vector<float> _prob;
+    std::vector<int> _alias;
+
+public:
+    void build(const std::vector<double>& weights);
+    int sample(CounterRng& rng) const;
+    size_t size() const;
+};
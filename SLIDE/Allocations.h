@@ -0,0 +1,7 @@
+#pragma once
+
+/*
+*  Counts calls to the global operator new/new[] (COUNT_ALLOCATIONS in Config.h), so the
+*  hot path can be checked for heap allocations.
+*/
+long long allocationCount();
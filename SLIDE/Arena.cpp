@@ -0,0 +1,205 @@
+#include "Arena.h"
+#include "Config.h"
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+
+using namespace std;
+
+struct ArenaBlock {
+    size_t _bytes;
+    size_t _pageSize;
+    ArenaTag _tag;
+    bool _hugetlb;
+    bool _attached;  // shared segment created by another process
+    string _shmName; // shared segment this process unlinks when freeing
+};
+
+static const char* _tagNames[ARENA_TAGS] = {"weights", "adam", "grads", "train", "nodes", "lsh"};
+static map<void*, ArenaBlock> _blocks;
+static size_t _usage[ARENA_TAGS][2]; // [tag][hugetlb?]
+static mutex _arenaLock;
+static string _sharePrefix;
+static bool _shareCreate;
+static int _shareCount;
+
+
+/*
+* Segments are numbered in allocation order, which is the same in every worker since they
+* build the same network; the creating process must finish allocating before others attach.
+*/
+void arenaShare(const char* prefix, bool create)
+{
+    _sharePrefix = prefix;
+    _shareCreate = create;
+    _shareCount = 0;
+}
+
+
+bool arenaSharing()
+{
+    return !_sharePrefix.empty();
+}
+
+
+static void* mapShared(size_t bytes, ArenaBlock& block)
+{
+    string name = _sharePrefix + "-" + to_string(_shareCount++);
+    int fd = shm_open(name.c_str(), _shareCreate ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0) {
+        std::cout << "shm_open failed for " << name << std::endl;
+        return MAP_FAILED;
+    }
+    if (_shareCreate && ftruncate(fd, bytes) != 0) {
+        std::cout << "ftruncate failed for " << name << std::endl;
+        close(fd);
+        return MAP_FAILED;
+    }
+    void* ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr != MAP_FAILED && HUGEPAGE_MB > 0 && bytes >= (2UL << 20))
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+    block._attached = !_shareCreate;
+    if (_shareCreate)
+        block._shmName = name;
+    return ptr;
+}
+
+
+static size_t roundUp(size_t bytes, size_t page)
+{
+    return (bytes + page - 1) / page * page;
+}
+
+
+static void* mapHugetlb(size_t bytes, size_t page)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    if (page == (1UL << 30))
+        flags |= MAP_HUGE_1GB;
+    else
+        flags |= MAP_HUGE_2MB;
+    return mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+}
+
+
+void* arenaAlloc(size_t bytes, ArenaTag tag)
+{
+    if (bytes == 0)
+        bytes = 1;
+    size_t smallPage = sysconf(_SC_PAGESIZE);
+    ArenaBlock block;
+    block._tag = tag;
+    block._hugetlb = false;
+    block._attached = false;
+    void* ptr = MAP_FAILED;
+
+    if (!_sharePrefix.empty() && (tag == ARENA_WEIGHTS || tag == ARENA_ADAM)) {
+        block._bytes = roundUp(bytes, smallPage);
+        block._pageSize = smallPage;
+        ptr = mapShared(block._bytes, block);
+        if (ptr == MAP_FAILED)
+            return NULL;
+        lock_guard<mutex> guard(_arenaLock);
+        _blocks[ptr] = block;
+        _usage[tag][0] += block._bytes;
+        return ptr;
+    }
+
+    // largest configured page size that wastes at most 1/8 of the buffer
+    size_t pages[2] = {1UL << 30, 2UL << 20};
+    for (int p = 0; p < 2 && ptr == MAP_FAILED; p++) {
+        size_t page = pages[p];
+        if (page > (size_t) HUGEPAGE_MB << 20 || roundUp(bytes, page) - bytes > bytes / 8)
+            continue;
+        ptr = mapHugetlb(roundUp(bytes, page), page);
+        if (ptr != MAP_FAILED) {
+            block._bytes = roundUp(bytes, page);
+            block._pageSize = page;
+            block._hugetlb = true;
+        }
+    }
+
+    if (ptr == MAP_FAILED) {
+        block._bytes = roundUp(bytes, smallPage);
+        block._pageSize = smallPage;
+        ptr = mmap(NULL, block._bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            std::cout << "mmap failed at arena for " << bytes << " bytes of " << _tagNames[tag] << std::endl;
+            return NULL;
+        }
+        if (HUGEPAGE_MB > 0 && block._bytes >= (2UL << 20))
+            madvise(ptr, block._bytes, MADV_HUGEPAGE);
+    }
+
+    lock_guard<mutex> guard(_arenaLock);
+    _blocks[ptr] = block;
+    _usage[tag][block._hugetlb] += block._bytes;
+    return ptr;
+}
+
+
+void arenaFree(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+    lock_guard<mutex> guard(_arenaLock);
+    map<void*, ArenaBlock>::iterator it = _blocks.find(ptr);
+    if (it == _blocks.end()) {
+        std::cout << "arenaFree of a pointer not owned by the arena" << std::endl;
+        return;
+    }
+    munmap(ptr, it->second._bytes);
+    if (!it->second._shmName.empty())
+        shm_unlink(it->second._shmName.c_str());
+    _usage[it->second._tag][it->second._hugetlb] -= it->second._bytes;
+    _blocks.erase(it);
+}
+
+
+// parameters already initialized by the process that created the segment
+bool arenaAttached(void* ptr)
+{
+    lock_guard<mutex> guard(_arenaLock);
+    map<void*, ArenaBlock>::iterator it = _blocks.find(ptr);
+    return it != _blocks.end() && it->second._attached;
+}
+
+
+// once every process has attached, the names can go; the mappings stay until unmapped
+void arenaUnlinkShared()
+{
+    lock_guard<mutex> guard(_arenaLock);
+    for (map<void*, ArenaBlock>::iterator it = _blocks.begin(); it != _blocks.end(); it++) {
+        if (!it->second._shmName.empty()) {
+            shm_unlink(it->second._shmName.c_str());
+            it->second._shmName.clear();
+        }
+    }
+}
+
+
+size_t arenaPageSize(void* ptr)
+{
+    lock_guard<mutex> guard(_arenaLock);
+    map<void*, ArenaBlock>::iterator it = _blocks.find(ptr);
+    return it == _blocks.end() ? sysconf(_SC_PAGESIZE) : it->second._pageSize;
+}
+
+
+void arenaReport()
+{
+    lock_guard<mutex> guard(_arenaLock);
+    size_t total = 0;
+    cout << "Arena usage (MB, hugetlb / thp or small pages):" << endl;
+    for (int t = 0; t < ARENA_TAGS; t++) {
+        cout << "  " << _tagNames[t] << ": " << _usage[t][1] / (1 << 20) << " / " << _usage[t][0] / (1 << 20) << endl;
+        total += _usage[t][0] + _usage[t][1];
+    }
+    cout << "  total: " << total / (1 << 20) << " MB in " << _blocks.size() << " mappings" << endl;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+
+/*
+*  One allocator for the large model buffers (weights, Adam state, training state, LSH slabs).
+*  Every allocation is its own mapping, backed by hugetlb pages of up to HUGEPAGE_MB (Config.h)
+*  and falling back to madvise'd transparent huge pages when the hugetlb pool is empty.
+*  The mapping length is remembered, so arenaFree releases the whole buffer.
+*  After arenaShare, weights and Adam state are named /dev/shm segments instead, so that worker
+*  processes (Workers.h) train the same parameters; gradients and everything else stay private.
+*/
+enum ArenaTag
+{ ARENA_WEIGHTS, ARENA_ADAM, ARENA_GRADS, ARENA_TRAIN, ARENA_NODES, ARENA_LSH, ARENA_TAGS };
+
+void* arenaAlloc(size_t bytes, ArenaTag tag);
+void arenaFree(void* ptr);
+size_t arenaPageSize(void* ptr);
+void arenaReport();
+void arenaShare(const char* prefix, bool create);
+bool arenaSharing();
+bool arenaAttached(void* ptr);
+void arenaUnlinkShared();
@@ -1,17 +1,42 @@
 #include <iostream>
 #include "Bucket.h"
+#include "Random.h"
 
 
 Bucket::Bucket()
 {
     isInit = -1;
-    arr = new int[BUCKETSIZE]();
+    arr = NULL;
+}
+
+
+// arr is a BUCKETSIZE slice of the owning table's arena slab
+void Bucket::setStorage(int* storage)
+{
+    arr = storage;
+}
+
+
+// a bucket of a frozen table (Frozen.h): storage already holds its ids, terminated as getAll leaves them
+void Bucket::restore(int* storage, int counts)
+{
+    arr = storage;
+    _counts = counts;
+    isInit = counts > 0 ? counts - 1 : -1;
+    index = counts < BUCKETSIZE ? counts : BUCKETSIZE;
+}
+
+
+void Bucket::reset()
+{
+    isInit = -1;
+    index = 0;
+    _counts = 0;
 }
 
 
 Bucket::~Bucket()
 {
-    delete[] arr;
 }
 
 
@@ -41,9 +66,10 @@ int Bucket::add(int id) {
     else {
         _counts++;
         if (index == BUCKETSIZE) {
-            int randnum = rand() % (_counts) + 1;
+            CounterRng& rng = threadRng(RNG_BUCKET);
+            int randnum = rng() % (_counts) + 1;
             if (randnum == 2) {
-                int randind = rand() % BUCKETSIZE;
+                int randind = rng() % BUCKETSIZE;
                 arr[randind] = id;
                 return randind;
             } else {
@@ -71,7 +97,8 @@ int * Bucket::getAll()
 {
     if (isInit == -1)
         return NULL;
-    if(_counts<BUCKETSIZE){
+    // only written when missing, so a read-only frozen table is never written
+    if(_counts<BUCKETSIZE && arr[_counts]!=-1){
         arr[_counts]=-1;
     }
     return arr;
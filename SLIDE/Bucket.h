@@ -1,6 +1,7 @@
 #pragma once
 #include "Config.h"
 
+// BUCKETSIZE ids in a slice of its table's slab; the memory ledger counts both through LSH
 class Bucket
 {
 private:
@@ -11,6 +12,9 @@ private:
 	
 public:
 	Bucket();
+	void setStorage(int* storage);
+	void restore(int* storage, int counts);
+	void reset();
 	int add(int id);
 	int retrieve(int index);
 	int * getAll();
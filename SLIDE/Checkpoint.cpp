@@ -0,0 +1,471 @@
+#include "Checkpoint.h"
+#include "Frozen.h"
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <omp.h>
+
+using namespace std;
+
+
+// false, without a message, when there is no state to resume from yet
+bool readStateHeader(const char* file, StateHeader* header)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool read = pread(fd, header, sizeof(StateHeader), 0) == sizeof(StateHeader);
+    close(fd);
+    if (!read || memcmp(header->_magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0) {
+        cout << file << " is not a training state" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+* The whole file, private and writable: training writes to its own copy of a page the first time it
+* changes it, and the file itself stays as saved. NULL if it cannot be mapped or is truncated.
+*/
+char* stateMap(const char* file, size_t* bytes)
+{
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        cout << "Could not open training state " << file << ": " << strerror(errno) << endl;
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cout << "Could not map training state " << file << ": " << strerror(errno) << endl;
+        return NULL;
+    }
+    *bytes = st.st_size;
+
+    const StateHeader* header = (const StateHeader*) map;
+    const StateLayer* layers = (const StateLayer*) (header + 1);
+    bool complete = *bytes >= sizeof(StateHeader) && *bytes >= sizeof(StateHeader) + header->_layers * sizeof(StateLayer);
+    for (uint32_t l = 0; complete && l < header->_layers; l++) {
+        const StateLayer& layer = layers[l];
+        size_t parameters = layer._nodes * layer._inputs * sizeof(float);
+        complete = layer._weights + parameters <= *bytes && layer._adamAvgMom + parameters <= *bytes
+                && layer._adamAvgVel + parameters <= *bytes && layer._t + parameters <= *bytes
+                && layer._bias + layer._nodes * sizeof(float) <= *bytes
+                && layer._biasAdam + 3 * layer._nodes * sizeof(float) <= *bytes
+                && layer._randNode + layer._nodes * sizeof(int) <= *bytes
+                && layer._labelCounts + layer._nodes * sizeof(long long) <= *bytes;
+    }
+    if (!complete) {
+        cout << "Training state " << file << " is truncated" << endl;
+        munmap(map, *bytes);
+        return NULL;
+    }
+    return (char*) map;
+}
+
+
+LayerState stateLayer(char* map, int l)
+{
+    const StateLayer& layer = ((const StateLayer*) (map + sizeof(StateHeader)))[l];
+    LayerState state;
+    state._nodes = layer._nodes;
+    state._inputs = layer._inputs;
+    state._hasherKey = layer._hasherKey;
+    state._weights = layer._weights ? (float*) (map + layer._weights) : NULL;
+    state._bias = layer._bias ? (float*) (map + layer._bias) : NULL;
+    state._adamAvgMom = layer._adamAvgMom ? (float*) (map + layer._adamAvgMom) : NULL;
+    state._adamAvgVel = layer._adamAvgVel ? (float*) (map + layer._adamAvgVel) : NULL;
+    state._t = layer._t ? (float*) (map + layer._t) : NULL;
+    state._biasAdam = layer._biasAdam ? (float*) (map + layer._biasAdam) : NULL;
+    state._randNode = layer._randNode ? (int*) (map + layer._randNode) : NULL;
+    state._labelCounts = layer._labelCounts ? (long long*) (map + layer._labelCounts) : NULL;
+    return state;
+}
+
+
+// written to <file>.tmp, fsynced and renamed over the previous state, so a crash leaves either one whole
+bool writeState(const char* file, const StateHeader& header, const LayerState* layers)
+{
+    string tmp = string(file) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cout << "Could not write training state " << tmp << ": " << strerror(errno) << endl;
+        return false;
+    }
+    vector<StateLayer> table(header._layers);
+    size_t offset = frozenAlign(sizeof(StateHeader) + header._layers * sizeof(StateLayer));
+    bool written = true;
+    // each present section goes to the next page boundary
+    auto section = [&](const void* data, size_t bytes) -> uint64_t
+    {
+        if (data == NULL || bytes == 0)
+            return 0;
+        size_t at = offset;
+        written = written && frozenWrite(fd, data, bytes, at);
+        offset = frozenAlign(at + bytes);
+        return at;
+    };
+    for (uint32_t l = 0; l < header._layers; l++) {
+        const LayerState& layer = layers[l];
+        StateLayer& entry = table[l];
+        size_t parameters = layer._nodes * layer._inputs * sizeof(float);
+        entry._nodes = layer._nodes;
+        entry._inputs = layer._inputs;
+        entry._hasherKey = layer._hasherKey;
+        entry._weights = section(layer._weights, parameters);
+        entry._bias = section(layer._bias, layer._nodes * sizeof(float));
+        entry._adamAvgMom = section(layer._adamAvgMom, parameters);
+        entry._adamAvgVel = section(layer._adamAvgVel, parameters);
+        entry._t = section(layer._t, parameters);
+        entry._biasAdam = section(layer._biasAdam, 3 * layer._nodes * sizeof(float));
+        entry._randNode = section(layer._randNode, layer._nodes * sizeof(int));
+        entry._labelCounts = section(layer._labelCounts, layer._nodes * sizeof(long long));
+    }
+    written = written && ftruncate(fd, offset) == 0
+            && frozenWrite(fd, &header, sizeof(header), 0)
+            && frozenWrite(fd, table.data(), table.size() * sizeof(StateLayer), sizeof(StateHeader))
+            && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(tmp.c_str(), file) != 0) {
+        cout << "Could not write training state " << file << ": " << strerror(errno) << endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+static const char* MANIFEST = "manifest";
+
+// one file of a sharded checkpoint: rows [_first, _first + _rows) of array _array
+struct ShardFile
+{
+    size_t _array, _first, _rows;
+    std::string _name;
+    uint32_t _crc;
+    size_t _stored;
+    int _compressed;
+    bool _ok;
+    int _error; // errno of the call that failed, 0 for a bad size or checksum
+};
+
+
+// zlib takes 32-bit lengths
+static uint32_t checksum(const char* data, size_t bytes)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (size_t done = 0; done < bytes; ) {
+        uInt n = (uInt) min(bytes - done, (size_t) 1 << 30);
+        crc = crc32(crc, (const Bytef*) data + done, n);
+        done += n;
+    }
+    return crc;
+}
+
+
+static bool readAt(int fd, void* data, size_t bytes)
+{
+    char* p = (char*) data;
+    for (size_t offset = 0; bytes > 0; ) {
+        ssize_t n = pread(fd, p, bytes, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = 0; // shorter than expected: damaged, not unreadable
+        if (n <= 0)
+            return false;
+        p += n;
+        offset += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+static bool syncDirectory(const string& dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    return synced;
+}
+
+
+// the manifest ends in "end <crc>", the CRC-32 of everything before that line
+static string manifestBody(const string& text)
+{
+    size_t end = text.rfind("end ");
+    if (end == string::npos || (end > 0 && text[end - 1] != '\n'))
+        return "";
+    istringstream line(text.substr(end + 4));
+    uint32_t crc = 0;
+    if (!(line >> crc) || checksum(text.data(), end) != crc)
+        return "";
+    return text.substr(0, end);
+}
+
+
+// the generation after the committed one in dir, which is created if need be
+long long nextGeneration(const string& dir)
+{
+    mkdir(dir.c_str(), 0755);
+    ifstream manifest(dir + "/" + MANIFEST);
+    string magic;
+    int version = 0;
+    long long generation = 0;
+    manifest >> magic >> version >> generation;
+    return generation + 1;
+}
+
+
+/*
+* Writes the arrays' files with up to threads threads and returns their manifest entries ("" if a file
+* could not be written). bytes and stored add up the raw and written sizes.
+*/
+string saveShards(const string& dir, long long generation, const vector<CheckpointArray>& arrays,
+                  size_t rowsPerFile, int level, int threads, size_t* bytes, size_t* stored)
+{
+    vector<ShardFile> files;
+    for (size_t a = 0; a < arrays.size(); a++) {
+        for (size_t first = 0, k = 0; first < arrays[a]._rows; first += rowsPerFile, k++) {
+            ShardFile file;
+            file._array = a;
+            file._first = first;
+            file._rows = min(rowsPerFile, arrays[a]._rows - first);
+            file._name = arrays[a]._key + "." + to_string(generation) + "." + to_string(k);
+            files.push_back(file);
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic) num_threads(max(threads, 1))
+    for (size_t f = 0; f < files.size(); f++) {
+        ShardFile& file = files[f];
+        const CheckpointArray& array = arrays[file._array];
+        size_t width = max(array._columns, (size_t) 1);
+        const char* data = (const char*) (array._data + file._first * width);
+        size_t size = file._rows * width * sizeof(float);
+        file._crc = checksum(data, size);
+        file._compressed = 0;
+        file._stored = size;
+        // kept raw when zlib does not make it smaller
+        vector<Bytef> packed;
+        if (level > 0) {
+            uLongf packedSize = compressBound(size);
+            packed.resize(packedSize);
+            if (compress2(&packed[0], &packedSize, (const Bytef*) data, size, level) == Z_OK && packedSize < size) {
+                data = (const char*) &packed[0];
+                file._stored = packedSize;
+                file._compressed = 1;
+            }
+        }
+        string path = dir + "/" + file._name;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        file._ok = fd >= 0 && frozenWrite(fd, data, file._stored, 0) && fsync(fd) == 0;
+        file._error = file._ok ? 0 : errno;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    ostringstream entries;
+    for (size_t a = 0; a < arrays.size(); a++) {
+        size_t count = 0;
+        for (size_t f = 0; f < files.size(); f++)
+            count += files[f]._array == a;
+        entries << "array " << arrays[a]._key << " " << arrays[a]._rows << " " << arrays[a]._columns << " " << count << "\n";
+        for (size_t f = 0; f < files.size(); f++) {
+            const ShardFile& file = files[f];
+            if (file._array != a)
+                continue;
+            if (!file._ok) {
+                cout << "Could not write " << dir << "/" << file._name << ": " << strerror(file._error) << endl;
+                return "";
+            }
+            entries << "file " << file._name << " " << file._first << " " << file._rows << " " << file._crc
+                    << " " << file._stored << " " << file._compressed << "\n";
+            *bytes += file._rows * max(arrays[a]._columns, (size_t) 1) * sizeof(float);
+            *stored += file._stored;
+        }
+    }
+    return entries.str();
+}
+
+
+// the manifest renamed into place commits the generation; older generations' files go afterwards
+bool commitShards(const string& dir, long long generation, const string& entries)
+{
+    string path = dir + "/" + MANIFEST;
+    string tmp = path + ".tmp";
+    string text = "slide-checkpoint 2 " + to_string(generation) + "\n" + entries;
+    text += "end " + to_string(checksum(text.data(), text.size())) + "\n";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && frozenWrite(fd, text.data(), text.size(), 0) && fsync(fd) == 0;
+    int error = errno;
+    if (fd >= 0)
+        close(fd);
+    if (written) {
+        written = rename(tmp.c_str(), path.c_str()) == 0 && syncDirectory(dir);
+        error = errno;
+    }
+    if (!written) {
+        cout << "Could not write " << path << ": " << strerror(error) << endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // <key>.<generation>.<k>
+    string current = "." + to_string(generation) + ".";
+    DIR* listing = opendir(dir.c_str());
+    for (dirent* entry = listing ? readdir(listing) : NULL; entry; entry = readdir(listing)) {
+        string name = entry->d_name;
+        size_t last = name.rfind('.');
+        size_t middle = last == string::npos || last == 0 ? string::npos : name.rfind('.', last - 1);
+        if (middle != string::npos && name.compare(middle, last - middle + 1, current) != 0)
+            unlink((dir + "/" + name).c_str());
+    }
+    if (listing)
+        closedir(listing);
+    return true;
+}
+
+
+/*
+* A sharded checkpoint's arrays, read and inflated in parallel. Empty when the manifest fails its checksum,
+* when its files do not cover every array's rows exactly once, or on a missing file or a checksum mismatch.
+*/
+static cnpy::npz_t loadShards(const string& dir)
+{
+    cnpy::npz_t arrays;
+    ifstream in(dir + "/" + MANIFEST);
+    ostringstream text;
+    text << in.rdbuf();
+    istringstream manifest(manifestBody(text.str()));
+    string magic, kind;
+    int version = 0;
+    long long generation = 0;
+    manifest >> magic >> version >> generation;
+    if (magic != "slide-checkpoint" || version != 2) {
+        cout << dir << " holds no checkpoint manifest, or a damaged one" << endl;
+        return arrays;
+    }
+
+    vector<ShardFile> files;
+    vector<cnpy::NpyArray*> targets;
+    vector<size_t> widths, rowCounts, fileCounts;
+    bool valid = true;
+    while (valid && manifest >> kind) {
+        if (kind == "array") {
+            string key;
+            size_t rows, columns, count;
+            valid = manifest >> key >> rows >> columns >> count && arrays.count(key) == 0;
+            if (!valid)
+                break;
+            vector<size_t> shape = columns ? vector<size_t>{rows, columns} : vector<size_t>{rows};
+            arrays[key] = cnpy::NpyArray(shape, sizeof(float), false);
+            targets.push_back(&arrays[key]);
+            widths.push_back(max(columns, (size_t) 1));
+            rowCounts.push_back(rows);
+            fileCounts.push_back(count);
+        } else if (kind == "file" && !targets.empty()) {
+            ShardFile file;
+            file._array = targets.size() - 1;
+            valid = manifest >> file._name >> file._first >> file._rows >> file._crc >> file._stored >> file._compressed
+                    && file._rows > 0 && file._first <= rowCounts.back() && file._rows <= rowCounts.back() - file._first
+                    && fileCounts.back() > 0;
+            fileCounts.back()--;
+            files.push_back(file);
+        } else {
+            valid = false;
+        }
+    }
+    // every array's files, in order of their first rows, follow each other from row 0 to the last
+    vector<size_t> covered(targets.size(), 0);
+    vector<size_t> order(files.size());
+    for (size_t f = 0; f < files.size(); f++)
+        order[f] = f;
+    sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return files[a]._array != files[b]._array ? files[a]._array < files[b]._array : files[a]._first < files[b]._first;
+    });
+    for (size_t f = 0; valid && f < order.size(); f++) {
+        const ShardFile& file = files[order[f]];
+        valid = file._first == covered[file._array];
+        covered[file._array] += file._rows;
+    }
+    for (size_t a = 0; valid && a < targets.size(); a++)
+        valid = covered[a] == rowCounts[a] && fileCounts[a] == 0;
+    if (!valid) {
+        cout << "Checkpoint manifest " << dir << "/" << MANIFEST << " does not describe every row once" << endl;
+        return cnpy::npz_t();
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t f = 0; f < files.size(); f++) {
+        ShardFile& file = files[f];
+        size_t size = file._rows * widths[file._array] * sizeof(float);
+        char* to = targets[file._array]->data<char>() + file._first * widths[file._array] * sizeof(float);
+        int fd = open((dir + "/" + file._name).c_str(), O_RDONLY);
+        file._ok = fd >= 0;
+        file._error = file._ok ? 0 : errno;
+        if (file._ok && file._compressed) {
+            file._ok = file._stored <= compressBound(size);
+            vector<Bytef> packed(file._ok ? file._stored : 0);
+            uLongf inflated = size;
+            if (file._ok && !readAt(fd, &packed[0], file._stored)) {
+                file._ok = false;
+                file._error = errno;
+            }
+            file._ok = file._ok && uncompress((Bytef*) to, &inflated, &packed[0], file._stored) == Z_OK && inflated == size;
+        } else if (file._ok) {
+            file._ok = file._stored == size;
+            if (file._ok && !readAt(fd, to, size)) {
+                file._ok = false;
+                file._error = errno;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        file._ok = file._ok && checksum(to, size) == file._crc;
+    }
+    for (size_t f = 0; f < files.size(); f++) {
+        if (files[f]._ok)
+            continue;
+        cout << "Checkpoint file " << dir << "/" << files[f]._name << " is "
+             << (files[f]._error ? string("unreadable: ") + strerror(files[f]._error) : string("damaged")) << endl;
+        return cnpy::npz_t();
+    }
+    return arrays;
+}
+
+
+// a checkpoint directory (sharded) or npz file, as npz_load returns it
+cnpy::npz_t loadCheckpoint(const string& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        return cnpy::npz_load(path);
+    auto t1 = chrono::high_resolution_clock::now();
+    cnpy::npz_t arrays = loadShards(path);
+    auto t2 = chrono::high_resolution_clock::now();
+    size_t bytes = 0;
+    for (cnpy::npz_t::iterator it = arrays.begin(); it != arrays.end(); it++)
+        bytes += it->second.num_bytes();
+    double ms = chrono::duration_cast<chrono::microseconds>(t2 - t1).count() / 1000.0;
+    cout << "Loaded checkpoint " << path << ": " << (bytes >> 20) << " MB in " << ms << " ms, "
+         << (ms > 0 ? bytes / 1048576.0 / ms * 1000 : 0) << " MB/s with " << omp_get_max_threads() << " threads" << endl;
+    return arrays;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include "Random.h"
+#include "cnpy.h"
+
+/*
+*  Training state for resuming a run (resume config key, Network::saveState). Per layer the file holds
+*  the weights, the biases, the Adam moments of both, the gradients accumulated since the last update
+*  (_t), the random node order, the hash functions' stream key and the label counts of the Mode 4
+*  negatives. For the run it holds the number of batches trained, which gives the Adam bias correction
+*  and the position in the data, and the random seed and stream counters. Sections are page aligned as
+*  in a frozen model (Frozen.h). The file is mapped copy-on-write and the layers train on its pages in
+*  place, so loading copies nothing and reads only what is touched. LSH tables are not stored but
+*  rebuilt from the weights, which is what the next rehash would do anyway. Every shard of a sharded
+*  output layer keeps its own file, <file>.shard<k>.
+*/
+const char STATE_MAGIC[8] = {'S', 'L', 'I', 'D', 'E', 'S', 'T', '1'};
+
+struct StateHeader
+{
+    char _magic[8];
+    uint32_t _layers;
+    int32_t _batchSize;
+    int64_t _iter; // batches trained, the global index of the next one
+    int32_t _batchesSinceSync;
+    int32_t _seedFixed;
+    uint64_t _seed;
+    uint64_t _streamIds[RNG_COMPONENTS];
+};
+
+struct StateLayer
+{
+    uint64_t _nodes, _inputs;
+    uint64_t _hasherKey; // the hash functions are redrawn at every rebuild, see Layer::drawHashers
+    // file offsets of the sections, 0 for one that is not stored
+    uint64_t _weights, _bias, _adamAvgMom, _adamAvgVel, _t, _biasAdam, _randNode, _labelCounts;
+};
+
+// one layer's state, node-major; _biasAdam is the bias moment, velocity and gradient of every node.
+// A layer this process does not hold has no nodes.
+struct LayerState
+{
+    size_t _nodes, _inputs;
+    uint64_t _hasherKey;
+    float* _weights, *_bias, *_adamAvgMom, *_adamAvgVel, *_t, *_biasAdam;
+    int* _randNode;
+    long long* _labelCounts; // NULL with uniform negatives
+};
+
+// buffers a layer's state is copied into, for a checkpoint written while training goes on
+struct LayerSnapshot
+{
+    std::vector<float> _weights, _bias, _adamAvgMom, _adamAvgVel, _t, _biasAdam;
+    std::vector<int> _randNode;
+    std::vector<long long> _labelCounts;
+};
+
+bool readStateHeader(const char* file, StateHeader* header);
+char* stateMap(const char* file, size_t* bytes);
+LayerState stateLayer(char* map, int layer);
+bool writeState(const char* file, const StateHeader& header, const LayerState* layers);
+
+
+/*
+*  Sharded checkpoint (CheckpointRows / CheckpointCompression config keys): savedweight is a directory,
+*  and every array an npz checkpoint holds (w_layer_<n>, b_layer_<n>, am_layer_<n>, av_layer_<n>) is cut
+*  into files of up to CheckpointRows rows, <key>.<generation>.<k>. All threads write and read the files
+*  at once, each compressing or inflating its own with zlib. A text manifest gives every array's shape
+*  and every file's first row, rows, CRC-32 of the raw bytes and stored size, and ends with a CRC-32 of
+*  itself. Renaming the manifest into place commits a checkpoint, after which the files of older
+*  generations are removed. A manifest whose files do not cover every array's rows exactly once is not loaded.
+*  loadCheckpoint reads either format into the arrays npz_load would return.
+*/
+struct CheckpointArray
+{
+    std::string _key;
+    const float* _data;
+    size_t _rows, _columns; // no columns for a vector (biases)
+};
+
+long long nextGeneration(const std::string& dir);
+std::string saveShards(const std::string& dir, long long generation, const std::vector<CheckpointArray>& arrays,
+                       size_t rowsPerFile, int level, int threads, size_t* bytes, size_t* stored);
+bool commitShards(const std::string& dir, long long generation, const std::string& entries);
+cnpy::npz_t loadCheckpoint(const std::string& path);
@@ -26,8 +26,42 @@
 
 #define THRESH 2
 
+//Mode 4: samples with fewer than PAD_BELOW candidates are padded with negatives up to PAD_TO active nodes
+#define PAD_BELOW 1500
+#define PAD_TO 1000
+
 #define FIFO 1
 
 #define LOADWEIGHT 0
 
-#define MAPLEN 325056
+//store the weights of a dense (Sparsity 1) first layer feature-major, see Layer::computeColumnActivations
+#define FIRST_LAYER_COLUMN_MAJOR 0
+
+//compute the output layer once per batch over the union of the samples' active nodes, whose weight rows are
+//gathered and multiplied with the batch in blocks of UNION_BLOCK rows, see Layer::batchComputeActivations
+#define BATCH_SOFTMAX 0
+#define UNION_BLOCK 64
+
+//threads writing the files of a sharded checkpoint (CheckpointRows) from the AsyncCheckpoint writer, next to training
+#define ASYNC_CHECKPOINT_THREADS 2
+
+//run the per-sample layer steps and the node update sweep (in chunks of STEAL_CHUNK nodes) on per-thread deques with stealing, see Scheduler.h
+#define WORK_STEALING 0
+#define STEAL_CHUNK 256
+
+//batches a parameter update may lag behind the forward pass. 0: the Adam sweep runs after every batch;
+//1: a batch's sweep runs on the scheduler together with the next batch (needs WORK_STEALING and ADAM),
+//so that batch reads weights with or without the previous update. Rehash batches always sweep in place.
+#define UPDATE_STALENESS 0
+
+//count operator new calls and report them per batch, see Allocations.h
+#define COUNT_ALLOCATIONS 0
+
+//time hashing, retrieval, dedup, activation, softmax, backprop, update and rehash per thread, see Timing.h
+#define PHASE_TIMING 0
+
+//largest huge page (in MB) backing the model buffers, see Arena.h: 1024 for 1GB pages, 2 for 2MB pages, 0 for none
+#define HUGEPAGE_MB 1024
+
+//partition each layer's nodes across NUMA nodes and pin OpenMP threads (see Numa.h)
+#define NUMA 0
@@ -5,7 +5,9 @@
 #include <vector>
 #include <climits>
 #include <algorithm>
+#include "Random.h"
 #include <queue>
+#include "Ledger.h"
 using namespace std;
 
 typedef pair<int, float> PAIR;
@@ -16,7 +18,7 @@ struct cmp {
     };
 };
 
-DensifiedMinhash::DensifiedMinhash(int numHashes, int noOfBitsToHash)
+DensifiedMinhash::DensifiedMinhash(int numHashes, int noOfBitsToHash, CounterRng gen)
 {
 
     _numhashes = numHashes;
@@ -24,8 +26,7 @@ DensifiedMinhash::DensifiedMinhash(int numHashes, int noOfBitsToHash)
     _lognumhash = log2(numHashes);
 
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    _key = gen.key();
     std::uniform_int_distribution<> dis(1, INT_MAX);
 
     _randa = dis(gen);
@@ -38,7 +39,15 @@ DensifiedMinhash::DensifiedMinhash(int numHashes, int noOfBitsToHash)
     _randHash[1] = dis(gen);
     if (_randHash[1] % 2 == 0)
         _randHash[1]++;
+    _ledgerLayer = ledgerLayer();
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, footprint(_numhashes, _rangePow));
+}
+
 
+// bytes of the hash constants, for the memory ledger; the bin map is the caller's (Layer::_binids)
+size_t DensifiedMinhash::footprint(int numHashes, int noOfBitsToHash)
+{
+    return 2 * sizeof(int);
 }
 
 
@@ -63,29 +72,40 @@ void DensifiedMinhash::getMap(int n, int* binids)
 
 
 int * DensifiedMinhash::getHashEasy(int* binids, float* data, int dataLen, int topK)
+{
+    int *hashArray = new int[_numhashes];
+    getHashEasy(binids, data, dataLen, topK, hashArray);
+    return hashArray;
+}
+
+
+void DensifiedMinhash::getHashEasy(int* binids, float* data, int dataLen, int topK, int* hashArray)
 {
 
     // binsize is the number of times the range is larger than the total number of hashes we need.
-// read the data and add it to priority queue O(dlogk approx 7d) with index as key and values as priority value, get topk index O(1) and apply minhash on retuned index.
+// read the data and add it to a min-heap O(dlogk approx 7d) with index as key and values as priority value, get topk index O(1) and apply minhash on retuned index.
+// the heap and hash scratch are per thread and reused across calls.
 
-    priority_queue<PAIR, vector<PAIR>, cmp> pq;
+    static thread_local vector<PAIR> heap;
+    static thread_local vector<int> hashScratch;
+    heap.clear();
 
     for (int i = 0; i < topK; i++)
     {
-        pq.push(std::make_pair(i,data[i]));
+        heap.push_back(std::make_pair(i,data[i]));
+        push_heap(heap.begin(), heap.end(), cmp());
     }
 
     for (int i = topK; i < dataLen; i++)
     {
-        pq.push(std::make_pair(i,data[i]));
-        pq.pop();
+        heap.push_back(std::make_pair(i,data[i]));
+        push_heap(heap.begin(), heap.end(), cmp());
+        pop_heap(heap.begin(), heap.end(), cmp());
+        heap.pop_back();
     }
 
-
-
-    int *hashes = new int[_numhashes];
-    //float *values = new float[_numhashes];
-    int *hashArray = new int[_numhashes];
+    hashScratch.resize(_numhashes);
+    int *hashes = &hashScratch[0];
 
     for (int i = 0; i < _numhashes; i++)
     {
@@ -95,8 +115,9 @@ int * DensifiedMinhash::getHashEasy(int* binids, float* data, int dataLen, int t
 
     for (int i = 0; i < topK; i++)
     {
-        PAIR pair = pq.top();
-        pq.pop();
+        PAIR pair = heap.front();
+        pop_heap(heap.begin(), heap.end(), cmp());
+        heap.pop_back();
         int index = pair.first;
         int binid = binids[index];
         if (hashes[binid] < index) {
@@ -127,15 +148,22 @@ int * DensifiedMinhash::getHashEasy(int* binids, float* data, int dataLen, int t
         }
         hashArray[i] = next;
     }
-    delete[] hashes;
-    return hashArray;
 }
 
 
 int * DensifiedMinhash::getHash(int* indices, float* data, int* binids, int dataLen)
 {
-    int *hashes = new int[_numhashes];
     int *hashArray = new int[_numhashes];
+    getHash(indices, data, binids, dataLen, hashArray);
+    return hashArray;
+}
+
+
+void DensifiedMinhash::getHash(int* indices, float* data, int* binids, int dataLen, int* hashArray)
+{
+    static thread_local vector<int> hashScratch;
+    hashScratch.resize(_numhashes);
+    int *hashes = &hashScratch[0];
 
     for (int i = 0; i < _numhashes; i++)
     {
@@ -177,9 +205,6 @@ int * DensifiedMinhash::getHash(int* indices, float* data, int* binids, int data
         }
         hashArray[i] = next;
     }
-    delete[] hashes;
-    //   delete[] values;
-    return hashArray;
 }
 
 
@@ -189,7 +214,15 @@ int DensifiedMinhash::getRandDoubleHash(int binid, int count) {
 }
 
 
+// key of the stream the parameters were drawn from
+uint64_t DensifiedMinhash::key() const
+{
+    return _key;
+}
+
+
 DensifiedMinhash::~DensifiedMinhash()
 {
     delete[] _randHash;
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, -(long long) footprint(_numhashes, _rangePow));
 }
@@ -8,6 +8,7 @@
 #include <vector>
 #include <string.h>
 #include "MurmurHash.h"
+#include "Random.h"
 
 
 using namespace std;
@@ -15,11 +16,17 @@ class DensifiedMinhash
 {
 private:
     int *_randHash, _randa, _numhashes, _rangePow,_lognumhash;
+    uint64_t _key;
+    int _ledgerLayer;
 public:
-    DensifiedMinhash(int numHashes, int noOfBitsToHash);
+    DensifiedMinhash(int numHashes, int noOfBitsToHash, CounterRng gen = rngStream(RNG_MINHASH, nextStreamId(RNG_MINHASH)));
+    static size_t footprint(int numHashes, int noOfBitsToHash);
+    uint64_t key() const;
     int * getHash(int* indices, float* data, int* binids, int dataLen);
+    void getHash(int* indices, float* data, int* binids, int dataLen, int* hashArray);
     int getRandDoubleHash(int binid, int count);
     int * getHashEasy(int* binids, float* data, int dataLen, int topK);
+    void getHashEasy(int* binids, float* data, int dataLen, int topK, int* hashArray);
     void getMap(int n, int* binid);
     ~DensifiedMinhash();
 };
\ No newline at end of file
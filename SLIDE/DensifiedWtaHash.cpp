@@ -7,17 +7,26 @@
 #include <algorithm>
 #include <map>
 #include "Config.h"
+#include "Random.h"
+#include "Ledger.h"
 using namespace std;
 
 
-DensifiedWtaHash::DensifiedWtaHash(int numHashes, int noOfBitsToHash)
+// bytes of the permutation tables (bin and position of every input) and the hash constants, for the memory ledger
+size_t DensifiedWtaHash::footprint(int numHashes, int noOfBitsToHash)
+{
+    size_t permute = ceil(numHashes * binsize * 1.0 / noOfBitsToHash);
+    return 2 * sizeof(int) * noOfBitsToHash * permute + 2 * sizeof(int);
+}
+
+
+DensifiedWtaHash::DensifiedWtaHash(int numHashes, int noOfBitsToHash, CounterRng gen)
 {
 
     _numhashes = numHashes;
     _rangePow = noOfBitsToHash;
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    _key = gen.key();
 
     _permute = ceil(_numhashes * binsize * 1.0 / noOfBitsToHash);
 
@@ -30,7 +39,7 @@ DensifiedWtaHash::DensifiedWtaHash(int numHashes, int noOfBitsToHash)
     }
 
     for (int p = 0; p < _permute ;p++) {
-        std::shuffle(n_array, n_array + _rangePow, rd);
+        std::shuffle(n_array, n_array + _rangePow, gen);
         for (int j = 0; j < _rangePow; j++) {
             _indices[p * _rangePow + n_array[j]] = (p * _rangePow + j) / binsize;
             _pos[p * _rangePow + n_array[j]] = (p * _rangePow + j)%binsize;
@@ -52,16 +61,30 @@ DensifiedWtaHash::DensifiedWtaHash(int numHashes, int noOfBitsToHash)
     if (_randHash[1] % 2 == 0)
         _randHash[1]++;
 
+    _ledgerLayer = ledgerLayer();
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, footprint(_numhashes, _rangePow));
 }
 
 
 int * DensifiedWtaHash::getHashEasy(float* data, int dataLen, int topk)
+{
+    int *hashArray = new int[_numhashes];
+    getHashEasy(data, dataLen, topk, hashArray);
+    return hashArray;
+}
+
+
+// scratch is per thread and reused, so the query path does not allocate
+void DensifiedWtaHash::getHashEasy(float* data, int dataLen, int topk, int* hashArray)
 {
     // binsize is the number of times the range is larger than the total number of hashes we need.
 
-    int *hashes = new int[_numhashes];
-    float *values = new float[_numhashes];
-    int *hashArray = new int[_numhashes];
+    static thread_local vector<int> hashScratch;
+    static thread_local vector<float> valueScratch;
+    hashScratch.resize(_numhashes);
+    valueScratch.resize(_numhashes);
+    int *hashes = &hashScratch[0];
+    float *values = &valueScratch[0];
 
     for (int i = 0; i < _numhashes; i++)
     {
@@ -104,16 +127,24 @@ int * DensifiedWtaHash::getHashEasy(float* data, int dataLen, int topk)
         }
         hashArray[i] = next;
     }
-    delete[] hashes;
-    delete[] values;
-    return hashArray;
 }
 
 int* DensifiedWtaHash::getHash(int* indices, float* data, int dataLen)
 {
-    int *hashes = new int[_numhashes];
-    float *values = new float[_numhashes];
     int *hashArray = new int[_numhashes];
+    getHash(indices, data, dataLen, hashArray);
+    return hashArray;
+}
+
+
+void DensifiedWtaHash::getHash(int* indices, float* data, int dataLen, int* hashArray)
+{
+    static thread_local vector<int> hashScratch;
+    static thread_local vector<float> valueScratch;
+    hashScratch.resize(_numhashes);
+    valueScratch.resize(_numhashes);
+    int *hashes = &hashScratch[0];
+    float *values = &valueScratch[0];
 
     // init hashes and values to INT_MIN to start
     for (int i = 0; i < _numhashes; i++)
@@ -157,11 +188,6 @@ int* DensifiedWtaHash::getHash(int* indices, float* data, int dataLen)
         }
         hashArray[i] = next;
     }
-
-    delete[] hashes;
-    delete[] values;
-
-    return hashArray;
 }
 
 
@@ -171,8 +197,17 @@ int DensifiedWtaHash::getRandDoubleHash(int binid, int count) {
 }
 
 
+// key of the stream the parameters were drawn from
+uint64_t DensifiedWtaHash::key() const
+{
+    return _key;
+}
+
+
 DensifiedWtaHash::~DensifiedWtaHash()
 {
     delete[] _randHash;
     delete[] _indices;
+    delete[] _pos;
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, -(long long) footprint(_numhashes, _rangePow));
 }
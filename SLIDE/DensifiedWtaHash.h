@@ -8,6 +8,7 @@
 #include <vector>
 #include <string.h>
 #include "MurmurHash.h"
+#include "Random.h"
 /*
 *  Algorithm from the paper Densified Winner Take All (WTA) Hashing for Sparse Datasets. Beidi Chen, Anshumali Shrivastava
 */
@@ -16,10 +17,16 @@ class DensifiedWtaHash
 {
 private:
     int *_randHash, _randa, _numhashes, _rangePow,_lognumhash, *_indices, *_pos, _permute;
+    uint64_t _key;
+    int _ledgerLayer;
 public:
-    DensifiedWtaHash(int numHashes, int noOfBitsToHash);
+    DensifiedWtaHash(int numHashes, int noOfBitsToHash, CounterRng gen = rngStream(RNG_DWTA, nextStreamId(RNG_DWTA)));
+    static size_t footprint(int numHashes, int noOfBitsToHash);
+    uint64_t key() const;
     int * getHash(int* indices, float* data, int dataLen);
+    void getHash(int* indices, float* data, int dataLen, int* hashArray);
     int getRandDoubleHash(int binid, int count);
     int * getHashEasy(float* data, int dataLen, int topK);
+    void getHashEasy(float* data, int dataLen, int topK, int* hashArray);
     ~DensifiedWtaHash();
 };
\ No newline at end of file
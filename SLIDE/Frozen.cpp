@@ -0,0 +1,92 @@
+#include "Frozen.h"
+#include "Config.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const size_t FROZEN_PAGE = 4096;
+
+
+size_t frozenAlign(size_t offset)
+{
+    return (offset + FROZEN_PAGE - 1) / FROZEN_PAGE * FROZEN_PAGE;
+}
+
+
+bool frozenWrite(int fd, const void* data, size_t bytes, size_t offset)
+{
+    const char* p = (const char*) data;
+    while (bytes > 0) {
+        ssize_t n = pwrite(fd, p, bytes, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        offset += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+// the whole file, read-only and shared with every other process mapping it; NULL on failure
+void* frozenMap(const char* file, size_t* bytes)
+{
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        cout << "Could not open frozen model " << file << ": " << strerror(errno) << endl;
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cout << "Could not map frozen model " << file << ": " << strerror(errno) << endl;
+        return NULL;
+    }
+    *bytes = st.st_size;
+    return map;
+}
+
+
+// the file is a frozen model this build can use: magic, settings and section bounds
+bool frozenCheck(const void* map, size_t bytes)
+{
+    const FrozenHeader* header = (const FrozenHeader*) map;
+    if (bytes < sizeof(FrozenHeader) || memcmp(header->_magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC)) != 0) {
+        cout << "Not a frozen model" << endl;
+        return false;
+    }
+    if (header->_hashFunction != HashFunction || header->_bucketSize != BUCKETSIZE || header->_binsize != binsize || header->_fifo != FIFO) {
+        cout << "Frozen model built with HashFunction " << header->_hashFunction << ", BUCKETSIZE " << header->_bucketSize
+             << ", binsize " << header->_binsize << ", FIFO " << header->_fifo << "; this build differs (Config.h)" << endl;
+        return false;
+    }
+    const FrozenLayer* layers = (const FrozenLayer*) (header + 1);
+    if (bytes < sizeof(FrozenHeader) + header->_layers * sizeof(FrozenLayer)) {
+        cout << "Frozen model is truncated" << endl;
+        return false;
+    }
+    for (uint32_t l = 0; l < header->_layers; l++) {
+        const FrozenLayer& layer = layers[l];
+        size_t buckets = (size_t) layer._L << layer._rangePow;
+        if (layer._weights + layer._nodes * layer._inputs * sizeof(float) > bytes
+                || layer._bias + layer._nodes * sizeof(float) > bytes
+                || layer._randNode + layer._nodes * sizeof(int) > bytes
+                || layer._counts + buckets * sizeof(int) > bytes
+                || layer._slab + buckets * BUCKETSIZE * sizeof(int) > bytes) {
+            cout << "Frozen model is truncated at layer " << l << endl;
+            return false;
+        }
+    }
+    return true;
+}
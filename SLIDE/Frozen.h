@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+*  Frozen inference model (FrozenModel config key, Network::exportFrozen): one file with every
+*  layer's weights, biases, random node order and LSH tables (bucket ids and sizes), each section
+*  page aligned so the file is mapped read-only and used in place (Network(frozenFile, batchsize)).
+*  Hashers are stored as the key of the stream they were drawn from and redrawn on load, which is
+*  cheap next to hashing every node. Adam state is left out. Empty buckets are not written, so the
+*  tables take disk space only for what they hold. Processes mapping the same file share its pages.
+*/
+const char FROZEN_MAGIC[8] = {'S', 'L', 'I', 'D', 'E', 'F', 'Z', '1'};
+
+struct FrozenHeader
+{
+    char _magic[8];
+    uint32_t _layers;
+    int32_t _inputDim;
+    // compile-time settings the tables and hashes depend on, checked on load
+    int32_t _hashFunction, _bucketSize, _binsize, _fifo;
+};
+
+struct FrozenLayer
+{
+    uint64_t _nodes, _inputs;
+    int32_t _type, _K, _L, _rangePow;
+    float _sparsity, _inferenceSparsity;
+    int32_t _columnMajor; // weights feature-major, see Layer::computeColumnActivations
+    uint64_t _hasherKey, _lshKey;
+    // file offsets of the sections
+    uint64_t _weights, _bias, _randNode, _slab, _counts;
+};
+
+size_t frozenAlign(size_t offset);
+bool frozenWrite(int fd, const void* data, size_t bytes, size_t offset);
+void* frozenMap(const char* file, size_t* bytes);
+bool frozenCheck(const void* map, size_t bytes);
@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+
+/*
+*  Per-request state of the read-only inference path (Network::predictTopK with a context): every
+*  sample's active node ids, values and count per layer, and its softmax normalization. Network only
+*  reads its own state on this path, so any number of threads may query one Network at once, each
+*  with its own context, at any batch size. A context is reused across requests and only grows.
+*/
+struct InferenceSample
+{
+    std::vector<std::vector<int> > _nodes;    // per layer output, sized with Layer::maxActiveNodes
+    std::vector<std::vector<float> > _values;
+    std::vector<int*> _nodePointers;          // [0] is the request's input, then the buffers above
+    std::vector<float*> _valuePointers;
+    std::vector<int> _sizes;
+    float _normalization;
+};
+
+struct InferenceContext
+{
+    std::vector<InferenceSample> _samples;
+};
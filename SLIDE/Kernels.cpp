@@ -0,0 +1,236 @@
+#include "Kernels.h"
+#include <immintrin.h>
+
+/*
+* Each kernel has a portable version and AVX2/AVX-512 versions compiled with target attributes,
+* so the build does not need -mavx2/-mavx512f; the widest one the CPU supports is picked on first use.
+*/
+
+static float dotScalar(const float* x, const float* y, int n)
+{
+    float total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        total += x[i] * y[i];
+    }
+    return total;
+}
+
+
+static float dotGatherScalar(const float* weights, const int* indices, const float* values, int n)
+{
+    float total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        total += weights[indices[i]] * values[i];
+    }
+    return total;
+}
+
+
+static void axpyScalar(float alpha, const float* x, float* y, int n)
+{
+#pragma omp simd
+    for (int i = 0; i < n; i++)
+    {
+        y[i] += alpha * x[i];
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static float hsum256(__m256 v)
+{
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+
+
+__attribute__((target("avx2,fma")))
+static float dotAvx2(const float* x, const float* y, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+    }
+    float total = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++)
+    {
+        total += x[i] * y[i];
+    }
+    return total;
+}
+
+
+__attribute__((target("avx2,fma")))
+static float dotGatherAvx2(const float* weights, const int* indices, const float* values, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i idx = _mm256_loadu_si256((const __m256i*) (indices + i));
+        __m256 w = _mm256_i32gather_ps(weights, idx, 4);
+        acc = _mm256_fmadd_ps(w, _mm256_loadu_ps(values + i), acc);
+    }
+    float total = hsum256(acc);
+    for (; i < n; i++)
+    {
+        total += weights[indices[i]] * values[i];
+    }
+    return total;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void axpyAvx2(float alpha, const float* x, float* y, int n)
+{
+    __m256 a = _mm256_set1_ps(alpha);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++)
+    {
+        y[i] += alpha * x[i];
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static float dotAvx512(const float* x, const float* y, int n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1);
+    }
+    if (i + 16 <= n)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+        i += 16;
+    }
+    if (i < n)
+    {
+        __mmask16 mask = (__mmask16) ((1 << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+
+__attribute__((target("avx512f")))
+static float dotGatherAvx512(const float* weights, const int* indices, const float* values, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i idx = _mm512_loadu_si512((const void*) (indices + i));
+        __m512 w = _mm512_i32gather_ps(idx, weights, 4);
+        acc = _mm512_fmadd_ps(w, _mm512_loadu_ps(values + i), acc);
+    }
+    if (i < n)
+    {
+        __mmask16 mask = (__mmask16) ((1 << (n - i)) - 1);
+        __m512i idx = _mm512_maskz_loadu_epi32(mask, indices + i);
+        __m512 w = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx, weights, 4);
+        acc = _mm512_fmadd_ps(w, _mm512_maskz_loadu_ps(mask, values + i), acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+
+__attribute__((target("avx512f")))
+static void axpyAvx512(float alpha, const float* x, float* y, int n)
+{
+    __m512 a = _mm512_set1_ps(alpha);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    if (i < n)
+    {
+        __mmask16 mask = (__mmask16) ((1 << (n - i)) - 1);
+        __m512 r = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+        _mm512_mask_storeu_ps(y + i, mask, r);
+    }
+}
+
+
+struct KernelTable {
+    float (*_dot)(const float*, const float*, int);
+    float (*_dotGather)(const float*, const int*, const float*, int);
+    void (*_axpy)(float, const float*, float*, int);
+    const char* _name;
+
+    KernelTable()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            _dot = dotAvx512;
+            _dotGather = dotGatherAvx512;
+            _axpy = axpyAvx512;
+            _name = "avx512";
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            _dot = dotAvx2;
+            _dotGather = dotGatherAvx2;
+            _axpy = axpyAvx2;
+            _name = "avx2";
+        } else {
+            _dot = dotScalar;
+            _dotGather = dotGatherScalar;
+            _axpy = axpyScalar;
+            _name = "scalar";
+        }
+    }
+};
+
+
+static const KernelTable& kernels()
+{
+    static KernelTable table;
+    return table;
+}
+
+
+float dot(const float* x, const float* y, int n)
+{
+    return kernels()._dot(x, y, n);
+}
+
+
+float dotGather(const float* weights, const int* indices, const float* values, int n)
+{
+    return kernels()._dotGather(weights, indices, values, n);
+}
+
+
+// y += alpha * x
+void axpy(float alpha, const float* x, float* y, int n)
+{
+    kernels()._axpy(alpha, x, y, n);
+}
+
+
+const char* kernelName()
+{
+    return kernels()._name;
+}
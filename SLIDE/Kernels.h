@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+*  Small dense float kernels used by the layer hot paths, dispatched at runtime to
+*  AVX-512, AVX2/FMA or portable code.
+*/
+float dot(const float* x, const float* y, int n);
+float dotGather(const float* weights, const int* indices, const float* values, int n);
+void axpy(float alpha, const float* x, float* y, int n);
+const char* kernelName();
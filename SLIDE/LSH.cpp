@@ -1,29 +1,52 @@
 #include <iostream>
 #include <unordered_map>
 #include "LSH.h"
+#include "Arena.h"
 #include <climits>
 #include "Config.h"
+#include "Random.h"
+#include "Ledger.h"
 #include <chrono>
+#include <cstring>
 
 using namespace std;
 
-LSH::LSH(int K, int L, int RangePow)
+
+// for the memory ledger: the ids of all buckets, and the Bucket objects, table pointers and index hash constants
+size_t LSH::slabBytes(int L, int RangePow)
+{
+	return sizeof(int) * BUCKETSIZE * ((size_t) L << RangePow);
+}
+
+
+size_t LSH::bucketBytes(int K, int L, int RangePow)
+{
+	return sizeof(Bucket) * ((size_t) L << RangePow) + sizeof(Bucket*) * L + sizeof(int) * K * L;
+}
+
+
+LSH::LSH(int K, int L, int RangePow, CounterRng gen)
 {
 	_K = K;
 	_L = L;
 	_RangePow = RangePow;
 	_bucket = new Bucket*[L];
+	_slab = (int*) arenaAlloc(sizeof(int) * BUCKETSIZE * ((size_t) L << _RangePow), ARENA_LSH);
 
 //#pragma omp parallel for
 	for (int i = 0; i < L; i++)
 	{
 		_bucket[i] = new Bucket[1 << _RangePow];
+		for (int b = 0; b < 1 << _RangePow; b++)
+		{
+			_bucket[i][b].setStorage(_slab + ((size_t) i << _RangePow) * BUCKETSIZE + (size_t) b * BUCKETSIZE);
+		}
 	}
 
+	_frozen = false;
+	_key = gen.key();
 	rand1 = new int[_K*_L];
 
-	std::random_device rd;
-	std::mt19937 gen(rd());
 	std::uniform_int_distribution<> dis(1, INT_MAX);
 
 //#pragma omp parallel for
@@ -33,6 +56,84 @@ LSH::LSH(int K, int L, int RangePow)
 		if (rand1[i] % 2 == 0)
 			rand1[i]++;
 	}
+	_ledgerLayer = ledgerLayer();
+	ledgerCharge(_ledgerLayer, LEDGER_LSH_SLAB, slabBytes(_L, _RangePow));
+	ledgerCharge(_ledgerLayer, LEDGER_LSH_BUCKETS, bucketBytes(_K, _L, _RangePow));
+}
+
+
+/*
+* Tables of a frozen model: slab and counts are the mapped sections written by exportBuckets,
+* the index hash is redrawn from its stream key.
+*/
+LSH::LSH(int K, int L, int RangePow, uint64_t key, int* slab, const int* counts)
+{
+	_K = K;
+	_L = L;
+	_RangePow = RangePow;
+	_frozen = true;
+	_key = key;
+	_slab = slab;
+	_bucket = new Bucket*[L];
+	for (int i = 0; i < L; i++)
+	{
+		_bucket[i] = new Bucket[1 << _RangePow];
+		for (int b = 0; b < 1 << _RangePow; b++)
+		{
+			size_t bucket = ((size_t) i << _RangePow) + b;
+			_bucket[i][b].restore(_slab + bucket * BUCKETSIZE, counts[bucket]);
+		}
+	}
+
+	rand1 = new int[_K*_L];
+	CounterRng gen(key);
+	std::uniform_int_distribution<> dis(1, INT_MAX);
+	for (int i = 0; i < _K*_L; i++)
+	{
+		rand1[i] = dis(gen);
+		if (rand1[i] % 2 == 0)
+			rand1[i]++;
+	}
+	// the slab is the frozen model's
+	_ledgerLayer = ledgerLayer();
+	ledgerCharge(_ledgerLayer, LEDGER_LSH_BUCKETS, bucketBytes(_K, _L, _RangePow));
+}
+
+
+uint64_t LSH::key() const
+{
+	return _key;
+}
+
+
+// buckets of all tables, table i's bucket b being number (i << RangePow) + b
+size_t LSH::buckets() const
+{
+	return (size_t) _L << _RangePow;
+}
+
+
+/*
+* Copies buckets [first, first + count) into slab (BUCKETSIZE ids each, terminated with -1 where
+* not full, as getAll would) and their sizes into counts. Returns how many are not empty; the ids of
+* empty buckets are left as they were.
+*/
+size_t LSH::exportBuckets(size_t first, size_t count, int* slab, int* counts) const
+{
+	size_t used = 0;
+	for (size_t c = 0; c < count; c++)
+	{
+		Bucket& bucket = _bucket[(first + c) >> _RangePow][(first + c) & ((1 << _RangePow) - 1)];
+		int size = bucket.getSize();
+		counts[c] = size;
+		if (size == 0)
+			continue;
+		used++;
+		memcpy(slab + c * BUCKETSIZE, _slab + (first + c) * BUCKETSIZE, sizeof(int) * BUCKETSIZE);
+		if (size < BUCKETSIZE)
+			slab[c * BUCKETSIZE + size] = -1;
+	}
+	return used;
 }
 
 
@@ -40,9 +141,10 @@ void LSH::clear()
 {
     for (int i = 0; i < _L; i++)
     {
-    	delete[] _bucket[i];
-    	_bucket[i] = new Bucket[1 << _RangePow];
-
+    	for (int b = 0; b < 1 << _RangePow; b++)
+    	{
+    		_bucket[i][b].reset();
+    	}
     }
 }
 
@@ -65,8 +167,14 @@ void LSH::count()
 
 int* LSH::hashesToIndex(int * hashes)
 {
-
 	int * indices = new int[_L];
+	hashesToIndex(hashes, indices);
+	return indices;
+}
+
+
+void LSH::hashesToIndex(int * hashes, int * indices)
+{
 	for (int i = 0; i < _L; i++)
 	{
 		unsigned int index = 0;
@@ -94,20 +202,23 @@ int* LSH::hashesToIndex(int * hashes)
 		}
 		indices[i] = index;
 	}
-
-	return indices;
 }
 
 
 int* LSH::add(int *indices, int id)
 {
 	int * secondIndices = new int[_L];
+	add(indices, id, secondIndices);
+	return secondIndices;
+}
+
+
+void LSH::add(int *indices, int id, int *secondIndices)
+{
 	for (int i = 0; i < _L; i++)
 	{
 		secondIndices[i] = _bucket[i][indices[i]].add(id);
 	}
-
-	return secondIndices;
 }
 
 
@@ -124,12 +235,17 @@ int LSH::add(int tableId, int indices, int id)
 int** LSH::retrieveRaw(int *indices)
 {
 	int ** rawResults = new int*[_L];
+	retrieveRaw(indices, rawResults);
+	return rawResults;
+}
 
+
+void LSH::retrieveRaw(int *indices, int **rawResults)
+{
 	for (int i = 0; i < _L; i++)
 	{
 		rawResults[i] = _bucket[i][indices[i]].getAll();
 	}
-	return rawResults;
 }
 
 
@@ -146,4 +262,9 @@ LSH::~LSH()
 	 	delete[] _bucket[i];
 	 }
 	 delete[] _bucket;
+	 if (!_frozen) {
+	 	arenaFree(_slab);
+	 	ledgerCharge(_ledgerLayer, LEDGER_LSH_SLAB, -(long long) slabBytes(_L, _RangePow));
+	 }
+	 ledgerCharge(_ledgerLayer, LEDGER_LSH_BUCKETS, -(long long) bucketBytes(_K, _L, _RangePow));
 }
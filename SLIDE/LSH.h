@@ -1,23 +1,38 @@
 #pragma once
 #include "Bucket.h"
+#include "Random.h"
 #include <random>
+#include <stdint.h>
 
 class LSH {
 private:
 	Bucket ** _bucket;
+	int *_slab;
 	int _K;
 	int _L;
 	int _RangePow;
 	int *rand1;
+	uint64_t _key;
+	bool _frozen; // buckets live in a read-only frozen model
+	int _ledgerLayer;
 
 
 public:
-	LSH(int K, int L, int RangePow);
+	LSH(int K, int L, int RangePow, CounterRng gen = rngStream(RNG_LSH, nextStreamId(RNG_LSH)));
+	LSH(int K, int L, int RangePow, uint64_t key, int* slab, const int* counts);
+	static size_t slabBytes(int L, int RangePow);
+	static size_t bucketBytes(int K, int L, int RangePow);
+	uint64_t key() const;
+	size_t buckets() const;
+	size_t exportBuckets(size_t first, size_t count, int* slab, int* counts) const;
 	void clear();
 	int* add(int *indices, int id);
+	void add(int *indices, int id, int *secondIndices);
 	int add(int indices, int tableId, int id);
 	int * hashesToIndex(int * hashes);
+	void hashesToIndex(int * hashes, int * indices);
 	int** retrieveRaw(int *indices);
+	void retrieveRaw(int *indices, int **rawResults);
 	int retrieve(int table, int indices, int bucket);
 	void count();
 	~LSH();
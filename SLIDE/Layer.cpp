@@ -5,17 +5,38 @@
 #include <map>
 #include <climits>
 #include "Config.h"
-#include <bitset>
+#include "Numa.h"
+#include "Arena.h"
+#include "Kernels.h"
+#include "Random.h"
+#include "Timing.h"
+#include "Ledger.h"
+#include <new>
 #include <fstream>
 #include <omp.h>
+#include <cstring>
 
 using namespace std;
 
 
+// one row per node, placed by partition in NUMA mode (shared parameters are placed by their creator)
+static void* allocNodeRows(size_t rows, size_t rowBytes, ArenaTag tag)
+{
+    void* ptr = arenaAlloc(rows * rowBytes, tag);
+    if (NUMA && !arenaAttached(ptr))
+        numaPlaceRows(ptr, rows, rowBytes);
+    return ptr;
+}
+
+
 Layer::Layer(size_t noOfNodes, int previousLayerNumOfNodes, int layerID, NodeType type, int batchsize,  int K, int L, int RangePow, float Sparsity, float* weights, float* bias, float *adamAvgMom, float *adamAvgVel) {
+    LedgerScope ledger(layerID);
     _layerID = layerID;
+    _shard = -1;
+    _negativeMode = NEGATIVES_UNIFORM;
+    _negativePower = 1;
     _noOfNodes = noOfNodes;
-    _Nodes = new Node[noOfNodes];
+    _Nodes = (Node*) arenaAlloc(sizeof(Node) * noOfNodes, ARENA_NODES);
     _type = type;
     _noOfActive = floor(_noOfNodes * Sparsity);
     _K = K;
@@ -30,25 +51,26 @@ Layer::Layer(size_t noOfNodes, int previousLayerNumOfNodes, int layerID, NodeTyp
         _randNode[n] = n;
     }
 
-    std::random_shuffle(_randNode, _randNode + _noOfNodes);
+    CounterRng order = rngStream(RNG_NODE_ORDER, nextStreamId(RNG_NODE_ORDER));
+    std::shuffle(_randNode, _randNode + _noOfNodes, order);
 
 //TODO: Initialize Hash Tables and add the nodes. Done by Beidi
     _hashTables = new LSH(_K, _L, RangePow);
-
-    if (HashFunction == 1) {
-        _wtaHasher = new WtaHash(_K * _L, previousLayerNumOfNodes);
-    } else if (HashFunction == 2) {
-        _binids = new int[previousLayerNumOfNodes];
-        _dwtaHasher = new DensifiedWtaHash(_K * _L, previousLayerNumOfNodes);
-    } else if (HashFunction == 3) {
-        _binids = new int[previousLayerNumOfNodes];
-        _MinHasher = new DensifiedMinhash(_K * _L, previousLayerNumOfNodes);
-        _MinHasher->getMap(previousLayerNumOfNodes, _binids);
-    } else if (HashFunction == 4) {
-        _srp = new SparseRandomProjection(previousLayerNumOfNodes, _K * _L, Ratio);
-    }
-
-    if (LOADWEIGHT) {
+    _wtaHasher = NULL;
+    _dwtaHasher = NULL;
+    _MinHasher = NULL;
+    _srp = NULL;
+    _binids = NULL;
+    drawHashers(NULL);
+
+    // a dense first layer keeps its weights feature-major: one contiguous column of _noOfNodes per input feature
+    _columnMajor = FIRST_LAYER_COLUMN_MAJOR && layerID == 0 && Sparsity == 1;
+
+    // saved parameters are used in place, the caller keeps them alive. A column-major layer, or one
+    // whose parameters are shared between workers, copies them into the arena instead.
+    _loaded = weights != NULL && !_columnMajor && !arenaSharing();
+    _frozen = false;
+    if (_loaded) {
         _weights = weights;
         _bias = bias;
 
@@ -58,74 +80,347 @@ Layer::Layer(size_t noOfNodes, int previousLayerNumOfNodes, int layerID, NodeTyp
         }
 
     }else{
-        _weights = new float[_noOfNodes * previousLayerNumOfNodes]();
-        _bias = new float[_noOfNodes];
-        random_device rd;
-        default_random_engine dre(rd());
-        normal_distribution<float> distribution(0.0, 0.01);
-
-        generate(_weights, _weights + _noOfNodes * previousLayerNumOfNodes, [&] () { return distribution(dre); });
-        generate(_bias, _bias + _noOfNodes, [&] () { return distribution(dre); });
-
-
+        _weights = (float*) allocNodeRows(_noOfNodes, previousLayerNumOfNodes * sizeof(float), ARENA_WEIGHTS);
+        _bias = (float*) arenaAlloc(sizeof(float) * _noOfNodes, ARENA_WEIGHTS);
         if (ADAM)
         {
-            _adamAvgMom = new float[_noOfNodes * previousLayerNumOfNodes]();
-            _adamAvgVel = new float[_noOfNodes * previousLayerNumOfNodes]();
+            _adamAvgMom = (float*) allocNodeRows(_noOfNodes, previousLayerNumOfNodes * sizeof(float), ARENA_ADAM);
+            _adamAvgVel = (float*) allocNodeRows(_noOfNodes, previousLayerNumOfNodes * sizeof(float), ARENA_ADAM);
 
         }
+
+        // a worker attaching to shared parameters keeps the creator's initialization
+        if (!arenaAttached(_weights) && weights) {
+            copyIn(weights, _weights);
+            memcpy(_bias, bias, sizeof(float) * _noOfNodes);
+            if (ADAM) {
+                copyIn(adamAvgMom, _adamAvgMom);
+                copyIn(adamAvgVel, _adamAvgVel);
+            }
+        } else if (!arenaAttached(_weights)) {
+            CounterRng dre = rngStream(RNG_WEIGHTS, _layerID);
+            normal_distribution<float> distribution(0.0, 0.01);
+            generate(_weights, _weights + _noOfNodes * previousLayerNumOfNodes, [&] () { return distribution(dre); });
+            generate(_bias, _bias + _noOfNodes, [&] () { return distribution(dre); });
+        }
+    }
+
+    _t = NULL;
+    _tPending = NULL;
+    if (ADAM) {
+        _t = (float*) allocNodeRows(_noOfNodes, previousLayerNumOfNodes * sizeof(float), ARENA_GRADS);
+        if (UPDATE_STALENESS && !_columnMajor)
+            _tPending = (float*) allocNodeRows(_noOfNodes, previousLayerNumOfNodes * sizeof(float), ARENA_GRADS);
     }
 
     auto t1 = std::chrono::high_resolution_clock::now();
 
-    _train_array = new train[noOfNodes*batchsize];
+    _train_array = (train*) allocNodeRows(noOfNodes, batchsize * sizeof(train), ARENA_TRAIN);
 
     // create nodes for this layer
 #pragma omp parallel for
     for (size_t i = 0; i < noOfNodes; i++)
     {
+        new (&_Nodes[i]) Node();
+        if (_columnMajor) {
+            // no per-node rows; the layer does the weight math, and a dense layer is never queried from the tables
+            _Nodes[i].Update(previousLayerNumOfNodes, i, _layerID, type, batchsize, NULL, _bias[i], NULL, NULL, NULL, _train_array);
+            continue;
+        }
         _Nodes[i].Update(previousLayerNumOfNodes, i, _layerID, type, batchsize, _weights+previousLayerNumOfNodes*i,
-                _bias[i], _adamAvgMom+previousLayerNumOfNodes*i , _adamAvgVel+previousLayerNumOfNodes*i, _train_array);
+                _bias[i], _adamAvgMom+previousLayerNumOfNodes*i , _adamAvgVel+previousLayerNumOfNodes*i,
+                _t+previousLayerNumOfNodes*i, _train_array);
+        if (_tPending)
+            _Nodes[i]._tPending = _tPending + previousLayerNumOfNodes*i;
         addtoHashTable(_Nodes[i]._weights, previousLayerNumOfNodes, *_Nodes[i]._bias, i);
     }
+    if (seedFixed() && !_columnMajor) {
+        for (size_t i = 0; i < noOfNodes; i++)
+            _Nodes[i]._indicesInBuckets = _hashTables->add(_Nodes[i]._indicesInTables, i + 1);
+        _rehashIndices.resize(noOfNodes * _L);
+    }
     auto t2 = std::chrono::high_resolution_clock::now();
     auto timeDiffInMiliseconds = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
     std::cout<< noOfNodes<<" "<<1.0 * timeDiffInMiliseconds<<std::endl;
 
+    _numaLocal = 0;
+    _numaRemote = 0;
+    _unionSlot = NULL;
+    if (NUMA) {
+        std::cout << "NUMA layer " << _layerID << ": " << numaPlacementRatio(_weights, _noOfNodes, previousLayerNumOfNodes * sizeof(float)) * 100
+                  << "% of weight pages on their partition's node" << std::endl;
+    }
+
     if (type == NodeType::Softmax)
     {
         _normalizationConstants = new float[batchsize]();
     }
+    chargeLedger(1);
+}
+
+
+/*
+* Layer of a frozen model (Frozen.h): weights, biases, node order and tables are used in place from
+* the read-only map, only the hashers are redrawn from their keys. Nothing is hashed, and no
+* Adam state or gradients exist, so such a layer only serves the inference path.
+*/
+Layer::Layer(const FrozenLayer& frozen, char* map, int layerID, int batchsize)
+{
+    LedgerScope ledger(layerID);
+    _layerID = layerID;
+    _shard = -1;
+    _negativeMode = NEGATIVES_UNIFORM;
+    _negativePower = 1;
+    _noOfNodes = frozen._nodes;
+    _type = (NodeType) frozen._type;
+    _noOfActive = floor(_noOfNodes * frozen._sparsity);
+    _K = frozen._K;
+    _L = frozen._L;
+    _batchsize = batchsize;
+    _RangeRow = frozen._rangePow;
+    _previousLayerNumOfNodes = frozen._inputs;
+    _columnMajor = frozen._columnMajor;
+    _loaded = true;
+    _frozen = true;
+
+    _randNode = (int*) (map + frozen._randNode);
+    _weights = (float*) (map + frozen._weights);
+    _bias = (float*) (map + frozen._bias);
+    _adamAvgMom = NULL;
+    _adamAvgVel = NULL;
+    _t = NULL;
+    _tPending = NULL;
+
+    _hashTables = new LSH(_K, _L, _RangeRow, frozen._lshKey, (int*) (map + frozen._slab), (int*) (map + frozen._counts));
+    _wtaHasher = NULL;
+    _dwtaHasher = NULL;
+    _MinHasher = NULL;
+    _srp = NULL;
+    _binids = NULL;
+    drawHashers(&frozen._hasherKey);
+
+    _Nodes = (Node*) arenaAlloc(sizeof(Node) * _noOfNodes, ARENA_NODES);
+    _train_array = (train*) arenaAlloc(_noOfNodes * batchsize * sizeof(train), ARENA_TRAIN);
+#pragma omp parallel for
+    for (size_t i = 0; i < _noOfNodes; i++)
+    {
+        new (&_Nodes[i]) Node();
+        float* weights = _columnMajor ? NULL : _weights + (size_t) _previousLayerNumOfNodes * i;
+        _Nodes[i].Update(_previousLayerNumOfNodes, i, _layerID, _type, batchsize, weights, _bias[i], NULL, NULL, NULL, _train_array);
+    }
+
+    _numaLocal = 0;
+    _numaRemote = 0;
+    _unionSlot = NULL;
+    _normalizationConstants = NULL;
+    if (_type == NodeType::Softmax)
+    {
+        _normalizationConstants = new float[batchsize]();
+    }
+    chargeLedger(1);
+}
+
+
+/*
+* What this layer's own buffers add to the memory ledger (sign 1), or take from it when freed (-1);
+* the tables and hashers charge themselves. Loaded parameters are counted although the checkpoint
+* holds them, a frozen model's mapped sections are not. Layer::footprint has the same sizes.
+*/
+void Layer::chargeLedger(int sign) const
+{
+    long long rows = (long long) _noOfNodes * _previousLayerNumOfNodes * sizeof(float);
+    if (!_frozen)
+        ledgerCharge(_layerID, LEDGER_WEIGHTS, sign * (rows + (long long) _noOfNodes * sizeof(float)));
+    if (ADAM && !_frozen)
+        ledgerCharge(_layerID, LEDGER_ADAM, sign * 2 * rows);
+    ledgerCharge(_layerID, LEDGER_GRADS, sign * rows * ((_t != NULL) + (_tPending != NULL)));
+    ledgerCharge(_layerID, LEDGER_TRAIN, sign * (long long) (_noOfNodes * _batchsize * sizeof(train)));
+    // node objects, the random node order, and the table and bucket indices of the nodes in the tables
+    long long nodes = sizeof(Node) * _noOfNodes;
+    if (!_frozen)
+        nodes += sizeof(int) * _noOfNodes;
+    if (!_frozen && !_columnMajor)
+        nodes += 2 * sizeof(int) * _L * _noOfNodes;
+    nodes += sizeof(int) * _rehashIndices.size();
+    ledgerCharge(_layerID, LEDGER_NODES, sign * nodes);
+}
+
+
+// the memory ledger of a layer built with these arguments, for runme --dry-run
+void Layer::footprint(size_t noOfNodes, int previousLayerNumOfNodes, int layerID, int batchsize, int K, int L, int RangePow, float Sparsity, size_t bytes[LEDGER_CATEGORIES])
+{
+    bool columnMajor = FIRST_LAYER_COLUMN_MAJOR && layerID == 0 && Sparsity == 1;
+    size_t rows = noOfNodes * previousLayerNumOfNodes * sizeof(float);
+    memset(bytes, 0, sizeof(size_t) * LEDGER_CATEGORIES);
+    bytes[LEDGER_WEIGHTS] = rows + noOfNodes * sizeof(float);
+    if (ADAM) {
+        bytes[LEDGER_ADAM] = 2 * rows;
+        bytes[LEDGER_GRADS] = UPDATE_STALENESS && !columnMajor ? 2 * rows : rows;
+    }
+    bytes[LEDGER_TRAIN] = noOfNodes * batchsize * sizeof(train);
+    bytes[LEDGER_NODES] = (sizeof(Node) + sizeof(int)) * noOfNodes;
+    if (!columnMajor)
+        bytes[LEDGER_NODES] += (seedFixed() ? 3 : 2) * sizeof(int) * L * noOfNodes;
+    bytes[LEDGER_LSH_SLAB] = LSH::slabBytes(L, RangePow);
+    bytes[LEDGER_LSH_BUCKETS] = LSH::bucketBytes(K, L, RangePow);
+    if (HashFunction == 1)
+        bytes[LEDGER_HASHERS] = WtaHash::footprint(K * L, previousLayerNumOfNodes);
+    else if (HashFunction == 2)
+        bytes[LEDGER_HASHERS] = DensifiedWtaHash::footprint(K * L, previousLayerNumOfNodes) + sizeof(int) * previousLayerNumOfNodes;
+    else if (HashFunction == 3)
+        bytes[LEDGER_HASHERS] = DensifiedMinhash::footprint(K * L, previousLayerNumOfNodes) + sizeof(int) * previousLayerNumOfNodes;
+    else if (HashFunction == 4)
+        bytes[LEDGER_HASHERS] = SparseRandomProjection::footprint(previousLayerNumOfNodes, K * L, Ratio);
+}
+
+
+// key of the stream the current hasher was drawn from
+uint64_t Layer::hasherKey() const
+{
+    if (HashFunction == 1)
+        return _wtaHasher->key();
+    if (HashFunction == 2)
+        return _dwtaHasher->key();
+    if (HashFunction == 3)
+        return _MinHasher->key();
+    return _srp->key();
+}
+
+
+/*
+* Writes this layer's sections of a frozen model from offset on and describes them in frozen;
+* returns the offset after them. Tables are written in blocks, leaving holes for blocks without ids.
+*/
+size_t Layer::exportFrozen(int fd, size_t offset, FrozenLayer* frozen) const
+{
+    frozen->_nodes = _noOfNodes;
+    frozen->_inputs = _previousLayerNumOfNodes;
+    frozen->_type = _type;
+    frozen->_K = _K;
+    frozen->_L = _L;
+    frozen->_rangePow = _RangeRow;
+    frozen->_columnMajor = _columnMajor;
+    frozen->_hasherKey = hasherKey();
+    frozen->_lshKey = _hashTables->key();
+
+    bool written = true;
+    size_t weights = _noOfNodes * _previousLayerNumOfNodes * sizeof(float);
+    frozen->_weights = frozenAlign(offset);
+    written &= frozenWrite(fd, _weights, weights, frozen->_weights);
+    frozen->_bias = frozenAlign(frozen->_weights + weights);
+    written &= frozenWrite(fd, _bias, _noOfNodes * sizeof(float), frozen->_bias);
+    frozen->_randNode = frozenAlign(frozen->_bias + _noOfNodes * sizeof(float));
+    written &= frozenWrite(fd, _randNode, _noOfNodes * sizeof(int), frozen->_randNode);
+
+    size_t buckets = _hashTables->buckets();
+    frozen->_counts = frozenAlign(frozen->_randNode + _noOfNodes * sizeof(int));
+    frozen->_slab = frozenAlign(frozen->_counts + buckets * sizeof(int));
+    const size_t block = 4096;
+    vector<int> slab(block * BUCKETSIZE), counts(block);
+    for (size_t first = 0; first < buckets && written; first += block) {
+        size_t count = std::min(block, buckets - first);
+        if (_hashTables->exportBuckets(first, count, &slab[0], &counts[0]) > 0)
+            written &= frozenWrite(fd, &slab[0], count * BUCKETSIZE * sizeof(int), frozen->_slab + first * BUCKETSIZE * sizeof(int));
+        written &= frozenWrite(fd, &counts[0], count * sizeof(int), frozen->_counts + first * sizeof(int));
+    }
+    if (!written)
+        return 0;
+    return frozen->_slab + buckets * BUCKETSIZE * sizeof(int);
 }
 
 
 void Layer::updateTable()
 {
+    PHASE_SCOPE(PHASE_REHASH);
+    drawHashers(NULL);
+}
+
 
+// new hash functions, from a fresh stream or, given its key, from a saved one (frozen model, training state)
+void Layer::drawHashers(const uint64_t* key)
+{
+    LedgerScope ledger(_layerID);
+    if (_binids)
+        ledgerCharge(_layerID, LEDGER_HASHERS, -(long long) sizeof(int) * _previousLayerNumOfNodes);
+    delete _wtaHasher;
+    delete _dwtaHasher;
+    delete _MinHasher;
+    delete _srp;
+    delete [] _binids;
+    _wtaHasher = NULL;
+    _dwtaHasher = NULL;
+    _MinHasher = NULL;
+    _srp = NULL;
+    _binids = NULL;
     if (HashFunction == 1) {
-         delete _wtaHasher;
-        _wtaHasher = new WtaHash(_K * _L, _previousLayerNumOfNodes);
+        _wtaHasher = key ? new WtaHash(_K * _L, _previousLayerNumOfNodes, CounterRng(*key))
+                         : new WtaHash(_K * _L, _previousLayerNumOfNodes);
     } else if (HashFunction == 2) {
-         delete _dwtaHasher, _binids;
         _binids = new int[_previousLayerNumOfNodes];
-        _dwtaHasher = new DensifiedWtaHash(_K * _L, _previousLayerNumOfNodes);
+        _dwtaHasher = key ? new DensifiedWtaHash(_K * _L, _previousLayerNumOfNodes, CounterRng(*key))
+                          : new DensifiedWtaHash(_K * _L, _previousLayerNumOfNodes);
     } else if (HashFunction == 3) {
-
-         delete _MinHasher,  _binids;
         _binids = new int[_previousLayerNumOfNodes];
-        _MinHasher = new DensifiedMinhash(_K * _L, _previousLayerNumOfNodes);
+        _MinHasher = key ? new DensifiedMinhash(_K * _L, _previousLayerNumOfNodes, CounterRng(*key))
+                         : new DensifiedMinhash(_K * _L, _previousLayerNumOfNodes);
         _MinHasher->getMap(_previousLayerNumOfNodes, _binids);
     } else if (HashFunction == 4) {
+        _srp = key ? new SparseRandomProjection(_previousLayerNumOfNodes, _K * _L, Ratio, CounterRng(*key))
+                   : new SparseRandomProjection(_previousLayerNumOfNodes, _K * _L, Ratio);
+    }
+    if (_binids)
+        ledgerCharge(_layerID, LEDGER_HASHERS, (long long) sizeof(int) * _previousLayerNumOfNodes);
+}
 
-        _srp = new SparseRandomProjection(_previousLayerNumOfNodes, _K * _L, Ratio);
 
+void Layer::updateRandomNodes()
+{
+    CounterRng order = rngStream(RNG_NODE_ORDER, nextStreamId(RNG_NODE_ORDER));
+    std::shuffle(_randNode, _randNode + _noOfNodes, order);
+}
+
+
+void Layer::setNegativeSampling(int mode, float power)
+{
+    _negativeMode = mode;
+    _negativePower = power;
+    // counts restored from a training state (restoreState) are kept
+    if (mode == NEGATIVES_UNIFORM)
+        _labelCounts.clear();
+    else if (_labelCounts.size() != _noOfNodes)
+        _labelCounts.assign(_noOfNodes, 0);
+    else
+        rebuildNegatives();
+}
+
+
+// labels are global ids, offset is the first one this layer holds (a shard of the output layer)
+void Layer::countLabels(int* label, int labelsize, size_t offset)
+{
+    if (_labelCounts.empty())
+        return;
+    for (int k = 0; k < labelsize; k++) {
+        if (label[k] >= (long long) offset && label[k] < (long long) (offset + _noOfNodes))
+            _labelCounts[label[k] - offset]++;
     }
 }
 
 
-void Layer::updateRandomNodes()
+/*
+* Rebuilds the negatives' alias table from the labels counted so far, weighting node n by
+* count + 1 (frequency) or (count + 1)^power; the + 1 keeps classes not seen yet drawable.
+*/
+void Layer::rebuildNegatives()
 {
-    std::random_shuffle(_randNode, _randNode + _noOfNodes);
+    if (_labelCounts.empty())
+        return;
+    vector<double> weights(_noOfNodes);
+    for (size_t n = 0; n < _noOfNodes; n++) {
+        weights[n] = _labelCounts[n] + 1;
+        if (_negativeMode == NEGATIVES_POWER)
+            weights[n] = pow(weights[n], (double) _negativePower);
+    }
+    _negatives.build(weights);
 }
 
 
@@ -144,16 +439,55 @@ void Layer::addtoHashTable(float* weights, int length, float bias, int ID)
     }
 
     int * hashIndices = _hashTables->hashesToIndex(hashes);
-    int * bucketIndices = _hashTables->add(hashIndices, ID+1);
-
     _Nodes[ID]._indicesInTables = hashIndices;
-    _Nodes[ID]._indicesInBuckets = bucketIndices;
+    // with a fixed seed the constructor inserts the nodes afterwards, in node order
+    if (!seedFixed())
+        _Nodes[ID]._indicesInBuckets = _hashTables->add(hashIndices, ID+1);
 
     delete [] hashes;
 
 }
 
 
+// reinserts node ID after a rehash; unlike addtoHashTable nothing is kept, so per-thread scratch is enough
+void Layer::rehashNode(float* weights, int length, int ID)
+{
+    static thread_local vector<int> hashes, hashIndices, bucketIndices;
+    hashes.resize(_K * _L);
+    hashIndices.resize(_L);
+    bucketIndices.resize(_L);
+    if(HashFunction==1) {
+        _wtaHasher->getHash(weights, &hashes[0]);
+    }else if (HashFunction==2) {
+        _dwtaHasher->getHashEasy(weights, length, TOPK, &hashes[0]);
+    }else if (HashFunction==3) {
+        _MinHasher->getHashEasy(_binids, weights, length, TOPK, &hashes[0]);
+    }else if (HashFunction==4) {
+        _srp->getHash(weights, length, &hashes[0]);
+    }
+
+    if (seedFixed()) {
+        _hashTables->hashesToIndex(&hashes[0], &_rehashIndices[(size_t) ID * _L]);
+        return;
+    }
+    _hashTables->hashesToIndex(&hashes[0], &hashIndices[0]);
+    _hashTables->add(&hashIndices[0], ID+1, &bucketIndices[0]);
+}
+
+
+// with a fixed seed, the nodes rehashed by rehashNode go into the tables in node order
+void Layer::insertRehashed()
+{
+    if (!seedFixed())
+        return;
+    PHASE_SCOPE(PHASE_REHASH);
+    static thread_local vector<int> bucketIndices;
+    bucketIndices.resize(_L);
+    for (size_t i = 0; i < _noOfNodes; i++)
+        _hashTables->add(&_rehashIndices[i * _L], i + 1, &bucketIndices[0]);
+}
+
+
 Node* Layer::getNodebyID(size_t nodeID)
 {
     assert(("nodeID less than _noOfNodes" , nodeID < _noOfNodes));
@@ -171,6 +505,11 @@ int Layer::getNodeCount()
     return _noOfNodes;
 }
 
+int Layer::getInputCount() const
+{
+    return _previousLayerNumOfNodes;
+}
+
 float Layer::getNomalizationConstant(int inputID)
 {
     assert(("Error Call to Normalization Constant for non - softmax layer", _type == NodeType::Softmax));
@@ -179,11 +518,7 @@ float Layer::getNomalizationConstant(int inputID)
 
 
 float innerproduct(int* index1, float* value1, int len1, float* value2){
-    float total = 0;
-    for (int i=0; i<len1; i++){
-        total+=value1[i]*value2[index1[i]];
-    }
-    return total;
+    return dotGather(value2, index1, value1, len1);
 }
 
 
@@ -204,215 +539,270 @@ float collision(int* hashes, int* table_hashes, int k, int l){
 }
 
 
+// per-thread bitmap with a bit per node of the largest layer seen; users clear what they set
+static vector<uint64_t>& nodeMask(size_t nodes)
+{
+    static thread_local vector<uint64_t> mask;
+    if (mask.size() < (nodes + 63) / 64)
+        mask.resize((nodes + 63) / 64, 0);
+    return mask;
+}
+
+
+// per-thread position of the Mode 4 padding walk of every layer
+static vector<size_t>& paddingOffsets()
+{
+    static thread_local vector<size_t> offsets;
+    return offsets;
+}
+
+
+/*
+* Where the Mode 4 padding walk over _randNode starts. With a fixed seed it is a draw keyed by the
+* sample (iter), so it does not depend on the thread; otherwise each thread carries on where its
+* previous walk over this layer ended, so its consecutive samples get different padding without a draw.
+*/
+size_t Layer::paddingStart(int iter) const
+{
+    if (seedFixed() && iter >= 0)
+        return rngStream(RNG_PADDING, ((uint64_t) _layerID << 48) ^ iter)() % _noOfNodes;
+    vector<size_t>& offsets = paddingOffsets();
+    if (offsets.size() <= (size_t) _layerID)
+        offsets.resize(_layerID + 1, SIZE_MAX);
+    if (offsets[_layerID] >= _noOfNodes)
+        offsets[_layerID] = threadRng(RNG_PADDING)() % _noOfNodes;
+    return offsets[_layerID];
+}
+
+
+void Layer::paddingEnd(int iter, size_t next) const
+{
+    if (!(seedFixed() && iter >= 0))
+        paddingOffsets()[_layerID] = next;
+}
+
+
 int Layer::queryActiveNodeandComputeActivations(int** activenodesperlayer, float** activeValuesperlayer, int* lengths, int layerIndex, int inputID, int* label, int labelsize, float Sparsity, int iter)
+{
+    int in = queryActiveNodes(activenodesperlayer, activeValuesperlayer, lengths, layerIndex, inputID, label, labelsize, Sparsity, iter);
+    computeActivations(activenodesperlayer, activeValuesperlayer, lengths, layerIndex, inputID);
+    computeSoftmax(activenodesperlayer, activeValuesperlayer, lengths, layerIndex, inputID);
+    return in;
+}
+
+
+/*
+* Hashes the layer input and collects the raw bucket contents (node ids, with repeats) into candidates.
+* Hash, index and bucket pointer scratch is per thread and kept across calls.
+*/
+void Layer::retrieveCandidates(int** activenodesperlayer, float** activeValuesperlayer, int* lengths, int layerIndex, vector<int>& candidates) const
+{
+    static thread_local vector<int> hashes, hashIndices;
+    static thread_local vector<int*> actives;
+    hashes.resize(_K * _L);
+    hashIndices.resize(_L);
+    actives.resize(_L);
+
+    {
+        PHASE_SCOPE(PHASE_HASH);
+        if (HashFunction == 1) {
+            _wtaHasher->getHash(activeValuesperlayer[layerIndex], &hashes[0]);
+        } else if (HashFunction == 2) {
+            _dwtaHasher->getHash(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex],
+                                 lengths[layerIndex], &hashes[0]);
+        } else if (HashFunction == 3) {
+            _MinHasher->getHashEasy(_binids, activeValuesperlayer[layerIndex], lengths[layerIndex], TOPK, &hashes[0]);
+        } else if (HashFunction == 4) {
+            _srp->getHashSparse(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex], &hashes[0]);
+        }
+        _hashTables->hashesToIndex(&hashes[0], &hashIndices[0]);
+    }
+    PHASE_SCOPE(PHASE_RETRIEVE);
+    _hashTables->retrieveRaw(&hashIndices[0], &actives[0]);
+
+    candidates.clear();
+    for (int i = 0; i < _L; i++) {
+        if (actives[i] == NULL) {
+            continue;
+        }
+        for (int j = 0; j < BUCKETSIZE; j++) {
+            int tempID = actives[i][j] - 1;
+            if (tempID >= 0) {
+                candidates.push_back(tempID);
+            } else {
+                break;
+            }
+        }
+    }
+}
+
+
+/*
+* Upper bound on what queryActiveNodes writes for one sample with labelsize labels,
+* callers size activenodesperlayer / activeValuesperlayer [layerIndex + 1] to this.
+*/
+int Layer::maxActiveNodes(int labelsize, float Sparsity) const
+{
+    if (Sparsity == 1.0 || _columnMajor)
+        return _noOfNodes;
+    size_t len = 0;
+    if (Mode == 1) {
+        len = labelsize + (size_t) _L * BUCKETSIZE;
+    } else if (Mode == 4) {
+        len = std::max(labelsize + (size_t) _L * BUCKETSIZE, (size_t) PAD_TO);
+    } else {
+        len = floor(_noOfNodes * Sparsity);
+    }
+    return std::min(len, _noOfNodes);
+}
+
+
+/*
+* Writes the active node ids of layerIndex + 1 into activenodesperlayer[layerIndex + 1], which the
+* caller has sized with maxActiveNodes. Candidates are deduplicated by sorting per-thread buffers,
+* so nothing is allocated per sample once those have grown; the ids come out sorted as before.
+*/
+int Layer::queryActiveNodes(int** activenodesperlayer, float** activeValuesperlayer, int* lengths, int layerIndex, int inputID, int* label, int labelsize, float Sparsity, int iter) const
 {
     //LSH QueryLogic
 
     //Beidi. Query out all the candidate nodes
     int len;
     int in = 0;
+    int* out = activenodesperlayer[layerIndex + 1];
+    static thread_local vector<int> candidates, labels;
+
+    // Make sure that the true label node is in candidates
+    labels.clear();
+    if (_type == NodeType::Softmax && labelsize > 0) {
+        labels.assign(label, label + labelsize);
+        std::sort(labels.begin(), labels.end());
+        labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+    }
 
-    if(Sparsity == 1.0){
+    if(Sparsity == 1.0 || _columnMajor){
         len = _noOfNodes;
         lengths[layerIndex + 1] = len;
-        activenodesperlayer[layerIndex + 1] = new int[len]; //assuming not intitialized;
         for (int i = 0; i < len; i++)
         {
-            activenodesperlayer[layerIndex + 1][i] = i;
+            out[i] = i;
         }
     }
     else
     {
         if (Mode==1) {
-            int *hashes;
-            if (HashFunction == 1) {
-                hashes = _wtaHasher->getHash(activeValuesperlayer[layerIndex]);
-            } else if (HashFunction == 2) {
-                hashes = _dwtaHasher->getHash(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex],
-                                              lengths[layerIndex]);
-            } else if (HashFunction == 3) {
-                hashes = _MinHasher->getHashEasy(_binids, activeValuesperlayer[layerIndex], lengths[layerIndex], TOPK);
-            } else if (HashFunction == 4) {
-                hashes = _srp->getHashSparse(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex]);
-            }
-            int *hashIndices = _hashTables->hashesToIndex(hashes);
-            int **actives = _hashTables->retrieveRaw(hashIndices);
-
             // Get candidates from hashtable
-            auto t00 = std::chrono::high_resolution_clock::now();
-
-            std::map<int, size_t> counts;
-            // Make sure that the true label node is in candidates
-            if (_type == NodeType::Softmax) {
-                if (labelsize > 0) {
-                    for (int i=0; i<labelsize ;i++){
-                        counts[label[i]] = _L;
-                    }
+            retrieveCandidates(activenodesperlayer, activeValuesperlayer, lengths, layerIndex, candidates);
+            PHASE_SCOPE(PHASE_DEDUP);
+            std::sort(candidates.begin(), candidates.end());
+
+            //thresholding: a node's count is its number of hits, labels count as seen in all _L tables
+            len = 0;
+            size_t c = 0, l = 0;
+            while (c < candidates.size() || l < labels.size()) {
+                int id = (l == labels.size() || (c < candidates.size() && candidates[c] < labels[l])) ? candidates[c] : labels[l];
+                size_t count = 0;
+                for (; c < candidates.size() && candidates[c] == id; c++)
+                    count++;
+                if (l < labels.size() && labels[l] == id) {
+                    count += _L;
+                    l++;
                 }
-            }
-
-            for (int i = 0; i < _L; i++) {
-                if (actives[i] == NULL) {
-                    continue;
-                } else {
-                    for (int j = 0; j < BUCKETSIZE; j++) {
-                        int tempID = actives[i][j] - 1;
-                        if (tempID >= 0) {
-                            counts[tempID] += 1;
-                        } else {
-                            break;
-                        }
-                    }
+                if (count > THRESH) {
+                    out[len++] = id;
                 }
             }
-            auto t11 = std::chrono::high_resolution_clock::now();
-
-            //thresholding
-            auto t3 = std::chrono::high_resolution_clock::now();
-            vector<int> vect;
-            for (auto &&x : counts){
-                if (x.second>THRESH){
-                    vect.push_back(x.first);
-                }
-            }
-
-            len = vect.size();
             lengths[layerIndex + 1] = len;
-            activenodesperlayer[layerIndex + 1] = new int[len];
-
-            for (int i = 0; i < len; i++) {
-                activenodesperlayer[layerIndex + 1][i] = vect[i];
-            }
-            auto t33 = std::chrono::high_resolution_clock::now();
             in = len;
 
-            delete[] hashes;
-            delete[] hashIndices;
-            delete[] actives;
-
         }
         if (Mode==4) {
-            int *hashes;
-            if (HashFunction == 1) {
-                hashes = _wtaHasher->getHash(activeValuesperlayer[layerIndex]);
-            } else if (HashFunction == 2) {
-                hashes = _dwtaHasher->getHash(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex],
-                                              lengths[layerIndex]);
-            } else if (HashFunction == 3) {
-                hashes = _MinHasher->getHashEasy(_binids, activeValuesperlayer[layerIndex], lengths[layerIndex], TOPK);
-            } else if (HashFunction == 4) {
-                hashes = _srp->getHashSparse(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex]);
-            }
-            int *hashIndices = _hashTables->hashesToIndex(hashes);
-            int **actives = _hashTables->retrieveRaw(hashIndices);
-            // we now have a sparse array of indices of active nodes
-
-            // Get candidates from hashtable
-            std::map<int, size_t> counts;
-            // Make sure that the true label node is in candidates
-            if (_type == NodeType::Softmax && labelsize > 0) {
-                for (int i = 0; i < labelsize ;i++){
-                    counts[label[i]] = _L;
-                }
-            }
-
-            for (int i = 0; i < _L; i++) {
-                if (actives[i] == NULL) {
-                    continue;
-                } else {
-                    // copy sparse array into (dense) map
-                    for (int j = 0; j < BUCKETSIZE; j++) {
-                        int tempID = actives[i][j] - 1;
-                        if (tempID >= 0) {
-                            counts[tempID] += 1;
-                        } else {
-                            break;
+            // Get candidates from hashtable, plus the labels
+            retrieveCandidates(activenodesperlayer, activeValuesperlayer, lengths, layerIndex, candidates);
+            PHASE_SCOPE(PHASE_DEDUP);
+            candidates.insert(candidates.end(), labels.begin(), labels.end());
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            len = candidates.size();
+            std::copy(candidates.begin(), candidates.end(), out);
+            in = len;
+            if (len<PAD_BELOW){
+                // nodes already taken are marked in the thread's node mask, one bit each
+                vector<uint64_t>& mask = nodeMask(_noOfNodes);
+                for (size_t c = 0; c < candidates.size(); c++)
+                    mask[candidates[c] >> 6] |= 1ULL << (candidates[c] & 63);
+
+                // negatives from the alias table, a bounded number of draws since frequent classes repeat
+                if (_negatives.size() > 0) {
+                    CounterRng keyed;
+                    CounterRng* rng = &threadRng(RNG_NEGATIVES);
+                    if (seedFixed() && iter >= 0) {
+                        keyed = rngStream(RNG_NEGATIVES, ((uint64_t) _layerID << 48) ^ iter);
+                        rng = &keyed;
+                    }
+                    for (int draws = 0; draws < 4 * PAD_TO && len < PAD_TO; draws++) {
+                        int id = _negatives.sample(*rng);
+                        if (!((mask[id >> 6] >> (id & 63)) & 1)) {
+                            mask[id >> 6] |= 1ULL << (id & 63);
+                            out[len++] = id;
                         }
                     }
                 }
-            }
 
-            in = counts.size();
-            if (counts.size()<1500){
-                srand(time(NULL));
-                size_t start = rand() % _noOfNodes;
-                for (size_t i = start; i < _noOfNodes; i++) {
-                    if (counts.size() >= 1000) {
-                        break;
-                    }
-                    if (counts.count(_randNode[i]) == 0) {
-                        counts[_randNode[i]] = 0;
-                    }
-                }
-
-                if (counts.size() < 1000) {
-                    for (size_t i = 0; i < _noOfNodes; i++) {
-                        if (counts.size() >= 1000) {
-                            break;
-                        }
-                        if (counts.count(_randNode[i]) == 0) {
-                            counts[_randNode[i]] = 0;
-                        }
-                    }
+                // the rest uniformly, by walking _randNode, a permutation, so no node comes up twice
+                size_t i = paddingStart(iter);
+                for (size_t steps = 0; steps < _noOfNodes && len < PAD_TO; steps++) {
+                    int id = _randNode[i];
+                    if (!((mask[id >> 6] >> (id & 63)) & 1))
+                        out[len++] = id;
+                    if (++i == _noOfNodes)
+                        i = 0;
                 }
+                paddingEnd(iter, i);
+                for (int k = 0; k < len; k++)
+                    mask[out[k] >> 6] = 0;
+                std::sort(out, out + len);
             }
-
-            len = counts.size();
             lengths[layerIndex + 1] = len;
-            activenodesperlayer[layerIndex + 1] = new int[len];
-
-            // copy map into new array
-            int i=0;
-            for (auto &&x : counts) {
-                activenodesperlayer[layerIndex + 1][i] = x.first;
-                i++;
-            }
-
-            delete[] hashes;
-            delete[] hashIndices;
-            delete[] actives;
 
         }
         else if (Mode == 2 & _type== NodeType::Softmax) {
             len = floor(_noOfNodes * Sparsity);
             lengths[layerIndex + 1] = len;
-            activenodesperlayer[layerIndex + 1] = new int[len];
 
-            auto t1 = std::chrono::high_resolution_clock::now();
-            bitset <MAPLEN> bs;
+            PHASE_SCOPE(PHASE_DEDUP);
+            vector<uint64_t>& bs = nodeMask(_noOfNodes);
+            CounterRng& rng = threadRng(RNG_SAMPLING);
             int tmpsize = 0;
             if (_type == NodeType::Softmax) {
                 if (labelsize > 0) {
                     for (int i=0; i<labelsize ;i++){
                         activenodesperlayer[layerIndex + 1][i] = label[i];
-                        bs[label[i]] = 1;
+                        bs[label[i] >> 6] |= 1ULL << (label[i] & 63);
                     }
                     tmpsize = labelsize;
                 }
             }
 
             while(tmpsize<len){
-                int v = rand() % _noOfNodes;
-                if(bs[v]==0) {
+                int v = rng() % _noOfNodes;
+                if(!((bs[v >> 6] >> (v & 63)) & 1)) {
                     activenodesperlayer[layerIndex + 1][tmpsize] = v;
-                    bs[v]=1;
+                    bs[v >> 6] |= 1ULL << (v & 63);
                     tmpsize++;
                 }
             }
-
-
-
-            auto t2 = std::chrono::high_resolution_clock::now();
-//            std::cout << "sampling "<<" takes" << 1.0 * timeDiffInMiliseconds << std::endl;
-
+            for (int i = 0; i < tmpsize; i++)
+                bs[activenodesperlayer[layerIndex + 1][i] >> 6] = 0;
         }
 
         else if (Mode==3 & _type== NodeType::Softmax){
 
             len = floor(_noOfNodes * Sparsity);
             lengths[layerIndex + 1] = len;
-            activenodesperlayer[layerIndex + 1] = new int[len];
-            vector<pair<float, int> > sortW;
+            static thread_local vector<pair<float, int> > sortW;
+            sortW.clear();
             int what = 0;
 
             for (size_t s = 0; s < _noOfNodes; s++) {
@@ -439,71 +829,590 @@ int Layer::queryActiveNodeandComputeActivations(int** activenodesperlayer, float
         }
     }
 
-    //***********************************
-    activeValuesperlayer[layerIndex + 1] = new float[len]; //assuming its not initialized else memory leak;
-    float maxValue = 0;
-    if (_type == NodeType::Softmax)
-        _normalizationConstants[inputID] = 0;
+    return in;
+}
+
+
+/*
+* Whether ids are first, first + 1, ..., which a node reads as one slice of its weight row. Checked per
+* sample: input ids from the data files need be neither ascending nor distinct, and Mode 3 orders a
+* layer's active ids by score.
+*/
+static bool denseRun(const int* indices, int length)
+{
+    for (int i = 1; i < length; i++) {
+        if (indices[i] != indices[0] + i)
+            return false;
+    }
+    return length > 0;
+}
+
+
+void Layer::computeActivations(int** activenodesperlayer, float** activeValuesperlayer, int* lengths, int layerIndex, int inputID)
+{
+    PHASE_SCOPE(PHASE_ACTIVATION);
+    int len = lengths[layerIndex + 1];
+
+    if (NUMA && numaThreadNode() >= 0) {
+        int local = 0;
+        for (int i = 0; i < len; i++) {
+            if (numaPartitionOf(activenodesperlayer[layerIndex + 1][i], _noOfNodes) == numaThreadNode())
+                local++;
+        }
+#pragma omp atomic
+        _numaLocal += local;
+#pragma omp atomic
+        _numaRemote += len - local;
+    }
+
+    if (_columnMajor) {
+        computeColumnActivations(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex], activeValuesperlayer[layerIndex + 1], inputID);
+        return;
+    }
 
     // find activation for all ACTIVE nodes in layer
+    bool dense = denseRun(activenodesperlayer[layerIndex], lengths[layerIndex]);
     for (int i = 0; i < len; i++)
     {
-        activeValuesperlayer[layerIndex + 1][i] = _Nodes[activenodesperlayer[layerIndex + 1][i]].getActivation(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex], inputID);
-        if(_type == NodeType::Softmax && activeValuesperlayer[layerIndex + 1][i] > maxValue){
+        activeValuesperlayer[layerIndex + 1][i] = _Nodes[activenodesperlayer[layerIndex + 1][i]].getActivation(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex], inputID, dense);
+    }
+}
+
+
+void Layer::computeSoftmax(int** activenodesperlayer, float** activeValuesperlayer, int* lengths, int layerIndex, int inputID)
+{
+    if (_type != NodeType::Softmax)
+        return;
+
+    PHASE_SCOPE(PHASE_SOFTMAX);
+    int len = lengths[layerIndex + 1];
+    float maxValue = 0;
+    for (int i = 0; i < len; i++) {
+        if (activeValuesperlayer[layerIndex + 1][i] > maxValue)
             maxValue = activeValuesperlayer[layerIndex + 1][i];
+    }
+
+    _normalizationConstants[inputID] = 0;
+    for (int i = 0; i < len; i++) {
+        float realActivation = exp(activeValuesperlayer[layerIndex + 1][i] - maxValue);
+        activeValuesperlayer[layerIndex + 1][i] = realActivation;
+        _Nodes[activenodesperlayer[layerIndex + 1][i]].SetlastActivation(inputID, realActivation);
+        _normalizationConstants[inputID] += realActivation;
+    }
+}
+
+/*
+* computeActivations for inference: the activations go only into activeValuesperlayer[layerIndex + 1],
+* nothing is recorded in the nodes for backpropagation and no NUMA statistics are kept.
+*/
+void Layer::inferActivations(int** activenodesperlayer, float** activeValuesperlayer, int* lengths, int layerIndex) const
+{
+    int len = lengths[layerIndex + 1];
+    float* out = activeValuesperlayer[layerIndex + 1];
+
+    if (_columnMajor) {
+        for (int n = 0; n < len; n++)
+            out[n] = 0;
+        for (int i = 0; i < lengths[layerIndex]; i++)
+            axpy(activeValuesperlayer[layerIndex][i], _weights + (size_t) activenodesperlayer[layerIndex][i] * _noOfNodes, out, _noOfNodes);
+        for (int n = 0; n < len; n++)
+            out[n] = _Nodes[n].infer(out[n]);
+        return;
+    }
+
+    bool dense = denseRun(activenodesperlayer[layerIndex], lengths[layerIndex]);
+    for (int i = 0; i < len; i++)
+        out[i] = _Nodes[activenodesperlayer[layerIndex + 1][i]].inferActivation(activenodesperlayer[layerIndex], activeValuesperlayer[layerIndex], lengths[layerIndex], dense);
+}
+
+
+// computeSoftmax for inference, returns the normalization constant instead of keeping it
+float Layer::inferSoftmax(float** activeValuesperlayer, int* lengths, int layerIndex) const
+{
+    if (_type != NodeType::Softmax)
+        return 1;
+
+    int len = lengths[layerIndex + 1];
+    float* values = activeValuesperlayer[layerIndex + 1];
+    float maxValue = 0; // as computeSoftmax
+    for (int i = 0; i < len; i++)
+        maxValue = std::max(maxValue, values[i]);
+
+    float normalization = 0;
+    for (int i = 0; i < len; i++) {
+        values[i] = exp(values[i] - maxValue);
+        normalization += values[i];
+    }
+    return normalization;
+}
+
+// node-major parameters into this layer's layout: a plain copy, or feature-major for a column-major layer
+void Layer::copyIn(const float* rows, float* to) const
+{
+    if (!_columnMajor) {
+#pragma omp parallel for
+        for (size_t n = 0; n < _noOfNodes; n++)
+            memcpy(to + n * _previousLayerNumOfNodes, rows + n * _previousLayerNumOfNodes, _previousLayerNumOfNodes * sizeof(float));
+        return;
+    }
+#pragma omp parallel for
+    for (size_t f = 0; f < (size_t) _previousLayerNumOfNodes; f++)
+    {
+        for (size_t n = 0; n < _noOfNodes; n++)
+            to[f * _noOfNodes + n] = rows[n * _previousLayerNumOfNodes + f];
+    }
+}
+
+
+// the inverse of copyIn: this layer's layout into node-major rows, for saving
+void Layer::copyOut(const float* from, float* rows) const
+{
+    if (!_columnMajor) {
+#pragma omp parallel for
+        for (size_t n = 0; n < _noOfNodes; n++)
+            memcpy(rows + n * _previousLayerNumOfNodes, from + n * _previousLayerNumOfNodes, _previousLayerNumOfNodes * sizeof(float));
+        return;
+    }
+#pragma omp parallel for
+    for (size_t n = 0; n < _noOfNodes; n++)
+    {
+        for (size_t f = 0; f < (size_t) _previousLayerNumOfNodes; f++)
+            rows[n * _previousLayerNumOfNodes + f] = from[f * _noOfNodes + n];
+    }
+}
+
+
+/*
+* Dense layer, sparse input: one axpy over a contiguous column per input nonzero,
+* instead of one strided gather per (node, nonzero).
+*/
+void Layer::computeColumnActivations(int* indices, float* values, int length, float* activations, int inputID)
+{
+    for (size_t n = 0; n < _noOfNodes; n++)
+        activations[n] = 0;
+    for (int i = 0; i < length; i++)
+    {
+        axpy(values[i], _weights + (size_t) indices[i] * _noOfNodes, activations, _noOfNodes);
+    }
+    for (size_t n = 0; n < _noOfNodes; n++)
+    {
+        activations[n] = _Nodes[n].activate(activations[n], inputID);
+    }
+}
+
+
+// gradient of every node of the dense layer scattered into the same columns the forward pass read
+void Layer::backPropagateColumns(int* indices, float* values, int length, int inputID)
+{
+    PHASE_SCOPE(PHASE_BACKPROP);
+    static thread_local vector<float> deltas;
+    deltas.resize(_noOfNodes);
+    for (size_t n = 0; n < _noOfNodes; n++)
+        deltas[n] = _Nodes[n]._train[inputID]._lastDeltaforBPs;
+    for (int i = 0; i < length; i++)
+    {
+        axpy(values[i], &deltas[0], _t + (size_t) indices[i] * _noOfNodes, _noOfNodes);
+    }
+}
+
+
+// the Adam step is elementwise, so the feature-major buffers are swept flat; biases stay per node
+void Layer::adamUpdateColumns(float tmplr)
+{
+    size_t total = _noOfNodes * _previousLayerNumOfNodes;
+#pragma omp parallel
+    {
+        PHASE_SCOPE(PHASE_UPDATE);
+#pragma omp for nowait
+        for (size_t d = 0; d < total; d++)
+        {
+            float t = _t[d];
+            float Mom = BETA1 * _adamAvgMom[d] + (1 - BETA1) * t;
+            float Vel = BETA2 * _adamAvgVel[d] + (1 - BETA2) * t * t;
+            _weights[d] += tmplr * Mom / (sqrt(Vel) + EPS);
+            _adamAvgMom[d] = Mom;
+            _adamAvgVel[d] = Vel;
+            _t[d] = 0;
         }
     }
 
-    if(_type == NodeType::Softmax) {
-        for (int i = 0; i < len; i++) {
-            float realActivation = exp(activeValuesperlayer[layerIndex + 1][i] - maxValue);
-            activeValuesperlayer[layerIndex + 1][i] = realActivation;
-            _Nodes[activenodesperlayer[layerIndex + 1][i]].SetlastActivation(inputID, realActivation);
-            _normalizationConstants[inputID] += realActivation;
+    PHASE_SCOPE(PHASE_UPDATE);
+    for (size_t n = 0; n < _noOfNodes; n++)
+    {
+        Node* tmp = &_Nodes[n];
+        tmp->_adamAvgMombias = BETA1 * tmp->_adamAvgMombias + (1 - BETA1) * tmp->_tbias;
+        tmp->_adamAvgVelbias = BETA2 * tmp->_adamAvgVelbias + (1 - BETA2) * tmp->_tbias * tmp->_tbias;
+        *tmp->_bias += tmplr * tmp->_adamAvgMombias / (sqrt(tmp->_adamAvgVelbias) + EPS);
+        tmp->_tbias = 0;
+    }
+}
+
+
+/*
+* UPDATE_STALENESS 1: the gradients just accumulated become the pending ones, swept during the next
+* batch, and the already swept (zeroed) pending buffers take the next batch's gradients.
+*/
+void Layer::swapGradients()
+{
+    std::swap(_t, _tPending);
+#pragma omp parallel for
+    for (size_t n = 0; n < _noOfNodes; n++)
+    {
+        std::swap(_Nodes[n]._t, _Nodes[n]._tPending);
+        std::swap(_Nodes[n]._tbias, _Nodes[n]._tbiasPending);
+    }
+}
+
+
+void Layer::buildUnion(int*** activeNodesPerBatch, int** sizesPerBatch, int layerIndex, int batchSize)
+{
+    if (_unionSlot == NULL) {
+        _unionSlot = new int[_noOfNodes];
+        std::fill(_unionSlot, _unionSlot + _noOfNodes, -1);
+    }
+
+    _unionIds.clear();
+    _maskStart.assign(1, 0);
+    for (int s = 0; s < batchSize; s++) {
+        for (int k = 0; k < sizesPerBatch[s][layerIndex + 1]; k++) {
+            int id = activeNodesPerBatch[s][layerIndex + 1][k];
+            if (_unionSlot[id] < 0) {
+                _unionSlot[id] = _unionIds.size();
+                _unionIds.push_back(id);
+                _maskStart.push_back(0);
+            }
+            _maskStart[_unionSlot[id] + 1]++;
+        }
+    }
+    for (size_t u = 0; u < _unionIds.size(); u++)
+        _maskStart[u + 1] += _maskStart[u];
+
+    // a block's pairs are those of its union nodes, filled in sample order
+    int unionSize = _unionIds.size();
+    int blocks = (unionSize + UNION_BLOCK - 1) / UNION_BLOCK;
+    _blockStart.resize(blocks + 1);
+    for (int b = 0; b <= blocks; b++)
+        _blockStart[b] = _maskStart[std::min(unionSize, b * UNION_BLOCK)];
+    _blockFill.assign(_blockStart.begin(), _blockStart.end() - 1);
+
+    _maskEntries.resize(_maskStart.back());
+    _blockEntries.resize(_maskStart.back());
+    _maskFill.assign(_maskStart.begin(), _maskStart.end() - 1);
+    for (int s = 0; s < batchSize; s++) {
+        for (int k = 0; k < sizesPerBatch[s][layerIndex + 1]; k++) {
+            int u = _unionSlot[activeNodesPerBatch[s][layerIndex + 1][k]];
+            _blockEntries[_blockFill[u / UNION_BLOCK]++] = make_pair(u, _maskFill[u]);
+            _maskEntries[_maskFill[u]++] = make_pair(s, k);
         }
     }
 
-    return in;
+    for (size_t u = 0; u < _unionIds.size(); u++)
+        _unionSlot[_unionIds[u]] = -1;
+}
+
+
+/*
+* Batch mode: instead of every sample walking its own candidate list, the weight rows of the union of
+* all candidate lists are gathered once into _unionWeights, and the union is multiplied with the batch's
+* inputs in blocks of UNION_BLOCK rows: block by block, each sample's inputs are applied to the block's
+* rows in its candidate list, so both the block and the sample's inputs stay in cache. The per-sample
+* (node, sample) pairs and their sums are the same as in queryActiveNodeandComputeActivations.
+*/
+void Layer::batchComputeActivations(int*** activeNodesPerBatch, float*** activeValuesPerBatch, int** sizesPerBatch, int layerIndex, int batchSize)
+{
+    buildUnion(activeNodesPerBatch, sizesPerBatch, layerIndex, batchSize);
+
+    int unionSize = _unionIds.size();
+    int blocks = (unionSize + UNION_BLOCK - 1) / UNION_BLOCK;
+    size_t width = _previousLayerNumOfNodes;
+    if (_unionWeights.size() < unionSize * width)
+        _unionWeights.resize(unionSize * width);
+    _denseInputs.resize(batchSize);
+    for (int s = 0; s < batchSize; s++)
+        _denseInputs[s] = denseRun(activeNodesPerBatch[s][layerIndex], sizesPerBatch[s][layerIndex]);
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < blocks; b++) {
+        PHASE_SCOPE(PHASE_ACTIVATION);
+        int end = std::min(unionSize, (b + 1) * UNION_BLOCK);
+        for (int u = b * UNION_BLOCK; u < end; u++)
+            memcpy(&_unionWeights[u * width], _Nodes[_unionIds[u]]._weights, width * sizeof(float));
+        for (int p = _blockStart[b]; p < _blockStart[b + 1]; p++) {
+            int u = _blockEntries[p].first;
+            int s = _maskEntries[_blockEntries[p].second].first;
+            activeValuesPerBatch[s][layerIndex + 1][_maskEntries[_blockEntries[p].second].second] = _Nodes[_unionIds[u]].getActivation(
+                    activeNodesPerBatch[s][layerIndex], activeValuesPerBatch[s][layerIndex], sizesPerBatch[s][layerIndex], s,
+                    _denseInputs[s], &_unionWeights[u * width]);
+        }
+    }
+
+#pragma omp parallel for
+    for (int s = 0; s < batchSize; s++)
+        computeSoftmax(activeNodesPerBatch[s], activeValuesPerBatch[s], sizesPerBatch[s], layerIndex, s);
+}
+
+
+/*
+* Batch mode backward over the same union blocks, reading the rows gathered by batchComputeActivations
+* (no update runs in between) and the previous activations from the samples' value lists: a node's
+* gradient row is only touched by the thread owning its block. Deltas for the previous layer are summed
+* in per-thread buffers and applied afterwards, so samples do not race on the previous layer's nodes.
+*/
+void Layer::batchBackPropagate(Node* previousNodes, int*** activeNodesPerBatch, float*** activeValuesPerBatch, int** sizesPerBatch, int layerIndex,
+                               int batchSize, float learningRate)
+{
+    _prevOffsets.resize(batchSize + 1);
+    _prevOffsets[0] = 0;
+    for (int s = 0; s < batchSize; s++)
+        _prevOffsets[s + 1] = _prevOffsets[s] + sizesPerBatch[s][layerIndex];
+    _prevDeltas.resize(omp_get_max_threads());
+    for (size_t t = 0; t < _prevDeltas.size(); t++)
+        _prevDeltas[t].clear();
+
+    int unionSize = _unionIds.size();
+    int blocks = (unionSize + UNION_BLOCK - 1) / UNION_BLOCK;
+    size_t width = _previousLayerNumOfNodes;
+#pragma omp parallel
+    {
+        vector<float> &deltas = _prevDeltas[omp_get_thread_num()];
+        deltas.assign(_prevOffsets[batchSize], 0);
+#pragma omp for schedule(dynamic)
+        for (int b = 0; b < blocks; b++) {
+            PHASE_SCOPE(PHASE_BACKPROP);
+            int end = std::min(unionSize, (b + 1) * UNION_BLOCK);
+            for (int u = b * UNION_BLOCK; u < end; u++) {
+                Node* node = &_Nodes[_unionIds[u]];
+                for (int e = _maskStart[u]; e < _maskStart[u + 1]; e++) {
+                    int s = _maskEntries[e].first;
+                    node->backPropagate(previousNodes, activeNodesPerBatch[s][layerIndex], sizesPerBatch[s][layerIndex], learningRate, s,
+                            &deltas[_prevOffsets[s]], activeValuesPerBatch[s][layerIndex], &_unionWeights[u * width]);
+                }
+            }
+        }
+    }
+
+    int threads = _prevDeltas.size();
+#pragma omp parallel for
+    for (int s = 0; s < batchSize; s++) {
+        PHASE_SCOPE(PHASE_BACKPROP);
+        for (int k = 0; k < sizesPerBatch[s][layerIndex]; k++) {
+            float delta = 0;
+            for (int t = 0; t < threads; t++) {
+                if (!_prevDeltas[t].empty())
+                    delta += _prevDeltas[t][_prevOffsets[s] + k];
+            }
+            previousNodes[activeNodesPerBatch[s][layerIndex][k]].incrementDelta(s, delta);
+        }
+    }
+}
+
+
+float Layer::numaRemoteRatio()
+{
+    long long total = _numaLocal + _numaRemote;
+    float ratio = total ? _numaRemote * 1.0 / total : 0;
+    _numaLocal = 0;
+    _numaRemote = 0;
+    return ratio;
 }
 
 void Layer::saveWeights(string file)
+{
+    if (_columnMajor) {
+        size_t size = _noOfNodes * _previousLayerNumOfNodes;
+        float* weights = new float[size];
+        float* adamAvgMom = new float[size];
+        float* adamAvgVel = new float[size];
+        snapshot(weights, NULL, adamAvgMom, adamAvgVel);
+        saveWeights(file, weights, _bias, adamAvgMom, adamAvgVel);
+        delete[] weights;
+        delete[] adamAvgMom;
+        delete[] adamAvgVel;
+    } else {
+        saveWeights(file, _weights, _bias, _adamAvgMom, _adamAvgVel);
+    }
+}
+
+
+/*
+* Node-major copy of the parameters as saveWeights writes them, for a checkpoint taken between two
+* batches and written while training goes on (Network::saveWeightsAsync). A NULL buffer is skipped.
+*/
+void Layer::snapshot(float* weights, float* bias, float* adamAvgMom, float* adamAvgVel) const
+{
+    if (weights)
+        copyOut(_weights, weights);
+    if (adamAvgMom)
+        copyOut(_adamAvgMom, adamAvgMom);
+    if (adamAvgVel)
+        copyOut(_adamAvgVel, adamAvgVel);
+    if (bias)
+        memcpy(bias, _bias, _noOfNodes * sizeof(float));
+}
+
+
+/*
+* The layer's training state as a state file stores it (Checkpoint.h), between two batches with the
+* pending updates applied. Parameters are referenced where they are when inPlace is set and the layer
+* is node-major; everything else is copied into buffers.
+*/
+LayerState Layer::exportState(LayerSnapshot& buffers, bool inPlace) const
+{
+    size_t size = _noOfNodes * _previousLayerNumOfNodes;
+    LayerState state;
+    memset(&state, 0, sizeof(state));
+    state._nodes = _noOfNodes;
+    state._inputs = _previousLayerNumOfNodes;
+    state._hasherKey = hasherKey();
+    if (inPlace && !_columnMajor) {
+        state._weights = _weights;
+        state._bias = _bias;
+        state._adamAvgMom = ADAM ? _adamAvgMom : NULL;
+        state._adamAvgVel = ADAM ? _adamAvgVel : NULL;
+        state._t = _t;
+    } else {
+        buffers._weights.resize(size);
+        buffers._bias.resize(_noOfNodes);
+        snapshot(&buffers._weights[0], &buffers._bias[0], NULL, NULL);
+        state._weights = &buffers._weights[0];
+        state._bias = &buffers._bias[0];
+        if (ADAM) {
+            buffers._adamAvgMom.resize(size);
+            buffers._adamAvgVel.resize(size);
+            buffers._t.resize(size);
+            snapshot(NULL, NULL, &buffers._adamAvgMom[0], &buffers._adamAvgVel[0]);
+            copyOut(_t, &buffers._t[0]);
+            state._adamAvgMom = &buffers._adamAvgMom[0];
+            state._adamAvgVel = &buffers._adamAvgVel[0];
+            state._t = &buffers._t[0];
+        }
+    }
+
+    buffers._biasAdam.resize(3 * _noOfNodes);
+    for (size_t n = 0; n < _noOfNodes; n++) {
+        buffers._biasAdam[3 * n] = _Nodes[n]._adamAvgMombias;
+        buffers._biasAdam[3 * n + 1] = _Nodes[n]._adamAvgVelbias;
+        buffers._biasAdam[3 * n + 2] = _Nodes[n]._tbias;
+    }
+    state._biasAdam = &buffers._biasAdam[0];
+    buffers._randNode.assign(_randNode, _randNode + _noOfNodes);
+    state._randNode = &buffers._randNode[0];
+    if (!_labelCounts.empty()) {
+        buffers._labelCounts = _labelCounts;
+        state._labelCounts = &buffers._labelCounts[0];
+    }
+    return state;
+}
+
+
+/*
+* Everything of a saved training state the constructor did not take: gradients (only for the process
+* that saved them, with gradients set), the bias Adam state, the node order, the hash functions and
+* the label counts, which setNegativeSampling keeps. The tables are not saved; like the constructor's,
+* they hold the nodes hashed from the saved weights.
+*/
+void Layer::restoreState(const LayerState& state, bool gradients)
+{
+    if (gradients && state._t && _t)
+        copyIn(state._t, _t);
+    for (size_t n = 0; state._biasAdam && n < _noOfNodes; n++) {
+        _Nodes[n]._adamAvgMombias = state._biasAdam[3 * n];
+        _Nodes[n]._adamAvgVelbias = state._biasAdam[3 * n + 1];
+        _Nodes[n]._tbias = gradients ? state._biasAdam[3 * n + 2] : 0;
+    }
+    if (state._randNode)
+        memcpy(_randNode, state._randNode, _noOfNodes * sizeof(int));
+    // hashers redrawn by a rebuild since the start: the same ones again, and the tables from them
+    if (state._hasherKey != hasherKey()) {
+        drawHashers(&state._hasherKey);
+        _hashTables->clear();
+        if (!_columnMajor) {
+#pragma omp parallel for
+            for (size_t n = 0; n < _noOfNodes; n++)
+                rehashNode(_Nodes[n]._weights, _previousLayerNumOfNodes, n);
+            insertRehashed();
+        }
+    }
+    if (state._labelCounts)
+        _labelCounts.assign(state._labelCounts, state._labelCounts + _noOfNodes);
+}
+
+
+void Layer::saveWeights(string file, const float* weights, const float* bias, const float* adamAvgMom, const float* adamAvgVel) const
 {
     if (_layerID==0) {
-        cnpy::npz_save(file, "w_layer_0", _weights, {_noOfNodes, _Nodes[0]._dim}, "w");
-        cnpy::npz_save(file, "b_layer_0", _bias, {_noOfNodes}, "a");
-        cnpy::npz_save(file, "am_layer_0", _adamAvgMom, {_noOfNodes, _Nodes[0]._dim}, "a");
-        cnpy::npz_save(file, "av_layer_0", _adamAvgVel, {_noOfNodes, _Nodes[0]._dim}, "a");
+        cnpy::npz_save(file, "w_layer_0", weights, {_noOfNodes, (size_t) _previousLayerNumOfNodes}, "w");
+        cnpy::npz_save(file, "b_layer_0", bias, {_noOfNodes}, "a");
+        cnpy::npz_save(file, "am_layer_0", adamAvgMom, {_noOfNodes, (size_t) _previousLayerNumOfNodes}, "a");
+        cnpy::npz_save(file, "av_layer_0", adamAvgVel, {_noOfNodes, (size_t) _previousLayerNumOfNodes}, "a");
         cout<<"save for layer 0"<<endl;
-        cout<<_weights[0]<<" "<<_weights[1]<<endl;
+        cout<<weights[0]<<" "<<weights[1]<<endl;
     }else{
-        cnpy::npz_save(file, "w_layer_"+ to_string(_layerID), _weights, {_noOfNodes, _Nodes[0]._dim}, "a");
-        cnpy::npz_save(file, "b_layer_"+ to_string(_layerID), _bias, {_noOfNodes}, "a");
-        cnpy::npz_save(file, "am_layer_"+ to_string(_layerID), _adamAvgMom, {_noOfNodes, _Nodes[0]._dim}, "a");
-        cnpy::npz_save(file, "av_layer_"+ to_string(_layerID), _adamAvgVel, {_noOfNodes, _Nodes[0]._dim}, "a");
-        cout<<"save for layer "<<to_string(_layerID)<<endl;
-        cout<<_weights[0]<<" "<<_weights[1]<<endl;
+        // a shard of the output layer is saved under its own keys, e.g. w_layer_2_shard_1
+        string name = to_string(_layerID);
+        if (_shard >= 0)
+            name += "_shard_" + to_string(_shard);
+        cnpy::npz_save(file, "w_layer_"+ name, weights, {_noOfNodes, (size_t) _previousLayerNumOfNodes}, "a");
+        cnpy::npz_save(file, "b_layer_"+ name, bias, {_noOfNodes}, "a");
+        cnpy::npz_save(file, "am_layer_"+ name, adamAvgMom, {_noOfNodes, (size_t) _previousLayerNumOfNodes}, "a");
+        cnpy::npz_save(file, "av_layer_"+ name, adamAvgVel, {_noOfNodes, (size_t) _previousLayerNumOfNodes}, "a");
+        cout<<"save for layer "<<name<<endl;
+        cout<<weights[0]<<" "<<weights[1]<<endl;
     }
 }
 
 
-Layer::~Layer()
+// the arrays saveWeights writes, under the same keys, for a sharded checkpoint (Checkpoint.h)
+void Layer::checkpointArrays(vector<CheckpointArray>& arrays, const float* weights, const float* bias, const float* adamAvgMom, const float* adamAvgVel) const
 {
+    string name = to_string(_layerID);
+    if (_shard >= 0)
+        name += "_shard_" + to_string(_shard);
+    size_t inputs = _previousLayerNumOfNodes;
+    arrays.push_back({"w_layer_" + name, weights, _noOfNodes, inputs});
+    arrays.push_back({"b_layer_" + name, bias, _noOfNodes, 0});
+    arrays.push_back({"am_layer_" + name, adamAvgMom, _noOfNodes, inputs});
+    arrays.push_back({"av_layer_" + name, adamAvgVel, _noOfNodes, inputs});
+}
 
+
+Layer::~Layer()
+{
+    chargeLedger(-1);
+    if (_binids)
+        ledgerCharge(_layerID, LEDGER_HASHERS, -(long long) sizeof(int) * _previousLayerNumOfNodes);
     for (size_t i = 0; i < _noOfNodes; i++)
     {
-        if (_type == NodeType::Softmax)
-        {
-            delete[] _normalizationConstants;
+        _Nodes[i].~Node();
+    }
+    arenaFree(_Nodes);
+    if (_type == NodeType::Softmax)
+    {
+        delete[] _normalizationConstants;
+    }
+    // a frozen layer's parameters belong to the map
+    if (!_frozen && !_loaded) {
+        arenaFree(_weights);
+        if (ADAM) {
+            arenaFree(_adamAvgMom);
+            arenaFree(_adamAvgVel);
         }
     }
-    delete [] _Nodes;
-    delete [] _weights;
-    delete [] _bias;
+    if (!_loaded) {
+        arenaFree(_bias);
+    }
+    if (ADAM) {
+        arenaFree(_t);
+        arenaFree(_tPending);
+    }
+    arenaFree(_train_array);
 
+    delete _hashTables;
     delete _wtaHasher;
     delete _dwtaHasher;
     delete _srp;
     delete _MinHasher;
-    delete [] _randNode;
-    delete[] _train_array;
+    delete [] _binids;
+    if (!_frozen)
+        delete [] _randNode;
+    delete [] _unionSlot;
 }
@@ -6,7 +6,12 @@
 #include "LSH.h"
 #include "DensifiedWtaHash.h"
 #include "cnpy.h"
-#include <sys/mman.h>
+#include "Arena.h"
+#include "AliasTable.h"
+#include "Frozen.h"
+#include "Checkpoint.h"
+#include "Ledger.h"
+#include <vector>
 
 using namespace std;
 
@@ -19,14 +24,47 @@ private:
 	float* _normalizationConstants;
     int _K, _L, _RangeRow, _previousLayerNumOfNodes, _batchsize;
     train* _train_array;
+    bool _loaded; // parameters came from a checkpoint
+    bool _frozen; // parameters and tables are sections of a mapped frozen model (Frozen.h)
+    long long _numaLocal, _numaRemote;
+
+    // batch mode: union of the batch's active nodes, and per union node the (sample, position) pairs using it;
+    // per block of UNION_BLOCK union nodes the same pairs sample by sample, as (union node, pair index),
+    // and the union's weight rows gathered next to each other
+    int* _unionSlot;
+    vector<int> _unionIds, _maskStart, _maskFill, _blockStart, _blockFill, _prevOffsets;
+    vector<pair<int, int> > _maskEntries, _blockEntries;
+    vector<float> _unionWeights;
+    vector<char> _denseInputs; // per sample, whether its inputs are one run of ids (see denseRun)
+    vector<vector<float> > _prevDeltas;
+    // with a fixed seed, every node's table indices from a rehash, inserted in node order afterwards
+    vector<int> _rehashIndices;
+    // Mode 4 negatives other than uniform: how often each node was a label, and the table drawn from
+    int _negativeMode;
+    float _negativePower;
+    vector<long long> _labelCounts;
+    AliasTable _negatives;
+    void buildUnion(int*** activeNodesPerBatch, int** sizesPerBatch, int layerIndex, int batchSize);
+    size_t paddingStart(int iter) const;
+    void paddingEnd(int iter, size_t next) const;
+    void retrieveCandidates(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerIndex, vector<int>& candidates) const;
+
+    void copyIn(const float* rows, float* to) const;
+    void drawHashers(const uint64_t* key);
+    void chargeLedger(int sign) const;
+    void copyOut(const float* from, float* rows) const;
 
 
 public:
 	int _layerID, _noOfActive;
+	int _shard; // which part of a sharded output layer this is, -1 for a whole layer (see Workers.h)
+	bool _columnMajor;
 	size_t _noOfNodes;
 	float* _weights;
 	float* _adamAvgMom;
 	float* _adamAvgVel;
+	float* _t; //for adam
+	float* _tPending;
 	float* _bias;
 	LSH *_hashTables;
 	WtaHash *_wtaHasher;
@@ -35,34 +73,44 @@ public:
     DensifiedWtaHash *_dwtaHasher;
 	int * _binids;
 	Layer(size_t _numNodex, int previousLayerNumOfNodes, int layerID, NodeType type, int batchsize, int K, int L, int RangePow, float Sparsity, float* weights=NULL, float* bias=NULL, float *adamAvgMom=NULL, float *adamAvgVel=NULL);
+	Layer(const FrozenLayer& frozen, char* map, int layerID, int batchsize);
+	static void footprint(size_t noOfNodes, int previousLayerNumOfNodes, int layerID, int batchsize, int K, int L, int RangePow, float Sparsity, size_t bytes[LEDGER_CATEGORIES]);
 	Node* getNodebyID(size_t nodeID);
 	Node* getAllNodes();
 	int getNodeCount();
+	int getInputCount() const;
 	void addtoHashTable(float* weights, int length, float bias, int id);
+	void rehashNode(float* weights, int length, int id);
+	void insertRehashed();
 	float getNomalizationConstant(int inputID);
+	int maxActiveNodes(int labelsize, float Sparsity) const;
 	int queryActiveNodeandComputeActivations(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID,  int* label, int labelsize, float Sparsity, int iter);
-    int queryActiveNodes(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID,  int* label, int labelsize, float Sparsity, int iter);
-    int computeActivations(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID,  int* label, int labelsize, float Sparsity, int iter);
-    int computeSoftmax(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID,  int* label, int labelsize, float Sparsity, int iter);
+    int queryActiveNodes(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID,  int* label, int labelsize, float Sparsity, int iter) const;
+    void computeActivations(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID);
+    void computeSoftmax(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID, int inputID);
+    // read-only forward step: touches no node or layer state, so any number of threads may run it at once
+    void inferActivations(int** activenodesperlayer, float** activeValuesperlayer, int* inlenght, int layerID) const;
+    float inferSoftmax(float** activeValuesperlayer, int* inlenght, int layerID) const;
 	void saveWeights(string file);
+	void saveWeights(string file, const float* weights, const float* bias, const float* adamAvgMom, const float* adamAvgVel) const;
+	void snapshot(float* weights, float* bias, float* adamAvgMom, float* adamAvgVel) const;
+	void checkpointArrays(vector<CheckpointArray>& arrays, const float* weights, const float* bias, const float* adamAvgMom, const float* adamAvgVel) const;
+	LayerState exportState(LayerSnapshot& buffers, bool inPlace) const;
+	void restoreState(const LayerState& state, bool gradients);
+	uint64_t hasherKey() const;
+	size_t exportFrozen(int fd, size_t offset, FrozenLayer* frozen) const;
 	void updateTable();
 	void updateRandomNodes();
+	void setNegativeSampling(int mode, float power);
+	void countLabels(int* label, int labelsize, size_t offset);
+	void rebuildNegatives();
+	float numaRemoteRatio();
+	void computeColumnActivations(int* indices, float* values, int length, float* activations, int inputID);
+	void backPropagateColumns(int* indices, float* values, int length, int inputID);
+	void adamUpdateColumns(float tmplr);
+	void swapGradients();
+	void batchComputeActivations(int*** activeNodesPerBatch, float*** activeValuesPerBatch, int** sizesPerBatch, int layerIndex, int batchSize);
+	void batchBackPropagate(Node* previousNodes, int*** activeNodesPerBatch, float*** activeValuesPerBatch, int** sizesPerBatch, int layerIndex, int batchSize, float learningRate);
 
 	~Layer();
-
-    void * operator new(size_t size){
-        cout << "new Layer" << endl;
-        void* ptr = mmap(NULL, size,
-            PROT_READ | PROT_EXEC | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
-            -1, 0);
-        if (ptr == MAP_FAILED){
-            ptr = mmap(NULL, size,
-                PROT_READ | PROT_EXEC | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
-                -1, 0);
-        }
-        if (ptr == MAP_FAILED)
-            std::cout << "mmap fail! No new layer!" << std::endl;
-        return ptr;};
-    void operator delete(void * pointer){munmap(pointer, sizeof(Layer));};
-
 };
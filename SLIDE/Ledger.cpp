@@ -0,0 +1,91 @@
+#include "Ledger.h"
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+struct LedgerRow
+{
+    long long _bytes[LEDGER_CATEGORIES];
+};
+
+static const char* _categoryNames[LEDGER_CATEGORIES] = {"weights", "adam", "grads", "train", "nodes", "lsh_slab",
+                                                        "lsh_buckets", "hashers"};
+static map<int, LedgerRow> _rows;
+static mutex _ledgerLock;
+static thread_local int _ledgerLayer = -1;
+
+
+void ledgerCharge(int layer, LedgerCategory category, long long bytes)
+{
+    if (bytes == 0)
+        return;
+    lock_guard<mutex> guard(_ledgerLock);
+    map<int, LedgerRow>::iterator it = _rows.find(layer);
+    if (it == _rows.end()) {
+        LedgerRow row = {};
+        it = _rows.insert(make_pair(layer, row)).first;
+    }
+    it->second._bytes[category] += bytes;
+}
+
+
+size_t ledgerBytes(int layer, LedgerCategory category)
+{
+    lock_guard<mutex> guard(_ledgerLock);
+    map<int, LedgerRow>::iterator it = _rows.find(layer);
+    return it == _rows.end() ? 0 : it->second._bytes[category];
+}
+
+
+void ledgerReport(const string& when)
+{
+    lock_guard<mutex> guard(_ledgerLock);
+    long long totals[LEDGER_CATEGORIES] = {};
+    ios::fmtflags flags = cout.flags();
+    streamsize precision = cout.precision();
+    cout << "Memory ledger " << when << " (MB):" << fixed << setprecision(1) << endl;
+    for (map<int, LedgerRow>::iterator it = _rows.begin(); it != _rows.end(); it++) {
+        long long total = 0;
+        if (it->first < 0)
+            cout << "  other:";
+        else
+            cout << "  layer " << it->first << ":";
+        for (int c = 0; c < LEDGER_CATEGORIES; c++) {
+            cout << (c ? ", " : " ") << _categoryNames[c] << " " << it->second._bytes[c] / 1048576.0;
+            total += it->second._bytes[c];
+            totals[c] += it->second._bytes[c];
+        }
+        cout << ", total " << total / 1048576.0 << endl;
+    }
+    long long total = 0;
+    cout << "  all layers:";
+    for (int c = 0; c < LEDGER_CATEGORIES; c++) {
+        cout << (c ? ", " : " ") << _categoryNames[c] << " " << totals[c] / 1048576.0;
+        total += totals[c];
+    }
+    cout << ", total " << total / 1048576.0 << endl;
+    cout.flags(flags);
+    cout.precision(precision);
+}
+
+
+int ledgerLayer()
+{
+    return _ledgerLayer;
+}
+
+
+LedgerScope::LedgerScope(int layer)
+{
+    _outer = _ledgerLayer;
+    _ledgerLayer = layer;
+}
+
+
+LedgerScope::~LedgerScope()
+{
+    _ledgerLayer = _outer;
+}
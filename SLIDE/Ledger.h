@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <string>
+
+/*
+*  Memory ledger: the bytes each layer holds in its large buffers, by category. Layer, LSH and the
+*  hash classes charge it where they allocate and credit it where they free; LSH and the hashers
+*  charge the layer of the LedgerScope they are constructed in (-1, "other", outside any layer).
+*  Bucket ids live in their table's slab (lsh_slab), the Bucket objects, table pointers and index hash
+*  constants are lsh_buckets. Requested sizes are counted, not the page rounding (see arenaReport),
+*  and neither per-batch scratch nor the mapped sections of a frozen model are.
+*  Printed at startup and after each rehash; runme <config> --dry-run prints the same table from
+*  Layer::footprint without allocating anything.
+*/
+enum LedgerCategory
+{ LEDGER_WEIGHTS, LEDGER_ADAM, LEDGER_GRADS, LEDGER_TRAIN, LEDGER_NODES, LEDGER_LSH_SLAB, LEDGER_LSH_BUCKETS,
+  LEDGER_HASHERS, LEDGER_CATEGORIES };
+
+void ledgerCharge(int layer, LedgerCategory category, long long bytes);
+size_t ledgerBytes(int layer, LedgerCategory category);
+void ledgerReport(const std::string& when);
+
+// layer charged by the LSH tables and hashers constructed now
+int ledgerLayer();
+
+class LedgerScope
+{
+private:
+    int _outer;
+
+public:
+    explicit LedgerScope(int layer);
+    ~LedgerScope();
+};
@@ -2,13 +2,59 @@
 #include <iostream>
 #include <math.h>
 #include <algorithm>
+#include <functional>
+#include <cstring>
 #include "Config.h"
+#include "Numa.h"
+#include "Arena.h"
+#include "Kernels.h"
+#include "Allocations.h"
+#include "Timing.h"
+#include "Ledger.h"
+#include "Scheduler.h"
+#include "Workers.h"
 #include <omp.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #define DEBUG 1
 using namespace std;
 
+// requests from shard 0 to the other shards of the output layer, each followed by _bytes of payload
+enum ShardOp { SHARD_TRAIN, SHARD_PREDICT, SHARD_SAVE, SHARD_STATE, SHARD_STOP };
 
-Network::Network(int *sizesOfLayers, NodeType *layersTypes, int noOfLayers, int batchSize, float lr, int inputdim,  int* K, int* L, int* RangePow, float* Sparsity, cnpy::npz_t arr) {
+struct ShardRequest
+{
+    int _op;
+    int _iter; // for SHARD_SAVE the generation of a sharded checkpoint
+    float _lr;
+    int _rehash, _rebuild;
+    int _k; // classes per sample a prediction asks for
+    size_t _bytes;
+    // training: whether the batch ends a sync period, and whether its sweep is deferred (UPDATE_STALENESS)
+    int _sync, _deferred;
+};
+
+struct ShardBest
+{
+    float _score;
+    int _id;
+};
+
+
+Network::Network(int *sizesOfLayers, NodeType *layersTypes, int noOfLayers, int batchSize, float lr, int inputdim,  int* K, int* L, int* RangePow, float* Sparsity, cnpy::npz_t arr, string stateFile) {
+
+    // a resumed run trains on the saved state in place, see Checkpoint.h
+    _stateMap = NULL;
+    _stateBytes = 0;
+    if (stateFile != "") {
+        _stateMap = stateMap(stateFile.c_str(), &_stateBytes);
+        if (_stateMap == NULL || ((StateHeader*) _stateMap)->_layers != (uint32_t) noOfLayers) {
+            cout << "Could not resume from " << stateFile << endl;
+            exit(1);
+        }
+    }
 
     _numberOfLayers = noOfLayers;
     _hiddenlayers = new Layer *[noOfLayers];
@@ -18,28 +64,61 @@ Network::Network(int *sizesOfLayers, NodeType *layersTypes, int noOfLayers, int
     _currentBatchSize = batchSize;
     _Sparsity = Sparsity;
 
+    _sharded = shardCount() > 1 && noOfLayers > 1;
+    _shardBegin = 0;
+
+    // worker and shard processes are already pinned to their own cores
+    if (NUMA && workerCount() == 1 && shardCount() == 1) {
+        numaPinThreads();
+    }
+    cout << "SIMD kernels: " << kernelName() << endl;
 
     for (int i = 0; i < noOfLayers; i++) {
+        // a shard process only holds its part of the output layer
+        if (_sharded && shardRank() != 0 && i != noOfLayers - 1) {
+            _hiddenlayers[i] = NULL;
+            continue;
+        }
         if (i != 0) {
             cnpy::NpyArray weightArr, biasArr, adamArr, adamvArr;
-            float* weight, *bias, *adamAvgMom, *adamAvgVel;
-            if(LOADWEIGHT){
-                weightArr = arr["w_layer_"+to_string(i)];
-                weight = weightArr.data<float>();
-                biasArr = arr["b_layer_"+to_string(i)];
-                bias = biasArr.data<float>();
+            float* weight = NULL, *bias = NULL, *adamAvgMom = NULL, *adamAvgVel = NULL;
+            size_t nodes = sizesOfLayers[i];
+            string name = to_string(i);
+            // rows of a loaded whole output layer before this shard's part
+            size_t skip = 0;
+            if (_sharded && i == noOfLayers - 1) {
+                size_t end;
+                shardRange(sizesOfLayers[i], shardRank(), &_shardBegin, &end);
+                nodes = end - _shardBegin;
+                string shardName = name + "_shard_" + to_string(shardRank());
+                if (arr.count("w_layer_" + shardName))
+                    name = shardName;
+                else
+                    skip = _shardBegin;
+            }
+            // layers in arr start from the saved parameters, the others are initialized
+            if(arr.count("w_layer_"+name)){
+                weightArr = arr["w_layer_"+name];
+                weight = weightArr.data<float>() + skip * sizesOfLayers[i - 1];
+                biasArr = arr["b_layer_"+name];
+                bias = biasArr.data<float>() + skip;
 
-                adamArr = arr["am_layer_"+to_string(i)];
-                adamAvgMom = adamArr.data<float>();
-                adamvArr = arr["av_layer_"+to_string(i)];
-                adamAvgVel = adamvArr.data<float>();
+                adamArr = arr["am_layer_"+name];
+                adamAvgMom = adamArr.data<float>() + skip * sizesOfLayers[i - 1];
+                adamvArr = arr["av_layer_"+name];
+                adamAvgVel = adamvArr.data<float>() + skip * sizesOfLayers[i - 1];
+            }
+            resumeLayer(i, nodes, sizesOfLayers[i - 1], &weight, &bias, &adamAvgMom, &adamAvgVel);
+            _hiddenlayers[i] = new Layer(nodes, sizesOfLayers[i - 1], i, _layersTypes[i], _currentBatchSize,  K[i], L[i], RangePow[i], Sparsity[i], weight, bias, adamAvgMom, adamAvgVel);
+            if (_sharded && i == noOfLayers - 1) {
+                _hiddenlayers[i]->_shard = shardRank();
+                cout << "Shard " << shardRank() << " of " << shardCount() << ": output nodes " << _shardBegin << "-" << _shardBegin + nodes - 1 << endl;
             }
-            _hiddenlayers[i] = new Layer(sizesOfLayers[i], sizesOfLayers[i - 1], i, _layersTypes[i], _currentBatchSize,  K[i], L[i], RangePow[i], Sparsity[i], weight, bias, adamAvgMom, adamAvgVel);
         } else {
 
             cnpy::NpyArray weightArr, biasArr, adamArr, adamvArr;
-            float* weight, *bias, *adamAvgMom, *adamAvgVel;
-            if(LOADWEIGHT){
+            float* weight = NULL, *bias = NULL, *adamAvgMom = NULL, *adamAvgVel = NULL;
+            if(arr.count("w_layer_"+to_string(i))){
                 weightArr = arr["w_layer_"+to_string(i)];
                 weight = weightArr.data<float>();
                 biasArr = arr["b_layer_"+to_string(i)];
@@ -50,10 +129,149 @@ Network::Network(int *sizesOfLayers, NodeType *layersTypes, int noOfLayers, int
                 adamvArr = arr["av_layer_"+to_string(i)];
                 adamAvgVel = adamvArr.data<float>();
             }
+            resumeLayer(i, sizesOfLayers[i], inputdim, &weight, &bias, &adamAvgMom, &adamAvgVel);
             _hiddenlayers[i] = new Layer(sizesOfLayers[i], inputdim, i, _layersTypes[i], _currentBatchSize, K[i], L[i], RangePow[i], Sparsity[i], weight, bias, adamAvgMom, adamAvgVel);
         }
     }
     cout << "after layer" << endl;
+    arenaReport();
+    ledgerReport("at startup");
+    _frozenMap = NULL;
+    _frozenBytes = 0;
+    allocateWorkspace();
+
+    if (_stateMap) {
+        // gradients accumulated by the other workers since their last update are lost with them
+        for (int i = 0; i < noOfLayers; i++) {
+            if (_hiddenlayers[i])
+                _hiddenlayers[i]->restoreState(stateLayer(_stateMap, i), workerRank() == 0);
+        }
+        const StateHeader* header = (const StateHeader*) _stateMap;
+        // hashers and node orders were just drawn from the same streams as before, later draws continue them
+        setStreamIds(header->_streamIds);
+        _batchesSinceSync = header->_batchesSinceSync;
+        cout << "Resumed from " << stateFile << " at batch " << header->_iter << endl;
+    }
+}
+
+
+// a resumed layer's parameters are the state's sections, which must have the layer's shape
+void Network::resumeLayer(int i, size_t nodes, int inputs, float** weights, float** bias, float** adamAvgMom, float** adamAvgVel)
+{
+    if (_stateMap == NULL)
+        return;
+    LayerState state = stateLayer(_stateMap, i);
+    if (state._nodes != nodes || state._inputs != (size_t) inputs) {
+        cout << "Training state has " << state._nodes << " x " << state._inputs << " parameters for layer " << i
+             << ", the config " << nodes << " x " << inputs << endl;
+        exit(1);
+    }
+    *weights = state._weights;
+    *bias = state._bias;
+    *adamAvgMom = state._adamAvgMom;
+    *adamAvgVel = state._adamAvgVel;
+}
+
+
+/*
+* Network of a frozen model (Frozen.h), for inference only: the file is mapped read-only and the
+* layers use it in place. Layer sizes, types and inference sparsities come from the file.
+*/
+Network::Network(string frozenFile, int batchSize) {
+    _stateMap = NULL;
+    _stateBytes = 0;
+    _frozenMap = (char*) frozenMap(frozenFile.c_str(), &_frozenBytes);
+    if (_frozenMap == NULL || !frozenCheck(_frozenMap, _frozenBytes)) {
+        cout << "Could not load frozen model " << frozenFile << endl;
+        exit(1);
+    }
+    const FrozenHeader* header = (const FrozenHeader*) _frozenMap;
+    const FrozenLayer* layers = (const FrozenLayer*) (header + 1);
+
+    _numberOfLayers = header->_layers;
+    _hiddenlayers = new Layer *[_numberOfLayers];
+    _sizesOfLayers = new int[_numberOfLayers];
+    _layersTypes = new NodeType[_numberOfLayers];
+    _frozenSparsity.resize(2 * _numberOfLayers);
+    _Sparsity = &_frozenSparsity[0];
+    _learningRate = 0;
+    _currentBatchSize = batchSize;
+    _sharded = false;
+    _shardBegin = 0;
+
+    for (int i = 0; i < _numberOfLayers; i++) {
+        _sizesOfLayers[i] = layers[i]._nodes;
+        _layersTypes[i] = (NodeType) layers[i]._type;
+        _Sparsity[i] = layers[i]._sparsity;
+        _Sparsity[_numberOfLayers + i] = layers[i]._inferenceSparsity;
+        _hiddenlayers[i] = new Layer(layers[i], _frozenMap, i, batchSize);
+    }
+    cout << "Mapped frozen model " << frozenFile << ": " << _numberOfLayers << " layers, " << (_frozenBytes >> 20) << " MB" << endl;
+    ledgerReport("at startup");
+    allocateWorkspace();
+}
+
+
+void Network::allocateWorkspace()
+{
+    int noOfLayers = _numberOfLayers;
+    _activeNodesPerBatch = new int**[_currentBatchSize];
+    _activeValuesPerBatch = new float**[_currentBatchSize];
+    _sizesPerBatch = new int*[_currentBatchSize];
+    _capacityPerBatch = new int*[_currentBatchSize];
+    for (int i = 0; i < _currentBatchSize; i++) {
+        _activeNodesPerBatch[i] = new int*[noOfLayers + 1]();
+        _activeValuesPerBatch[i] = new float*[noOfLayers + 1]();
+        _sizesPerBatch[i] = new int[noOfLayers + 1]();
+        _capacityPerBatch[i] = new int[noOfLayers + 1]();
+    }
+    _avgRetrieval = new int[noOfLayers]();
+    _scheduler = new Scheduler(omp_get_max_threads());
+    _pendingUpdate = false;
+    _pendingLr = 0;
+    _syncPeriod = 1;
+    _batchesSinceSync = 0;
+    _checkpointRows = 0;
+    _checkpointLevel = 0;
+}
+
+
+// with several workers, how many of its own batches a worker accumulates before updating the shared parameters
+void Network::setSyncPeriod(int period)
+{
+    _syncPeriod = period > 0 ? period : 1;
+}
+
+
+// how the output layer's Mode 4 padding is drawn, see AliasTable.h
+void Network::setNegativeSampling(int mode, float power)
+{
+    _hiddenlayers[_numberOfLayers - 1]->setNegativeSampling(mode, power);
+}
+
+
+/*
+* Makes sure sample's buffers can hold every layer's active set for this sparsity and label count.
+* Buffers only grow, so after the first few batches this does nothing.
+*/
+void Network::reserveWorkspace(int sample, int labelsize, float* Sparsity)
+{
+    for (int j = 0; j < _numberOfLayers; j++) {
+        // a shard process receives the last hidden layer's active nodes, at most all of them
+        int capacity = _hiddenlayers[j] ? _hiddenlayers[j]->maxActiveNodes(labelsize, Sparsity[j]) : _sizesOfLayers[j];
+        if (capacity > _capacityPerBatch[sample][j + 1]) {
+            delete[] _activeNodesPerBatch[sample][j + 1];
+            delete[] _activeValuesPerBatch[sample][j + 1];
+            _activeNodesPerBatch[sample][j + 1] = new int[capacity];
+            _activeValuesPerBatch[sample][j + 1] = new float[capacity];
+            _capacityPerBatch[sample][j + 1] = capacity;
+        }
+    }
+}
+
+
+int Network::getLayerCount() {
+    return _numberOfLayers;
 }
 
 
@@ -67,62 +285,178 @@ Layer *Network::getLayer(int LayerID) {
 }
 
 
-int Network::predictClass(int **inputIndices, float **inputValues, int *length, int **labels, int *labelsize) {
-    int correctPred = 0;
+/*
+* The k largest (score, id) pairs of the n given, best first, through a min-heap of size k
+* holding the best seen so far. Returns how many there are, at most k.
+*/
+static int selectTopK(const float* scores, const int* ids, int n, int k, pair<float, int>* heap)
+{
+    int size = 0;
+    for (int j = 0; j < n; j++) {
+        if (size < k) {
+            heap[size++] = make_pair(scores[j], ids[j]);
+            std::push_heap(heap, heap + size, std::greater<pair<float, int> >());
+        } else if (scores[j] > heap[0].first) {
+            std::pop_heap(heap, heap + size, std::greater<pair<float, int> >());
+            heap[size - 1] = make_pair(scores[j], ids[j]);
+            std::push_heap(heap, heap + size, std::greater<pair<float, int> >());
+        }
+    }
+    std::sort_heap(heap, heap + size, std::greater<pair<float, int> >());
+    return size;
+}
+
+
+/*
+* Top k classes of every sample of the batch: topLabels[i * k + r] and topScores[i * k + r] hold the
+* r-th best label of sample i and its softmax probability over the sample's active output nodes.
+* Samples with fewer than k active nodes are padded with label -1 and score 0.
+*/
+void Network::predictTopK(int **inputIndices, float **inputValues, int *length, int k, int *topLabels, float *topScores) {
+    flushUpdates();
 
     auto t1 = std::chrono::high_resolution_clock::now();
-    #pragma omp parallel for reduction(+:correctPred)
-    for (int i = 0; i < _currentBatchSize; i++) {
-        int **activenodesperlayer = new int *[_numberOfLayers + 1]();
-        float **activeValuesperlayer = new float *[_numberOfLayers + 1]();
-        int *sizes = new int[_numberOfLayers + 1]();
+    if (!_sharded) {
+        predictTopK(_inference, inputIndices, inputValues, length, _currentBatchSize, k, topLabels, topScores);
+    } else {
+        // a sharded output layer is queried by every shard once the hidden layers are done
+        #pragma omp parallel for
+        for (int i = 0; i < _currentBatchSize; i++) {
+            reserveWorkspace(i, 0, _Sparsity + _numberOfLayers);
+            int **activenodesperlayer = _activeNodesPerBatch[i];
+            float **activeValuesperlayer = _activeValuesPerBatch[i];
+            int *sizes = _sizesPerBatch[i];
+
+            activenodesperlayer[0] = inputIndices[i];
+            activeValuesperlayer[0] = inputValues[i];
+            sizes[0] = length[i];
+
+            for (int j = 0; j < _numberOfLayers - 1; j++) {
+                _hiddenlayers[j]->queryActiveNodeandComputeActivations(activenodesperlayer, activeValuesperlayer, sizes, j, i, NULL, 0,
+                        _Sparsity[_numberOfLayers+j], -1);
+            }
+        }
+        shardedTopK(k, topLabels, topScores);
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    float timeDiffInMiliseconds = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+    std::cout << "Inference takes " << timeDiffInMiliseconds/1000 << " milliseconds" << std::endl;
+}
+
+
+// buffers of the context's first batchSize samples, as reserveWorkspace does for a training sample
+void Network::reserveContext(InferenceContext& context, int batchSize) const
+{
+    if (context._samples.size() < (size_t) batchSize)
+        context._samples.resize(batchSize);
+    for (int i = 0; i < batchSize; i++) {
+        InferenceSample& sample = context._samples[i];
+        sample._nodes.resize(_numberOfLayers);
+        sample._values.resize(_numberOfLayers);
+        sample._nodePointers.resize(_numberOfLayers + 1);
+        sample._valuePointers.resize(_numberOfLayers + 1);
+        sample._sizes.resize(_numberOfLayers + 1);
+        for (int j = 0; j < _numberOfLayers; j++) {
+            size_t len = _hiddenlayers[j]->maxActiveNodes(0, _Sparsity[_numberOfLayers + j]);
+            if (sample._nodes[j].size() < len) {
+                sample._nodes[j].resize(len);
+                sample._values[j].resize(len);
+            }
+            sample._nodePointers[j + 1] = &sample._nodes[j][0];
+            sample._valuePointers[j + 1] = &sample._values[j][0];
+        }
+    }
+}
+
+
+/*
+* predictTopK through the read-only forward path: all per-request state is in the caller's context,
+* nothing of the network is written, so concurrent calls with their own contexts are safe and may
+* use any batch size. Training may run meanwhile, HOGWILD-style: predictions then see weights and
+* tables in whatever state the updates have them. Not available with a sharded output layer, whose
+* shards answer one request at a time.
+*/
+void Network::predictTopK(InferenceContext& context, int **inputIndices, float **inputValues, int *length, int batchSize, int k,
+        int *topLabels, float *topScores) const {
+    if (_sharded) {
+        cout << "Inference with a context is not supported with Shards" << endl;
+        std::fill(topLabels, topLabels + batchSize * k, -1);
+        std::fill(topScores, topScores + batchSize * k, 0);
+        return;
+    }
+    reserveContext(context, batchSize);
+
+    int last = _numberOfLayers - 1;
+    #pragma omp parallel for
+    for (int i = 0; i < batchSize; i++) {
+        InferenceSample& sample = context._samples[i];
+        int **activenodesperlayer = &sample._nodePointers[0];
+        float **activeValuesperlayer = &sample._valuePointers[0];
+        int *sizes = &sample._sizes[0];
 
         activenodesperlayer[0] = inputIndices[i];
         activeValuesperlayer[0] = inputValues[i];
         sizes[0] = length[i];
 
-        //inference
         for (int j = 0; j < _numberOfLayers; j++) {
-            _hiddenlayers[j]->queryActiveNodeandComputeActivations(activenodesperlayer, activeValuesperlayer, sizes, j, i, labels[i], 0,
-                    _Sparsity[_numberOfLayers+j], -1);
-        }
-
-        //compute softmax
-        int noOfClasses = sizes[_numberOfLayers];
-        float max_act = -222222222;
-        int predict_class = -1;
-        for (int k = 0; k < noOfClasses; k++) {
-            float cur_act = _hiddenlayers[_numberOfLayers - 1]->getNodebyID(activenodesperlayer[_numberOfLayers][k])->getLastActivation(i);
-            if (max_act < cur_act) {
-                max_act = cur_act;
-                predict_class = activenodesperlayer[_numberOfLayers][k];
-            }
+            _hiddenlayers[j]->queryActiveNodes(activenodesperlayer, activeValuesperlayer, sizes, j, i, NULL, 0, _Sparsity[_numberOfLayers + j], -1);
+            _hiddenlayers[j]->inferActivations(activenodesperlayer, activeValuesperlayer, sizes, j);
         }
+        sample._normalization = _hiddenlayers[last]->inferSoftmax(activeValuesperlayer, sizes, last);
 
-        if (std::find (labels[i], labels[i]+labelsize[i], predict_class)!= labels[i]+labelsize[i]) {
-            correctPred++;
+        // the softmax numerators are normalized only for the top k
+        static thread_local vector<pair<float, int> > heap;
+        heap.resize(k);
+        int found = selectTopK(activeValuesperlayer[_numberOfLayers], activenodesperlayer[_numberOfLayers], sizes[_numberOfLayers], k, &heap[0]);
+        for (int r = 0; r < k; r++) {
+            topLabels[i * k + r] = r < found ? heap[r].second : -1;
+            topScores[i * k + r] = r < found ? heap[r].first / sample._normalization : 0;
         }
+    }
+}
 
-        delete[] sizes;
-        for (int j = 1; j < _numberOfLayers + 1; j++) {
-            delete[] activenodesperlayer[j];
-            delete[] activeValuesperlayer[j];
+
+/*
+* Batched precision: precision[r] gets the sum over the batch of P@(r + 1), the share of a sample's
+* top r + 1 predictions that are among its labels, for r < k.
+*/
+void Network::precisionAtK(int **inputIndices, float **inputValues, int *length, int **labels, int *labelsize, int k, float *precision) {
+    vector<int> topLabels(_currentBatchSize * k);
+    vector<float> topScores(_currentBatchSize * k);
+    predictTopK(inputIndices, inputValues, length, k, &topLabels[0], &topScores[0]);
+
+    for (int r = 0; r < k; r++)
+        precision[r] = 0;
+    for (int i = 0; i < _currentBatchSize; i++) {
+        int hits = 0;
+        for (int r = 0; r < k; r++) {
+            int predicted = topLabels[i * k + r];
+            if (predicted >= 0 && std::find(labels[i], labels[i] + labelsize[i], predicted) != labels[i] + labelsize[i])
+                hits++;
+            precision[r] += hits * 1.0 / (r + 1);
         }
-        delete[] activenodesperlayer;
-        delete[] activeValuesperlayer;
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
-    float timeDiffInMiliseconds = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
-    std::cout << "Inference takes " << timeDiffInMiliseconds/1000 << " milliseconds" << std::endl;
+}
+
 
-    return correctPred;
+int Network::predictClass(int **inputIndices, float **inputValues, int *length, int **labels, int *labelsize) {
+    float correctPred;
+    precisionAtK(inputIndices, inputValues, length, labels, labelsize, 1, &correctPred);
+    return (int) correctPred;
 }
 
 
 int Network::ProcessInput(int **inputIndices, float **inputValues, int *lengths, int **labels, int *labelsize, int iter, bool rehash, bool rebuild) {
+    if (_frozenMap) {
+        cout << "A frozen model is for inference only" << endl;
+        return 0;
+    }
 
+    _phaseLog.batchBegin();
     float logloss = 0.0;
-    int* avg_retrieval = new int[_numberOfLayers]();
+    long long allocationsBefore = allocationCount();
+    int* avg_retrieval = _avgRetrieval;
 
     for (int j = 0; j < _numberOfLayers; j++)
         avg_retrieval[j] = 0;
@@ -132,6 +466,20 @@ int Network::ProcessInput(int **inputIndices, float **inputValues, int *lengths,
         //_learningRate *= 0.5;
         _hiddenlayers[1]->updateRandomNodes();
     }
+    // label counts behind the output layer's negatives, whose table follows them at every rehash
+    Layer* output = _hiddenlayers[_numberOfLayers - 1];
+    for (int i = 0; i < _currentBatchSize; i++)
+        output->countLabels(labels[i], labelsize[i], _shardBegin);
+    if (rehash)
+        output->rebuildNegatives();
+    bool overlapUpdates = UPDATE_STALENESS && WORK_STEALING && ADAM;
+    // gradients keep accumulating in _t until the sync period is over; a rehash needs the update first
+    _batchesSinceSync++;
+    bool sync = _batchesSinceSync >= _syncPeriod || rehash || rebuild;
+    if (sync)
+        _batchesSinceSync = 0;
+    // the sweep of a batch without rehash/rebuild is left for the next batch's scheduler run
+    bool deferred = sync && overlapUpdates && !rehash && !rebuild;
     float tmplr = _learningRate;
     if (ADAM) {
         tmplr = _learningRate * sqrt((1 - pow(BETA2, iter + 1))) /
@@ -140,71 +488,155 @@ int Network::ProcessInput(int **inputIndices, float **inputValues, int *lengths,
 //        tmplr *= pow(0.9, iter/10.0);
     }
 
-    int*** activeNodesPerBatch = new int**[_currentBatchSize];
-    float*** activeValuesPerBatch = new float**[_currentBatchSize];
-    int** sizesPerBatch = new int*[_currentBatchSize];
-#pragma omp parallel for
-    for (int i = 0; i < _currentBatchSize; i++) {
-        int **activenodesperlayer = new int *[_numberOfLayers + 1]();
-        float **activeValuesperlayer = new float *[_numberOfLayers + 1]();
-        int *sizes = new int[_numberOfLayers + 1]();
-
-        activeNodesPerBatch[i] = activenodesperlayer;
-        activeValuesPerBatch[i] = activeValuesperlayer;
-        sizesPerBatch[i] = sizes;
+    int*** activeNodesPerBatch = _activeNodesPerBatch;
+    float*** activeValuesPerBatch = _activeValuesPerBatch;
+    int** sizesPerBatch = _sizesPerBatch;
+    // with BATCH_SOFTMAX the output layer is computed once for the whole batch, between the per-sample passes,
+    // and so is a sharded one, together with the other shards
+    int last = _numberOfLayers - 1;
+    bool batchSoftmax = BATCH_SOFTMAX && _numberOfLayers > 1 && !_sharded;
+    int forwardEnd = _sharded ? last - 1 : last;
 
-        activenodesperlayer[0] = inputIndices[i];  // inputs parsed from training data file
-        activeValuesperlayer[0] = inputValues[i];
-        sizes[0] = lengths[i];
+    // forward pass of sample i through layer j
+    auto forwardLayer = [&](int i, int j)
+    {
+        int **activenodesperlayer = activeNodesPerBatch[i];
+        float **activeValuesperlayer = activeValuesPerBatch[i];
+        int *sizes = sizesPerBatch[i];
+        if (j == 0) {
+            reserveWorkspace(i, labelsize[i], _Sparsity);
+            activenodesperlayer[0] = inputIndices[i];  // inputs parsed from training data file
+            activeValuesperlayer[0] = inputValues[i];
+            sizes[0] = lengths[i];
+        }
         int in;
-        //auto t1 = std::chrono::high_resolution_clock::now();
-        for (int j = 0; j < _numberOfLayers; j++) {
+        if (batchSoftmax && j == last) {
+            in = _hiddenlayers[j]->queryActiveNodes(activenodesperlayer, activeValuesperlayer, sizes, j, i, labels[i], labelsize[i],
+                    _Sparsity[j], iter*_currentBatchSize+i);
+        } else {
             in = _hiddenlayers[j]->queryActiveNodeandComputeActivations(activenodesperlayer, activeValuesperlayer, sizes, j, i, labels[i], labelsize[i],
                     _Sparsity[j], iter*_currentBatchSize+i);
-            avg_retrieval[j] += in;
-        }
-
-        //Now backpropagate.
-        // layers
-        for (int j = _numberOfLayers - 1; j >= 0; j--) {
-            Layer* layer = _hiddenlayers[j];
-            Layer* prev_layer = _hiddenlayers[j - 1];
-            // nodes
-            for (int k = 0; k < sizesPerBatch[i][j + 1]; k++) {
-                Node* node = layer->getNodebyID(activeNodesPerBatch[i][j + 1][k]);
-                if (j == _numberOfLayers - 1) {
-                    //TODO: Compute Extra stats: labels[i];
-                    node->ComputeExtaStatsForSoftMax(layer->getNomalizationConstant(i), i, labels[i], labelsize[i]);
+        }
+#pragma omp atomic
+        avg_retrieval[j] += in;
+    };
+
+    // backpropagate sample i through layer j
+    auto backPropagateLayer = [&](int i, int j)
+    {
+        PHASE_SCOPE(PHASE_BACKPROP);
+        Layer* layer = _hiddenlayers[j];
+        Layer* prev_layer = j > 0 ? _hiddenlayers[j - 1] : NULL;
+        if (j == 0 && layer->_columnMajor) {
+            layer->backPropagateColumns(inputIndices[i], inputValues[i], lengths[i], i);
+        }
+        // nodes
+        for (int k = 0; k < sizesPerBatch[i][j + 1]; k++) {
+            Node* node = layer->getNodebyID(activeNodesPerBatch[i][j + 1][k]);
+            if (j == _numberOfLayers - 1) {
+                //TODO: Compute Extra stats: labels[i];
+                node->ComputeExtaStatsForSoftMax(layer->getNomalizationConstant(i), i, labels[i], labelsize[i]);
+            }
+            if (j != 0) {
+                node->backPropagate(prev_layer->getAllNodes(), activeNodesPerBatch[i][j], sizesPerBatch[i][j], tmplr, i);
+            } else if (layer->_columnMajor) {
+                // weight gradients already scattered by the layer, only the bias and bookkeeping remain
+                node->backPropagateFirstLayer(NULL, NULL, 0, tmplr, i);
+            } else {
+                node->backPropagateFirstLayer(inputIndices[i], inputValues[i], lengths[i], tmplr, i);
+            }
+        }
+    };
+
+    // stage j < _numberOfLayers is the forward step through layer j, stage _numberOfLayers + k the
+    // backward step through layer last - k; returns the sample's next stage, -1 when it is done
+    auto runStage = [&](int i, int stage)
+    {
+        if (stage < _numberOfLayers) {
+            forwardLayer(i, stage);
+            if (stage < forwardEnd)
+                return stage + 1;
+            return (batchSoftmax || _sharded) ? -1 : _numberOfLayers;
+        }
+        int j = last - (stage - _numberOfLayers);
+        backPropagateLayer(i, j);
+        return j > 0 ? stage + 1 : -1;
+    };
+
+    // every sample from stage on, either as stealable (sample, stage) tasks or one sample per iteration.
+    // With withUpdates the previous batch's deferred sweep is seeded first, as (chunk, -1 - layer) tasks:
+    // owners pop their newest tasks, the samples, and idle threads steal the oldest, the sweep chunks.
+    auto runSamples = [&](int stage, bool withUpdates)
+    {
+        if (WORK_STEALING) {
+            size_t tasks = _currentBatchSize;
+            for (int l = 0; withUpdates && l < _numberOfLayers; l++) {
+                if (!_hiddenlayers[l]->_columnMajor)
+                    tasks += (_hiddenlayers[l]->_noOfNodes + STEAL_CHUNK - 1) / STEAL_CHUNK;
+            }
+            _scheduler->reserve(tasks);
+            for (int l = 0; withUpdates && l < _numberOfLayers; l++) {
+                if (_hiddenlayers[l]->_columnMajor)
+                    continue;
+                int chunks = (_hiddenlayers[l]->_noOfNodes + STEAL_CHUNK - 1) / STEAL_CHUNK;
+                for (int c = 0; c < chunks; c++) {
+                    Task task = {c, -1 - l};
+                    _scheduler->seed((long long) c * _scheduler->threads() / chunks, task);
+                }
+            }
+            for (int i = 0; i < _currentBatchSize; i++) {
+                Task task = {i, stage};
+                _scheduler->seed((long long) i * _scheduler->threads() / _currentBatchSize, task);
+            }
+            _scheduler->run([&](Task task)
+            {
+                if (task._stage < 0) {
+                    sweepChunk(-1 - task._stage, task._id, _pendingLr, false, true);
+                    return;
                 }
-                if (j != 0) {
-                    node->backPropagate(prev_layer->getAllNodes(), activeNodesPerBatch[i][j], sizesPerBatch[i][j], tmplr, i);
-                } else {
-                    node->backPropagateFirstLayer(inputIndices[i], inputValues[i], lengths[i], tmplr, i);
+                int next = runStage(task._id, task._stage);
+                if (next >= 0) {
+                    Task follow = {task._id, next};
+                    _scheduler->push(follow);
                 }
+            });
+        } else {
+#pragma omp parallel for
+            for (int i = 0; i < _currentBatchSize; i++) {
+                for (int s = stage; s >= 0; s = runStage(i, s));
             }
         }
-    }
-    for (int i = 0; i < _currentBatchSize; i++) {
-        //Free memory to avoid leaks
-        delete[] sizesPerBatch[i];
-        for (int j = 1; j < _numberOfLayers + 1; j++) {
-            delete[] activeNodesPerBatch[i][j];
-            delete[] activeValuesPerBatch[i][j];
+    };
+
+    runSamples(0, _pendingUpdate);
+    _pendingUpdate = false;
+
+    if (batchSoftmax) {
+        Layer* layer = _hiddenlayers[last];
+        layer->batchComputeActivations(activeNodesPerBatch, activeValuesPerBatch, sizesPerBatch, last, _currentBatchSize);
+#pragma omp parallel for
+        for (int i = 0; i < _currentBatchSize; i++) {
+            PHASE_SCOPE(PHASE_BACKPROP);
+            for (int k = 0; k < sizesPerBatch[i][last + 1]; k++) {
+                Node* node = layer->getNodebyID(activeNodesPerBatch[i][last + 1][k]);
+                node->ComputeExtaStatsForSoftMax(layer->getNomalizationConstant(i), i, labels[i], labelsize[i]);
+            }
         }
-        delete[] activeNodesPerBatch[i];
-        delete[] activeValuesPerBatch[i];
+        layer->batchBackPropagate(_hiddenlayers[last - 1]->getAllNodes(), activeNodesPerBatch, activeValuesPerBatch, sizesPerBatch, last,
+                _currentBatchSize, tmplr);
+        runSamples(_numberOfLayers + 1, false);
+    }
+    if (_sharded) {
+        shardedSoftmax(labels, labelsize, iter, tmplr, rehash, rebuild, sync, deferred);
+        runSamples(_numberOfLayers + 1, false);
     }
 
-    delete[] activeNodesPerBatch;
-    delete[] activeValuesPerBatch;
-    delete[] sizesPerBatch;
-
+    long long allocationsForward = allocationCount() - allocationsBefore;
 
-    auto t1 = std::chrono::high_resolution_clock::now();
     bool tmpRehash;
     bool tmpRebuild;
 
-    for (int l=0; l<_numberOfLayers ;l++) {
+    for (int l=0; sync && l<_numberOfLayers ;l++) {
         if(rehash & _Sparsity[l]<1){
             tmpRehash=true;
         }else{
@@ -216,84 +648,864 @@ int Network::ProcessInput(int **inputIndices, float **inputValues, int *lengths,
             tmpRebuild=false;
         }
         if (tmpRehash) {
+            PHASE_SCOPE(PHASE_REHASH);
             _hiddenlayers[l]->_hashTables->clear();
         }
         if (tmpRebuild){
             _hiddenlayers[l]->updateTable();
         }
-        int ratio = 1;
-#pragma omp parallel for
-        for (size_t m = 0; m < _hiddenlayers[l]->_noOfNodes; m++)
+        if (_hiddenlayers[l]->_columnMajor) {
+            _hiddenlayers[l]->adamUpdateColumns(tmplr);
+            continue;
+        }
+        if (deferred) {
+            continue;
+        }
+        sweepLayer(l, tmplr, tmpRehash, false);
+    }
+    if (rehash || rebuild)
+        ledgerReport("after rehash at batch " + to_string(iter));
+
+    if (deferred) {
+        for (int l = 0; l < _numberOfLayers; l++) {
+            if (!_hiddenlayers[l]->_columnMajor)
+                _hiddenlayers[l]->swapGradients();
+        }
+        _pendingUpdate = true;
+        _pendingLr = tmplr;
+    }
+
+    if (DEBUG&rehash) {
+        cout << "Avg sample size = " << avg_retrieval[0]*1.0/_currentBatchSize<<" "<<avg_retrieval[1]*1.0/_currentBatchSize << endl;
+        if (COUNT_ALLOCATIONS)
+            cout << "Heap allocations in this batch = " << allocationCount() - allocationsBefore << " (forward/backward " << allocationsForward << ")" << endl;
+        if (NUMA) {
+            for (int l = 0; l < _numberOfLayers; l++)
+                cout << "NUMA remote access ratio layer " << l << " = " << _hiddenlayers[l]->numaRemoteRatio() << endl;
+        }
+        if (WORK_STEALING) {
+            cout << "Idle ms per thread since last rehash =";
+            for (int t = 0; t < _scheduler->threads(); t++)
+                cout << " " << _scheduler->idleMs(t);
+            cout << endl;
+            _scheduler->resetIdle();
+        }
+    }
+    _phaseLog.batchEnd(iter);
+    return logloss;
+}
+
+
+/*
+* Adam step (or mirror copy) of node m of layer l, optionally reinserting it into the cleared tables.
+* pending sweeps the previous batch's gradients, see Layer::swapGradients.
+*/
+void Network::updateNode(int l, size_t m, float tmplr, bool rehash, bool pending)
+{
+    int ratio = 1;
+    Node *tmp = _hiddenlayers[l]->getNodebyID(m);
+    int dim = tmp->_dim;
+    static thread_local vector<float> localWeights;
+    localWeights.assign(tmp->_weights, tmp->_weights + dim);
+    float* local_weights = &localWeights[0];
+
+    if(ADAM){
+        float* grad = pending ? tmp->_tPending : tmp->_t;
+        float& gradbias = pending ? tmp->_tbiasPending : tmp->_tbias;
+        for (int d=0; d < dim;d++){
+            float _t = grad[d];
+            float Mom = tmp->_adamAvgMom[d];
+            float Vel = tmp->_adamAvgVel[d];
+            Mom = BETA1 * Mom + (1 - BETA1) * _t;
+            Vel = BETA2 * Vel + (1 - BETA2) * _t * _t;
+            local_weights[d] += ratio * tmplr * Mom / (sqrt(Vel) + EPS);
+            tmp->_adamAvgMom[d] = Mom;
+            tmp->_adamAvgVel[d] = Vel;
+            grad[d] = 0;
+        }
+
+        tmp->_adamAvgMombias = BETA1 * tmp->_adamAvgMombias + (1 - BETA1) * gradbias;
+        tmp->_adamAvgVelbias = BETA2 * tmp->_adamAvgVelbias + (1 - BETA2) * gradbias * gradbias;
+        *tmp->_bias += ratio*tmplr * tmp->_adamAvgMombias / (sqrt(tmp->_adamAvgVelbias) + EPS);
+        gradbias = 0;
+    }
+    else
+    {
+        std::copy(tmp->_mirrorWeights, tmp->_mirrorWeights+(tmp->_dim) , tmp->_weights);
+        *tmp->_bias = tmp->_mirrorbias;
+    }
+    if (rehash) {
+        PHASE_SCOPE(PHASE_REHASH);
+        _hiddenlayers[l]->rehashNode(local_weights, dim, m);
+    }
+
+    std::copy(local_weights, local_weights + dim, tmp->_weights);
+}
+
+
+void Network::sweepChunk(int l, int chunk, float tmplr, bool rehash, bool pending)
+{
+    PHASE_SCOPE(PHASE_UPDATE);
+    size_t end = std::min(_hiddenlayers[l]->_noOfNodes, (size_t) (chunk + 1) * STEAL_CHUNK);
+    for (size_t m = (size_t) chunk * STEAL_CHUNK; m < end; m++)
+        updateNode(l, m, tmplr, rehash, pending);
+}
+
+
+void Network::sweepLayer(int l, float tmplr, bool rehash, bool pending)
+{
+    if (NUMA) {
+        // each socket's threads sweep only the nodes whose rows live on that socket
+#pragma omp parallel
         {
-            Node *tmp = _hiddenlayers[l]->getNodebyID(m);
-            int dim = tmp->_dim;
-            float* local_weights = new float[dim];
-            std::copy(tmp->_weights, tmp->_weights + dim, local_weights);
-
-            if(ADAM){
-                for (int d=0; d < dim;d++){
-                    float _t = tmp->_t[d];
-                    float Mom = tmp->_adamAvgMom[d];
-                    float Vel = tmp->_adamAvgVel[d];
-                    Mom = BETA1 * Mom + (1 - BETA1) * _t;
-                    Vel = BETA2 * Vel + (1 - BETA2) * _t * _t;
-                    local_weights[d] += ratio * tmplr * Mom / (sqrt(Vel) + EPS);
-                    tmp->_adamAvgMom[d] = Mom;
-                    tmp->_adamAvgVel[d] = Vel;
-                    tmp->_t[d] = 0;
-                }
+            PHASE_SCOPE(PHASE_UPDATE);
+            size_t begin, end;
+            numaThreadShare(_hiddenlayers[l]->_noOfNodes, &begin, &end);
+            for (size_t m = begin; m < end; m++)
+                updateNode(l, m, tmplr, rehash, pending);
+        }
+    } else if (WORK_STEALING) {
+        // contiguous chunks seeded in order over the threads, idle threads steal the remaining ones
+        int chunks = (_hiddenlayers[l]->_noOfNodes + STEAL_CHUNK - 1) / STEAL_CHUNK;
+        _scheduler->reserve(chunks);
+        for (int c = 0; c < chunks; c++) {
+            Task task = {c, 0};
+            _scheduler->seed((long long) c * _scheduler->threads() / chunks, task);
+        }
+        _scheduler->run([&](Task task)
+        {
+            sweepChunk(l, task._id, tmplr, rehash, pending);
+        });
+    } else {
+#pragma omp parallel
+        {
+            PHASE_SCOPE(PHASE_UPDATE);
+#pragma omp for nowait
+            for (size_t m = 0; m < _hiddenlayers[l]->_noOfNodes; m++)
+                updateNode(l, m, tmplr, rehash, pending);
+        }
+    }
+    if (rehash)
+        _hiddenlayers[l]->insertRehashed();
+}
 
-                tmp->_adamAvgMombias = BETA1 * tmp->_adamAvgMombias + (1 - BETA1) * tmp->_tbias;
-                tmp->_adamAvgVelbias = BETA2 * tmp->_adamAvgVelbias + (1 - BETA2) * tmp->_tbias * tmp->_tbias;
-                *tmp->_bias += ratio*tmplr * tmp->_adamAvgMombias / (sqrt(tmp->_adamAvgVelbias) + EPS);
-                tmp->_tbias = 0;
+
+// applies a sweep deferred by UPDATE_STALENESS, before the weights are read outside training
+void Network::flushUpdates()
+{
+    if (!_pendingUpdate)
+        return;
+    for (int l = 0; l < _numberOfLayers; l++) {
+        if (!_hiddenlayers[l]->_columnMajor)
+            sweepLayer(l, _pendingLr, false, true);
+    }
+    _pendingUpdate = false;
+}
+
+
+/*
+* Sends the request, and for training and prediction every sample's last hidden layer output
+* (active ids and values) and labels, from shard 0 to all other shards.
+*/
+void Network::shardBroadcast(int op, int iter, float lr, bool rehash, bool rebuild, bool sync, bool deferred, int k, int** labels, int* labelsize)
+{
+    int last = _numberOfLayers - 1;
+    size_t bytes = 0;
+    for (int i = 0; i < _currentBatchSize; i++)
+        bytes += 2 * sizeof(int) + _sizesPerBatch[i][last] * (sizeof(int) + sizeof(float)) + (labels ? labelsize[i] * sizeof(int) : 0);
+    _shardMessage.resize(bytes);
+
+    char* p = &_shardMessage[0];
+    auto put = [&](const void* data, size_t n)
+    {
+        memcpy(p, data, n);
+        p += n;
+    };
+    for (int i = 0; i < _currentBatchSize; i++) {
+        int len = _sizesPerBatch[i][last];
+        int labels_i = labels ? labelsize[i] : 0;
+        put(&len, sizeof(int));
+        put(_activeNodesPerBatch[i][last], len * sizeof(int));
+        put(_activeValuesPerBatch[i][last], len * sizeof(float));
+        put(&labels_i, sizeof(int));
+        if (labels_i)
+            put(labels[i], labels_i * sizeof(int));
+    }
+
+    ShardRequest request = {op, iter, lr, rehash, rebuild, k, bytes, sync, deferred};
+    for (int s = 1; s < shardCount(); s++) {
+        shardSend(s, &request, sizeof(request));
+        shardSend(s, &_shardMessage[0], bytes);
+    }
+}
+
+
+// sample i through this shard's part of the output layer, up to the logits; returns queryActiveNodes' count
+int Network::shardForward(int i, int* label, int labelsize, int iter, float sparsity)
+{
+    int last = _numberOfLayers - 1;
+    Layer* layer = _hiddenlayers[last];
+    static thread_local vector<int> local;
+    local.clear();
+    for (int k = 0; k < labelsize; k++) {
+        if (label[k] >= (long long) _shardBegin && label[k] < (long long) (_shardBegin + layer->_noOfNodes))
+            local.push_back(label[k] - _shardBegin);
+    }
+    int in = layer->queryActiveNodes(_activeNodesPerBatch[i], _activeValuesPerBatch[i], _sizesPerBatch[i], last, i, local.data(), local.size(), sparsity, iter);
+    layer->computeActivations(_activeNodesPerBatch[i], _activeValuesPerBatch[i], _sizesPerBatch[i], last, i);
+    return in;
+}
+
+
+// softmax over this shard's active nodes; keeps the max logit and the sum so the shards can be combined
+void Network::shardSoftmax(int i)
+{
+    int last = _numberOfLayers - 1;
+    float maxValue = 0; // as Layer::computeSoftmax
+    for (int k = 0; k < _sizesPerBatch[i][last + 1]; k++)
+        maxValue = std::max(maxValue, _activeValuesPerBatch[i][last + 1][k]);
+    _hiddenlayers[last]->computeSoftmax(_activeNodesPerBatch[i], _activeValuesPerBatch[i], _sizesPerBatch[i], last, i);
+    _shardPartial[2 * i] = maxValue;
+    _shardPartial[2 * i + 1] = _hiddenlayers[last]->getNomalizationConstant(i);
+}
+
+
+/*
+* Backward step of sample i through this shard's nodes, once _shardNorms holds the global max and
+* sum: each node's exp(x - local max) is normalized by the sum rescaled to the local max.
+* The increments for the last hidden layer are summed into deltas.
+*/
+void Network::shardBackward(int i, int* label, int labelsize, float tmplr, float* deltas)
+{
+    int last = _numberOfLayers - 1;
+    Layer* layer = _hiddenlayers[last];
+    float normalization = _shardNorms[2 * i + 1] * exp(_shardNorms[2 * i] - _shardPartial[2 * i]);
+    for (int k = 0; k < _sizesPerBatch[i][last + 1]; k++) {
+        Node* node = layer->getNodebyID(_activeNodesPerBatch[i][last + 1][k]);
+        node->ComputeExtaStatsForSoftMax(normalization, i, label, labelsize, _shardBegin);
+        node->backPropagate(NULL, _activeNodesPerBatch[i][last], _sizesPerBatch[i][last], tmplr, i, deltas, _activeValuesPerBatch[i][last]);
+    }
+}
+
+
+// the k highest logits of this shard's active nodes for sample i as global ids, best first, padded with id -1
+void Network::shardTopK(int i, int k, ShardBest* best)
+{
+    int last = _numberOfLayers - 1;
+    static thread_local vector<pair<float, int> > heap;
+    heap.resize(k);
+    int found = selectTopK(_activeValuesPerBatch[i][last + 1], _activeNodesPerBatch[i][last + 1], _sizesPerBatch[i][last + 1], k, &heap[0]);
+    for (int r = 0; r < k; r++) {
+        best[r]._score = r < found ? heap[r].first : 0;
+        best[r]._id = r < found ? heap[r].second + (int) _shardBegin : -1;
+    }
+}
+
+
+// every sample's slice of _shardDeltas, one slot per active node of the last hidden layer
+void Network::shardDeltaOffsets()
+{
+    int last = _numberOfLayers - 1;
+    _shardOffsets.resize(_currentBatchSize + 1);
+    _shardOffsets[0] = 0;
+    for (int i = 0; i < _currentBatchSize; i++)
+        _shardOffsets[i + 1] = _shardOffsets[i] + _sizesPerBatch[i][last];
+    _shardDeltas.assign(_shardOffsets[_currentBatchSize], 0);
+}
+
+
+/*
+* Shard 0's side of a training batch through the sharded output layer: broadcast the hidden outputs,
+* combine every shard's (max, sum) into the global softmax normalization, send it back, and apply the
+* summed increments of all shards to the last hidden layer. The other shards update their nodes
+* while shard 0 backpropagates the hidden layers.
+*/
+void Network::shardedSoftmax(int** labels, int* labelsize, int iter, float tmplr, bool rehash, bool rebuild, bool sync, bool deferred)
+{
+    int last = _numberOfLayers - 1;
+    shardBroadcast(SHARD_TRAIN, iter, tmplr, rehash, rebuild, sync, deferred, 0, labels, labelsize);
+
+    _shardPartial.resize(2 * _currentBatchSize);
+#pragma omp parallel for
+    for (int i = 0; i < _currentBatchSize; i++) {
+        int in = shardForward(i, labels[i], labelsize[i], iter * _currentBatchSize + i, _Sparsity[last]);
+        shardSoftmax(i);
+#pragma omp atomic
+        _avgRetrieval[last] += in;
+    }
+
+    _shardNorms = _shardPartial;
+    _shardReceived.resize(2 * _currentBatchSize);
+    for (int s = 1; s < shardCount(); s++) {
+        if (!shardRecv(s, &_shardReceived[0], _shardReceived.size() * sizeof(float))) {
+            cout << "Shard " << s << " is gone" << endl;
+            exit(1);
+        }
+        for (int i = 0; i < _currentBatchSize; i++) {
+            float m = _shardReceived[2 * i], sum = _shardReceived[2 * i + 1];
+            float& M = _shardNorms[2 * i];
+            float& Z = _shardNorms[2 * i + 1];
+            if (m > M) {
+                Z = Z * exp(M - m) + sum;
+                M = m;
+            } else {
+                Z += sum * exp(m - M);
             }
+        }
+    }
+    for (int s = 1; s < shardCount(); s++)
+        shardSend(s, &_shardNorms[0], _shardNorms.size() * sizeof(float));
+
+    shardDeltaOffsets();
+#pragma omp parallel for
+    for (int i = 0; i < _currentBatchSize; i++)
+        shardBackward(i, labels[i], labelsize[i], tmplr, &_shardDeltas[_shardOffsets[i]]);
+
+    _shardReceived.resize(_shardDeltas.size());
+    for (int s = 1; s < shardCount(); s++) {
+        if (!shardRecv(s, &_shardReceived[0], _shardReceived.size() * sizeof(float))) {
+            cout << "Shard " << s << " is gone" << endl;
+            exit(1);
+        }
+        for (size_t d = 0; d < _shardDeltas.size(); d++)
+            _shardDeltas[d] += _shardReceived[d];
+    }
+
+    Node* previousNodes = _hiddenlayers[last - 1]->getAllNodes();
+#pragma omp parallel for
+    for (int i = 0; i < _currentBatchSize; i++) {
+        for (int k = 0; k < _sizesPerBatch[i][last]; k++)
+            previousNodes[_activeNodesPerBatch[i][last][k]].incrementDelta(i, _shardDeltas[_shardOffsets[i] + k]);
+    }
+}
+
+
+/*
+* Loop of the shard processes: answers shard 0's requests with this shard's part of the output layer
+* until it is told to stop or shard 0 is gone.
+*/
+void Network::serveShard()
+{
+    int last = _numberOfLayers - 1;
+    Layer* layer = _hiddenlayers[last];
+    _shardLabels.resize(_currentBatchSize);
+    _shardLabelSizes.resize(_currentBatchSize);
+    _shardPartial.resize(2 * _currentBatchSize);
+    _shardNorms.resize(2 * _currentBatchSize);
+    vector<ShardBest> best;
+
+    ShardRequest request;
+    while (shardRecv(0, &request, sizeof(request)) && request._op != SHARD_STOP) {
+        _shardMessage.resize(request._bytes + 1);
+        if (!shardRecv(0, &_shardMessage[0], request._bytes))
+            break;
+        // a sweep deferred by the last training batch, before anything reads the layer, as on shard 0
+        if (_pendingUpdate) {
+            sweepLayer(last, _pendingLr, false, true);
+            _pendingUpdate = false;
+        }
+        if (request._op == SHARD_SAVE || request._op == SHARD_STATE) {
+            _shardMessage[request._bytes] = 0;
+            string file(&_shardMessage[0]);
+            // a sharded checkpoint's files are written here, shard 0 puts the entries into its manifest
+            if (request._op == SHARD_SAVE && _checkpointRows > 0) {
+                vector<CheckpointArray> arrays;
+                layer->checkpointArrays(arrays, layer->_weights, layer->_bias, layer->_adamAvgMom, layer->_adamAvgVel);
+                size_t bytes = 0, stored = 0;
+                string entries = saveShards(file, request._iter, arrays, _checkpointRows, _checkpointLevel, omp_get_max_threads(), &bytes, &stored);
+                size_t length = entries.size();
+                shardSend(0, &length, sizeof(length));
+                shardSend(0, entries.data(), length);
+                continue;
+            }
+            if (request._op == SHARD_SAVE)
+                layer->saveWeights(file);
             else
-            {
-                std::copy(tmp->_mirrorWeights, tmp->_mirrorWeights+(tmp->_dim) , tmp->_weights);
-                *tmp->_bias = tmp->_mirrorbias;
+                saveState(file + ".shard" + to_string(shardRank()), request._iter);
+            int done = 1;
+            shardSend(0, &done, sizeof(done));
+            continue;
+        }
+
+        // the hidden outputs are copied into the workspace, the labels stay in the message
+        char* p = &_shardMessage[0];
+        for (int i = 0; i < _currentBatchSize; i++) {
+            int len, labels_i;
+            memcpy(&len, p, sizeof(int));
+            char* ids = p + sizeof(int);
+            char* values = ids + len * sizeof(int);
+            memcpy(&labels_i, values + len * sizeof(float), sizeof(int));
+            p = values + len * sizeof(float) + sizeof(int);
+            reserveWorkspace(i, labels_i, request._op == SHARD_TRAIN ? _Sparsity : _Sparsity + _numberOfLayers);
+            memcpy(_activeNodesPerBatch[i][last], ids, len * sizeof(int));
+            memcpy(_activeValuesPerBatch[i][last], values, len * sizeof(float));
+            _sizesPerBatch[i][last] = len;
+            _shardLabels[i] = (int*) p;
+            _shardLabelSizes[i] = labels_i;
+            p += labels_i * sizeof(int);
+            if (request._op == SHARD_TRAIN)
+                layer->countLabels(_shardLabels[i], labels_i, _shardBegin);
+        }
+
+        if (request._op == SHARD_PREDICT) {
+            int k = request._k;
+            best.resize(_currentBatchSize * k);
+#pragma omp parallel for
+            for (int i = 0; i < _currentBatchSize; i++) {
+                shardForward(i, NULL, 0, -1, _Sparsity[_numberOfLayers + last]);
+                shardTopK(i, k, &best[i * k]);
+                shardSoftmax(i);
             }
-            if (tmpRehash) {
-                int *hashes;
-                if(HashFunction==1) {
-                    hashes = _hiddenlayers[l]->_wtaHasher->getHash(local_weights);
-                }else if (HashFunction==2){
-                    hashes = _hiddenlayers[l]->_dwtaHasher->getHashEasy(local_weights, dim, TOPK);
-                }else if (HashFunction==3){
-                    hashes = _hiddenlayers[l]->_MinHasher->getHashEasy(_hiddenlayers[l]->_binids, local_weights, dim, TOPK);
-                }else if (HashFunction==4){
-                    hashes = _hiddenlayers[l]->_srp->getHash(local_weights, dim);
-                }
+            shardSend(0, &best[0], sizeof(ShardBest) * best.size());
+            shardSend(0, &_shardPartial[0], _shardPartial.size() * sizeof(float));
+            continue;
+        }
+
+        if (request._iter % 6946 == 6945)
+            layer->updateRandomNodes();
+        if (request._rehash)
+            layer->rebuildNegatives();
+#pragma omp parallel for
+        for (int i = 0; i < _currentBatchSize; i++) {
+            shardForward(i, _shardLabels[i], _shardLabelSizes[i], request._iter * _currentBatchSize + i, _Sparsity[last]);
+            shardSoftmax(i);
+        }
+        shardSend(0, &_shardPartial[0], _shardPartial.size() * sizeof(float));
+        if (!shardRecv(0, &_shardNorms[0], _shardNorms.size() * sizeof(float)))
+            break;
+
+        shardDeltaOffsets();
+#pragma omp parallel for
+        for (int i = 0; i < _currentBatchSize; i++)
+            shardBackward(i, _shardLabels[i], _shardLabelSizes[i], request._lr, &_shardDeltas[_shardOffsets[i]]);
+        shardSend(0, &_shardDeltas[0], _shardDeltas.size() * sizeof(float));
+
+        // the sweep follows shard 0's schedule (SyncPeriod, UPDATE_STALENESS)
+        if (!request._sync)
+            continue;
+        bool rehash = request._rehash && _Sparsity[last] < 1;
+        if (rehash)
+            layer->_hashTables->clear();
+        if (request._rebuild && _Sparsity[last] < 1)
+            layer->updateTable();
+        if (request._deferred) {
+            layer->swapGradients();
+            _pendingUpdate = true;
+            _pendingLr = request._lr;
+            continue;
+        }
+        sweepLayer(last, request._lr, rehash, false);
+    }
+}
+
 
-                int *hashIndices = _hiddenlayers[l]->_hashTables->hashesToIndex(hashes);
-                int * bucketIndices = _hiddenlayers[l]->_hashTables->add(hashIndices, m+1);
+/*
+* Shard 0's side of predictTopK: every shard reports its k best (logit, global id) per sample and its
+* softmax (max, sum); the best k of all shards are normalized by the combined sum.
+*/
+void Network::shardedTopK(int k, int* topLabels, float* topScores)
+{
+    int last = _numberOfLayers - 1;
+    int shards = shardCount();
+    shardBroadcast(SHARD_PREDICT, -1, 0, false, false, false, false, k, NULL, NULL);
 
-                delete[] hashes;
-                delete[] hashIndices;
-                delete[] bucketIndices;
+    // candidates of shard s for sample i at (i * shards + s) * k
+    vector<ShardBest> best(_currentBatchSize * shards * k);
+    _shardPartial.resize(2 * _currentBatchSize);
+#pragma omp parallel for
+    for (int i = 0; i < _currentBatchSize; i++) {
+        shardForward(i, NULL, 0, -1, _Sparsity[_numberOfLayers + last]);
+        shardTopK(i, k, &best[i * shards * k]);
+        shardSoftmax(i);
+    }
+
+    _shardNorms = _shardPartial;
+    vector<ShardBest> received(_currentBatchSize * k);
+    _shardReceived.resize(2 * _currentBatchSize);
+    for (int s = 1; s < shards; s++) {
+        if (!shardRecv(s, &received[0], sizeof(ShardBest) * received.size())
+                || !shardRecv(s, &_shardReceived[0], _shardReceived.size() * sizeof(float))) {
+            cout << "Shard " << s << " is gone" << endl;
+            exit(1);
+        }
+        for (int i = 0; i < _currentBatchSize; i++) {
+            std::copy(&received[i * k], &received[(i + 1) * k], &best[(i * shards + s) * k]);
+            float m = _shardReceived[2 * i], sum = _shardReceived[2 * i + 1];
+            float& M = _shardNorms[2 * i];
+            float& Z = _shardNorms[2 * i + 1];
+            if (m > M) {
+                Z = Z * exp(M - m) + sum;
+                M = m;
+            } else {
+                Z += sum * exp(m - M);
             }
+        }
+    }
 
-            std::copy(local_weights, local_weights + dim, tmp->_weights);
-            delete[] local_weights;
+#pragma omp parallel for
+    for (int i = 0; i < _currentBatchSize; i++) {
+        static thread_local vector<float> scores;
+        static thread_local vector<int> ids;
+        static thread_local vector<pair<float, int> > heap;
+        scores.clear();
+        ids.clear();
+        for (int c = i * shards * k; c < (i + 1) * shards * k; c++) {
+            if (best[c]._id >= 0) {
+                scores.push_back(best[c]._score);
+                ids.push_back(best[c]._id);
+            }
+        }
+        heap.resize(k);
+        int found = selectTopK(scores.data(), ids.data(), scores.size(), k, &heap[0]);
+        for (int r = 0; r < k; r++) {
+            topLabels[i * k + r] = r < found ? heap[r].second : -1;
+            topScores[i * k + r] = r < found ? exp(heap[r].first - _shardNorms[2 * i]) / _shardNorms[2 * i + 1] : 0;
         }
     }
+}
 
-    if (DEBUG&rehash) {
-        cout << "Avg sample size = " << avg_retrieval[0]*1.0/_currentBatchSize<<" "<<avg_retrieval[1]*1.0/_currentBatchSize << endl;
+
+// shard 0 lets the other shards exit
+void Network::stopShards()
+{
+    if (!_sharded || shardRank() != 0)
+        return;
+    ShardRequest request = {SHARD_STOP, 0, 0, 0, 0, 0, 0};
+    for (int s = 1; s < shardCount(); s++)
+        shardSend(s, &request, sizeof(request));
+}
+
+
+/*
+* Writes the frozen inference model (Frozen.h) of the current parameters and tables. It is written
+* to file.tmp and renamed, so a serving process never maps a partial file.
+*/
+void Network::exportFrozen(string file)
+{
+    flushUpdates();
+    if (_sharded || _frozenMap) {
+        cout << "Frozen export needs the whole model in one process" << endl;
+        return;
     }
-    return logloss;
+    auto t1 = std::chrono::high_resolution_clock::now();
+    string tmp = file + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cout << "Could not write frozen model " << tmp << ": " << strerror(errno) << endl;
+        return;
+    }
+
+    FrozenHeader header;
+    memcpy(header._magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC));
+    header._layers = _numberOfLayers;
+    header._hashFunction = HashFunction;
+    header._bucketSize = BUCKETSIZE;
+    header._binsize = binsize;
+    header._fifo = FIFO;
+    vector<FrozenLayer> layers(_numberOfLayers);
+    size_t offset = sizeof(header) + layers.size() * sizeof(FrozenLayer);
+    for (int i = 0; i < _numberOfLayers && offset > 0; i++) {
+        offset = _hiddenlayers[i]->exportFrozen(fd, offset, &layers[i]);
+        layers[i]._sparsity = _Sparsity[i];
+        layers[i]._inferenceSparsity = _Sparsity[_numberOfLayers + i];
+    }
+    header._inputDim = layers[0]._inputs;
+    // the map covers every section, also the never written blocks of empty buckets at the end
+    bool written = offset > 0 && ftruncate(fd, offset) == 0
+            && frozenWrite(fd, &header, sizeof(header), 0)
+            && frozenWrite(fd, &layers[0], layers.size() * sizeof(FrozenLayer), sizeof(header))
+            && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(tmp.c_str(), file.c_str()) != 0) {
+        cout << "Could not write frozen model " << file << ": " << strerror(errno) << endl;
+        unlink(tmp.c_str());
+        return;
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    cout << "Frozen model " << file << ": " << (offset >> 20) << " MB in "
+         << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms" << endl;
+}
+
+
+// fsync a finished checkpoint and move it over the previous one, so a crash leaves either complete file
+static bool commitCheckpoint(string tmp, string file)
+{
+    int fd = open(tmp.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (!synced || rename(tmp.c_str(), file.c_str()) != 0) {
+        cout << "Could not write checkpoint " << file << ": " << strerror(errno) << endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// how savedweight is written: one npz (rows 0), or a directory of files of up to rows rows (Checkpoint.h)
+void Network::setCheckpointFormat(int rows, int level)
+{
+    _checkpointRows = rows > 0 ? rows : 0;
+    _checkpointLevel = level;
+}
+
+
+// appends the phase times of every batches training batches to file, see Timing.h
+void Network::setPhaseLog(string file, int every)
+{
+    _phaseLog.open(file, every);
+}
+
+
+/*
+* A sharded checkpoint of arrays into dir, written by up to threads threads; with withShards also the other
+* shards' parts of the output layer, which they write themselves. Logs the size and throughput of this process's part.
+*/
+bool Network::writeShards(string dir, const vector<CheckpointArray>& arrays, bool withShards, int threads)
+{
+    auto t1 = std::chrono::high_resolution_clock::now();
+    long long generation = nextGeneration(dir);
+    size_t bytes = 0, stored = 0;
+    string entries = saveShards(dir, generation, arrays, _checkpointRows, _checkpointLevel, threads, &bytes, &stored);
+    bool written = entries != "";
+    for (int s = 1; withShards && s < shardCount(); s++) {
+        ShardRequest request = {SHARD_SAVE, (int) generation, 0, 0, 0, 0, dir.size()};
+        shardSend(s, &request, sizeof(request));
+        shardSend(s, dir.data(), dir.size());
+        // without every shard's entries the generation is not committed
+        size_t length = 0;
+        string part;
+        if (shardRecv(s, &length, sizeof(length)) && length > 0) {
+            part.resize(length);
+            if (!shardRecv(s, &part[0], length))
+                length = 0;
+        }
+        if (length == 0) {
+            cout << "Shard " << s << " did not write its part of checkpoint " << dir << endl;
+            written = false;
+            break;
+        }
+        entries += part;
+    }
+    if (!written || !commitShards(dir, generation, entries))
+        return false;
+    auto t2 = std::chrono::high_resolution_clock::now();
+    double ms = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+    cout << "Checkpoint " << dir << " generation " << generation << ": " << (bytes >> 20) << " MB (" << (stored >> 20)
+         << " MB stored) in " << ms << " ms, " << (ms > 0 ? bytes / 1048576.0 / ms * 1000 : 0) << " MB/s" << endl;
+    return true;
 }
 
 
 void Network::saveWeights(string file)
 {
+    if (_frozenMap) {
+        cout << "A frozen model is for inference only" << endl;
+        return;
+    }
+    finishCheckpoint();
+    flushUpdates();
+    if (_checkpointRows > 0) {
+        // node-major layers are written in place, a column-major one from a node-major copy
+        vector<CheckpointArray> arrays;
+        vector<LayerSnapshot> copies(_numberOfLayers);
+        for (int i = 0; i < _numberOfLayers; i++) {
+            Layer* layer = _hiddenlayers[i];
+            if (!layer->_columnMajor) {
+                layer->checkpointArrays(arrays, layer->_weights, layer->_bias, layer->_adamAvgMom, layer->_adamAvgVel);
+                continue;
+            }
+            LayerSnapshot& copy = copies[i];
+            size_t size = layer->_noOfNodes * layer->getInputCount();
+            copy._weights.resize(size);
+            copy._bias.resize(layer->_noOfNodes);
+            copy._adamAvgMom.resize(size);
+            copy._adamAvgVel.resize(size);
+            layer->snapshot(&copy._weights[0], &copy._bias[0], &copy._adamAvgMom[0], &copy._adamAvgVel[0]);
+            layer->checkpointArrays(arrays, &copy._weights[0], &copy._bias[0], &copy._adamAvgMom[0], &copy._adamAvgVel[0]);
+        }
+        writeShards(file, arrays, _sharded, omp_get_max_threads());
+        return;
+    }
+    string tmp = file + ".tmp";
     for (int i=0; i< _numberOfLayers; i++){
-        _hiddenlayers[i]->saveWeights(file);
+        _hiddenlayers[i]->saveWeights(tmp);
+    }
+    // the other shards append their part of the output layer to the same file, one after the other
+    for (int s = 1; _sharded && s < shardCount(); s++) {
+        ShardRequest request = {SHARD_SAVE, 0, 0, 0, 0, 0, tmp.size()};
+        shardSend(s, &request, sizeof(request));
+        shardSend(s, tmp.data(), tmp.size());
+        int done = 0;
+        if (!shardRecv(s, &done, sizeof(done)) || done != 1) {
+            cout << "Shard " << s << " did not write its part of checkpoint " << file << endl;
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+    commitCheckpoint(tmp, file);
+}
+
+
+// the run's part of a training state, batches trained so far and the random streams
+StateHeader Network::stateHeader(long long iter) const
+{
+    StateHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header._magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    header._layers = _numberOfLayers;
+    header._batchSize = _currentBatchSize;
+    header._iter = iter;
+    header._batchesSinceSync = _batchesSinceSync;
+    header._seedFixed = seedFixed();
+    header._seed = globalSeed();
+    streamIds(header._streamIds);
+    return header;
+}
+
+
+/*
+* Full training state for resuming at batch iter (Checkpoint.h), written from the parameters in place.
+* Each other shard of a sharded output layer writes its part to <file>.shard<k>, first, so that this
+* process's file is only replaced once all of them are.
+*/
+void Network::saveState(string file, long long iter)
+{
+    if (_frozenMap) {
+        cout << "A frozen model is for inference only" << endl;
+        return;
+    }
+    finishCheckpoint();
+    flushUpdates();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    vector<LayerSnapshot> buffers(_numberOfLayers);
+    vector<LayerState> states(_numberOfLayers);
+    for (int i = 0; i < _numberOfLayers; i++) {
+        if (_hiddenlayers[i])
+            states[i] = _hiddenlayers[i]->exportState(buffers[i], true);
+        else
+            memset(&states[i], 0, sizeof(LayerState));
+    }
+    for (int s = 1; _sharded && shardRank() == 0 && s < shardCount(); s++) {
+        ShardRequest request = {SHARD_STATE, (int) iter, 0, 0, 0, 0, file.size()};
+        shardSend(s, &request, sizeof(request));
+        shardSend(s, file.data(), file.size());
+        int done = 0;
+        if (!shardRecv(s, &done, sizeof(done)) || done != 1) {
+            cout << "Shard " << s << " did not write its training state, " << file << " is left as it was" << endl;
+            return;
+        }
+    }
+    if (writeState(file.c_str(), stateHeader(iter), &states[0])) {
+        auto t2 = std::chrono::high_resolution_clock::now();
+        cout << "Training state " << file << " at batch " << iter << " written in "
+             << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms" << endl;
+    }
+}
+
+
+/*
+* Checkpoint without holding up training: the parameters, and with a stateFile the whole training
+* state, are copied between two batches into a second set of buffers, which a background thread
+* writes out while the next batches train. Training only stalls for the copy, and for the previous
+* checkpoint if it is still being written. The shards of a sharded output layer write their part
+* themselves, so that case stays synchronous.
+*/
+void Network::saveWeightsAsync(string file, string stateFile, long long iter)
+{
+    if (_sharded || _frozenMap) {
+        if (file != "")
+            saveWeights(file);
+        if (stateFile != "")
+            saveState(stateFile, iter);
+        return;
     }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    finishCheckpoint();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    flushUpdates();
+    _checkpoint.resize(_numberOfLayers);
+    vector<LayerState> states(_numberOfLayers);
+    for (int i = 0; i < _numberOfLayers; i++) {
+        Layer* layer = _hiddenlayers[i];
+        LayerSnapshot& buffers = _checkpoint[i];
+        if (stateFile != "") {
+            states[i] = layer->exportState(buffers, false);
+            continue;
+        }
+        size_t size = layer->_noOfNodes * layer->getInputCount();
+        buffers._weights.resize(size);
+        buffers._bias.resize(layer->_noOfNodes);
+        buffers._adamAvgMom.resize(size);
+        buffers._adamAvgVel.resize(size);
+        layer->snapshot(&buffers._weights[0], &buffers._bias[0], &buffers._adamAvgMom[0], &buffers._adamAvgVel[0]);
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+    _checkpointWriter = std::thread(&Network::writeCheckpoint, this, file, stateFile, stateHeader(iter), states);
+    cout << "Checkpoint at batch " << iter << ": training stalled "
+         << std::chrono::duration_cast<std::chrono::microseconds>(t3 - t1).count() / 1000.0 << " ms ("
+         << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0 << " ms waiting for the previous one)" << endl;
+}
+
+
+void Network::writeCheckpoint(string file, string stateFile, StateHeader header, vector<LayerState> states)
+{
+    auto t1 = std::chrono::high_resolution_clock::now();
+    bool written = true;
+    if (file != "" && _checkpointRows > 0) {
+        vector<CheckpointArray> arrays;
+        for (int i = 0; i < _numberOfLayers; i++) {
+            LayerSnapshot& buffers = _checkpoint[i];
+            _hiddenlayers[i]->checkpointArrays(arrays, &buffers._weights[0], &buffers._bias[0], &buffers._adamAvgMom[0], &buffers._adamAvgVel[0]);
+        }
+        // a few threads, so that the writes do not take the cores training runs on
+        written = writeShards(file, arrays, false, ASYNC_CHECKPOINT_THREADS);
+    } else if (file != "") {
+        string tmp = file + ".tmp";
+        for (int i = 0; i < _numberOfLayers; i++) {
+            LayerSnapshot& buffers = _checkpoint[i];
+            _hiddenlayers[i]->saveWeights(tmp, &buffers._weights[0], &buffers._bias[0], &buffers._adamAvgMom[0], &buffers._adamAvgVel[0]);
+        }
+        written = commitCheckpoint(tmp, file);
+    }
+    if (stateFile != "")
+        written = writeState(stateFile.c_str(), header, &states[0]) && written;
+    if (written) {
+        auto t2 = std::chrono::high_resolution_clock::now();
+        cout << "Checkpoint at batch " << header._iter << " written in the background in "
+             << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms" << endl;
+    }
+}
+
+
+// waits for the checkpoint being written, if any
+void Network::finishCheckpoint()
+{
+    if (_checkpointWriter.joinable())
+        _checkpointWriter.join();
 }
 
 
 Network::~Network() {
+    finishCheckpoint();
+
+    for (int i = 0; i < _currentBatchSize; i++) {
+        for (int j = 1; j < _numberOfLayers + 1; j++) {
+            delete[] _activeNodesPerBatch[i][j];
+            delete[] _activeValuesPerBatch[i][j];
+        }
+        delete[] _activeNodesPerBatch[i];
+        delete[] _activeValuesPerBatch[i];
+        delete[] _sizesPerBatch[i];
+        delete[] _capacityPerBatch[i];
+    }
+    delete[] _activeNodesPerBatch;
+    delete[] _activeValuesPerBatch;
+    delete[] _sizesPerBatch;
+    delete[] _capacityPerBatch;
+    delete[] _avgRetrieval;
+    delete _scheduler;
 
     delete[] _sizesOfLayers;
     for (int i=0; i< _numberOfLayers; i++){
@@ -301,4 +1513,8 @@ Network::~Network() {
     }
     delete[] _hiddenlayers;
     delete[] _layersTypes;
+    if (_frozenMap)
+        munmap(_frozenMap, _frozenBytes);
+    if (_stateMap)
+        munmap(_stateMap, _stateBytes);
 }
@@ -1,11 +1,16 @@
 #pragma once
 #include "Layer.h"
+#include "Scheduler.h"
+#include "InferenceContext.h"
+#include "Timing.h"
 #include <chrono>
+#include <thread>
 #include "cnpy.h"
-#include <sys/mman.h>
 
 using namespace std;
 
+struct ShardBest;
+
 class Network
 {
 private:
@@ -17,30 +22,84 @@ private:
 	float * _Sparsity;
 	//int* _inputIDs;
 	int  _currentBatchSize;
+	// per-sample active node lists, values and sizes for every layer, reused across batches
+	int*** _activeNodesPerBatch;
+	float*** _activeValuesPerBatch;
+	int** _sizesPerBatch;
+	int** _capacityPerBatch;
+	// predictTopK's own context for the evaluation batches
+	InferenceContext _inference;
+	// frozen model (Frozen.h) the layers use in place, NULL when trained in this process
+	char* _frozenMap;
+	size_t _frozenBytes;
+	vector<float> _frozenSparsity;
+	int* _avgRetrieval;
+	Scheduler* _scheduler;
+	// UPDATE_STALENESS 1: the previous batch's sweep still to be applied, and its learning rate
+	bool _pendingUpdate;
+	float _pendingLr;
+	// gradients are applied every _syncPeriod batches (see Workers.h)
+	int _syncPeriod, _batchesSinceSync;
+	// sharded output layer (see Workers.h): this process holds its nodes from global id _shardBegin on.
+	// Shard processes build no other layer; their per-sample labels point into the received message.
+	bool _sharded;
+	size_t _shardBegin;
+	vector<char> _shardMessage;
+	vector<float> _shardPartial, _shardNorms, _shardDeltas, _shardReceived;
+	vector<int> _shardOffsets, _shardLabelSizes;
+	vector<int*> _shardLabels;
+	// asynchronous checkpoint: per layer the state copied between two batches, and the thread writing it out
+	vector<LayerSnapshot> _checkpoint;
+	std::thread _checkpointWriter;
+	// training state (Checkpoint.h) resumed from, its layers train on the private map
+	char* _stateMap;
+	size_t _stateBytes;
+	// sharded checkpoint (Checkpoint.h): rows per file, 0 for npz, and zlib level
+	int _checkpointRows, _checkpointLevel;
+	// per-phase times of the training batches (Timing.h)
+	PhaseLog _phaseLog;
+	bool writeShards(string dir, const vector<CheckpointArray>& arrays, bool withShards, int threads);
+	StateHeader stateHeader(long long iter) const;
+	void writeCheckpoint(string file, string stateFile, StateHeader header, vector<LayerState> states);
+	void resumeLayer(int i, size_t nodes, int inputs, float** weights, float** bias, float** adamAvgMom, float** adamAvgVel);
+	void allocateWorkspace();
+	void reserveWorkspace(int sample, int labelsize, float* Sparsity);
+	void reserveContext(InferenceContext& context, int batchSize) const;
+	void updateNode(int l, size_t m, float tmplr, bool rehash, bool pending);
+	void sweepChunk(int l, int chunk, float tmplr, bool rehash, bool pending);
+	void sweepLayer(int l, float tmplr, bool rehash, bool pending);
+	void shardBroadcast(int op, int iter, float lr, bool rehash, bool rebuild, bool sync, bool deferred, int k, int** labels, int* labelsize);
+	int shardForward(int i, int* label, int labelsize, int iter, float sparsity);
+	void shardSoftmax(int i);
+	void shardBackward(int i, int* label, int labelsize, float tmplr, float* deltas);
+	void shardTopK(int i, int k, ShardBest* best);
+	void shardDeltaOffsets();
+	void shardedSoftmax(int** labels, int* labelsize, int iter, float tmplr, bool rehash, bool rebuild, bool sync, bool deferred);
+	void shardedTopK(int k, int* topLabels, float* topScores);
 
 
 public:
-	Network(int* sizesOfLayers, NodeType* layersTypes, int noOfLayers, int batchsize, float lr, int inputdim, int* K, int* L, int* RangePow, float* Sparsity, cnpy::npz_t arr);
+	Network(int* sizesOfLayers, NodeType* layersTypes, int noOfLayers, int batchsize, float lr, int inputdim, int* K, int* L, int* RangePow, float* Sparsity, cnpy::npz_t arr, string stateFile = "");
+	Network(string frozenFile, int batchsize);
 	Layer* getLayer(int LayerID);
+	int getLayerCount();
 	int predictClass(int ** inputIndices, float ** inputValues, int * length, int ** labels, int *labelsize);
+	void predictTopK(int ** inputIndices, float ** inputValues, int * length, int k, int * topLabels, float * topScores);
+	void predictTopK(InferenceContext& context, int ** inputIndices, float ** inputValues, int * length, int batchSize, int k, int * topLabels, float * topScores) const;
+	void precisionAtK(int ** inputIndices, float ** inputValues, int * length, int ** labels, int *labelsize, int k, float * precision);
 	int ProcessInput(int** inputIndices, float** inputValues, int* lengths, int ** label, int *labelsize, int iter, bool rehash, bool rebuild);
+	void flushUpdates();
+	void setSyncPeriod(int period);
+	void setCheckpointFormat(int rows, int level);
+	void setPhaseLog(string file, int every);
+	void setNegativeSampling(int mode, float power);
+	void serveShard();
+	void stopShards();
 	void saveWeights(string file);
+	void saveWeightsAsync(string file, string stateFile, long long iter);
+	void saveState(string file, long long iter);
+	void finishCheckpoint();
+	void exportFrozen(string file);
 	~Network();
-	void * operator new(size_t size){
-	    cout << "new Network" << endl;
-	    void* ptr = mmap(NULL, size,
-	        PROT_READ | PROT_EXEC | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
-	        -1, 0);
-	    if (ptr == MAP_FAILED){
-	        ptr = mmap(NULL, size,
-	            PROT_READ | PROT_EXEC | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
-	            -1, 0);
-	    }
-	    if (ptr == MAP_FAILED){
-	        std::cout << "mmap failed at Network." << std::endl;
-	    }
-	    return ptr;
-	}
-	void operator delete(void * pointer){munmap(pointer, sizeof(Network));};
 };
 
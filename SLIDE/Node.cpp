@@ -5,37 +5,12 @@
 #include <stdlib.h>
 #include <chrono>
 #include <algorithm>
-#include <sys/mman.h>
 #include "Config.h"
+#include "Kernels.h"
 
 using namespace std;
 
-Node::Node(int dim, int nodeID, int layerID, NodeType type, int batchsize, float *weights, float bias, float *adamAvgMom, float *adamAvgVel)
-{
-	_dim = dim;
-	_IDinLayer = nodeID;
-	_type = type;
-	_layerNum = layerID;
-    _currentBatchsize = batchsize;
-
-	if (ADAM)
-	{
-		_adamAvgMom = adamAvgMom;
-		_adamAvgVel = adamAvgVel;
-		_t = new float[_dim]();
-
-	}
-
-	_train = new train[_currentBatchsize];
-	_activeInputs = 0;
-
-    _weights = weights;
-    //_bias = bias;
-	//_mirrorbias = _bias;
-
-}
-
-void Node::Update(int dim, int nodeID, int layerID, NodeType type, int batchsize, float *weights, float &bias, float *adamAvgMom, float *adamAvgVel, train* train_blob)
+void Node::Update(int dim, int nodeID, int layerID, NodeType type, int batchsize, float *weights, float &bias, float *adamAvgMom, float *adamAvgVel, float *t, train* train_blob)
 {
     _dim = dim;
     _IDinLayer = nodeID;
@@ -47,7 +22,7 @@ void Node::Update(int dim, int nodeID, int layerID, NodeType type, int batchsize
     {
         _adamAvgMom = adamAvgMom;
         _adamAvgVel = adamAvgVel;
-        _t = new float[_dim]();
+        _t = t;
 
     }
 
@@ -85,7 +60,25 @@ bool Node::getActiveInputs(void)
     return _activeInputs > 0;
 }
 
-float Node::getActivation(int* indices, float* values, int length, int inputID)
+/*
+* dense: the caller has checked that indices are indices[0], indices[0] + 1, ... (e.g. a Sparsity 1 previous
+* layer), which is one contiguous slice of the weights; any other ids are gathered one by one.
+* weights: a copy of this node's weight row to read instead (Layer::batchComputeActivations), NULL for _weights
+*/
+float Node::getActivation(int* indices, float* values, int length, int inputID, bool dense, const float* weights)
+{
+	const float* row = weights ? weights : _weights;
+	float weightedSum;
+	if (dense)
+	    weightedSum = dot(row + indices[0], values, length);
+	else
+	    weightedSum = dotGather(row, indices, values, length);
+	return activate(weightedSum, inputID);
+}
+
+
+// bias + nonlinearity on an already computed weighted input sum
+float Node::activate(float weightedSum, int inputID)
 {
 	assert(("Input ID more than Batch Size", inputID <= _currentBatchsize));
 
@@ -95,12 +88,7 @@ float Node::getActivation(int* indices, float* values, int length, int inputID)
 	    _activeInputs++;
 	}
 
-	_train[inputID]._lastActivations = 0;
-	for (int i = 0; i < length; i++)
-	{
-	    _train[inputID]._lastActivations += _weights[indices[i]] * values[i];
-	}
-	_train[inputID]._lastActivations += (*_bias);
+	_train[inputID]._lastActivations = weightedSum + (*_bias);
 
 	switch (_type)
 	{
@@ -126,7 +114,30 @@ float Node::getActivation(int* indices, float* values, int length, int inputID)
 }
 
 
-void Node::ComputeExtaStatsForSoftMax(float normalizationConstant, int inputID, int* label, int labelsize)
+// getActivation without recording anything in _train, for the read-only inference path
+float Node::inferActivation(int* indices, float* values, int length, bool dense) const
+{
+	float weightedSum;
+	if (dense)
+	    weightedSum = dot(_weights + indices[0], values, length);
+	else
+	    weightedSum = dotGather(_weights, indices, values, length);
+	return infer(weightedSum);
+}
+
+
+// activate without recording anything in _train
+float Node::infer(float weightedSum) const
+{
+	float activation = weightedSum + (*_bias);
+	if (_type == NodeType::ReLU && activation < 0)
+	    activation = 0;
+	return activation;
+}
+
+
+// labelOffset: global id of node 0 of a sharded output layer, the labels are global ids
+void Node::ComputeExtaStatsForSoftMax(float normalizationConstant, int inputID, int* label, int labelsize, size_t labelOffset)
 {
 	assert(("Input Not Active but still called !! BUG", _train[inputID]._ActiveinputIds ==1));
 
@@ -134,7 +145,7 @@ void Node::ComputeExtaStatsForSoftMax(float normalizationConstant, int inputID,
 
 	//TODO:check  gradient
 	_train[inputID]._lastGradients = 1;
-	if (find (label, label+labelsize, _IDinLayer)!= label+labelsize) {
+	if (find (label, label+labelsize, _IDinLayer + labelOffset)!= label+labelsize) {
 	    _train[inputID]._lastDeltaforBPs = (1.0/labelsize - _train[inputID]._lastActivations) / _currentBatchsize;
 	}
 	else {
@@ -143,16 +154,30 @@ void Node::ComputeExtaStatsForSoftMax(float normalizationConstant, int inputID,
 }
 
 
-void Node::backPropagate(Node* previousNodes, int* previousLayerActiveNodeIds, int previousLayerActiveNodeSize, float learningRate, int inputID)
+/*
+* With previousDeltas the increments for the previous layer are summed there (one slot per previous active node) instead of applied.
+* With previousValues too, the previous activations are read from there, and previousNodes is not needed (a shard process).
+* With weights the deltas are taken from that copy of the weight row (Layer::batchBackPropagate).
+*/
+void Node::backPropagate(Node* previousNodes, int* previousLayerActiveNodeIds, int previousLayerActiveNodeSize, float learningRate, int inputID, float* previousDeltas, float* previousValues, const float* weights)
 {
 	assert(("Input Not Active but still called !! BUG", _train[inputID]._ActiveinputIds == 1));
+	const float* row = weights ? weights : _weights;
 	for (int i = 0; i < previousLayerActiveNodeSize; i++)
 	{
 		//UpdateDelta before updating weights
-	    Node* prev_node = &(previousNodes[previousLayerActiveNodeIds[i]]);
-	    prev_node->incrementDelta(inputID, _train[inputID]._lastDeltaforBPs * _weights[previousLayerActiveNodeIds[i]]);
-
-		float grad_t = _train[inputID]._lastDeltaforBPs * prev_node->getLastActivation(inputID);
+	    float activation;
+	    if (previousValues) {
+	        activation = previousValues[i];
+	    } else {
+	        activation = previousNodes[previousLayerActiveNodeIds[i]].getLastActivation(inputID);
+	    }
+	    if (previousDeltas)
+	        previousDeltas[i] += _train[inputID]._lastDeltaforBPs * row[previousLayerActiveNodeIds[i]];
+	    else
+	        previousNodes[previousLayerActiveNodeIds[i]].incrementDelta(inputID, _train[inputID]._lastDeltaforBPs * row[previousLayerActiveNodeIds[i]]);
+
+		float grad_t = _train[inputID]._lastDeltaforBPs * activation;
 
 		if (ADAM)
 		{
@@ -224,16 +249,9 @@ void Node::SetlastActivation(int inputID, float realActivation)
 
 Node::~Node()
 {
-
+	// weights, Adam state and _t are slices of the layer's arena buffers
 	delete[] _indicesInTables;
 	delete[] _indicesInBuckets;
-
-	if (ADAM)
-	{
-		delete[] _adamAvgMom;
-		delete[] _adamAvgVel;
-		delete[] _t;
-	}
 }
 
 
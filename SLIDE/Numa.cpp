@@ -0,0 +1,214 @@
+#include "Numa.h"
+#include "Arena.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <omp.h>
+
+using namespace std;
+
+// per partition, the cpus and the kernel's id of its node; ids need not be contiguous (offline or memory-only nodes)
+static vector<vector<int> > _nodeCpus;
+static vector<int> _nodeIds;
+static thread_local int _threadNode = -1;
+
+
+static void parseCpuList(string list, vector<int>& cpus)
+{
+    char *mystring = &list[0];
+    char *pch = strtok(mystring, ",\n");
+    while (pch != NULL) {
+        int first, last;
+        if (sscanf(pch, "%d-%d", &first, &last) == 2) {
+            for (int c = first; c <= last; c++)
+                cpus.push_back(c);
+        } else {
+            cpus.push_back(atoi(pch));
+        }
+        pch = strtok(NULL, ",\n");
+    }
+}
+
+
+static void readTopology()
+{
+    if (!_nodeCpus.empty())
+        return;
+    // the nodes with cpus, else all online ones; a node without cpus gets no partition
+    vector<int> nodes;
+    ifstream list("/sys/devices/system/node/has_cpu");
+    if (!list)
+        list.open("/sys/devices/system/node/online");
+    string str;
+    if (list && getline(list, str))
+        parseCpuList(str, nodes);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        ifstream file("/sys/devices/system/node/node" + to_string(nodes[n]) + "/cpulist");
+        if (!file || !getline(file, str))
+            continue;
+        vector<int> cpus;
+        parseCpuList(str, cpus);
+        if (!cpus.empty()) {
+            _nodeCpus.push_back(cpus);
+            _nodeIds.push_back(nodes[n]);
+        }
+    }
+    if (_nodeCpus.empty()) {
+        // no sysfs (or no NUMA): treat the whole box as one node
+        vector<int> cpus;
+        for (int c = 0; c < sysconf(_SC_NPROCESSORS_ONLN); c++)
+            cpus.push_back(c);
+        _nodeCpus.push_back(cpus);
+        _nodeIds.push_back(0);
+    }
+}
+
+
+int numaNodeCount()
+{
+    readTopology();
+    return _nodeCpus.size();
+}
+
+
+int numaPartitions()
+{
+    int threads = omp_get_max_threads();
+    int nodes = numaNodeCount();
+    return nodes < threads ? nodes : threads;
+}
+
+
+// thread tid of nthreads belongs to partition *part, being the *rank-th of *count threads there
+static void threadSlot(int tid, int nthreads, int parts, int* part, int* rank, int* count)
+{
+    *part = tid * parts / nthreads;
+    int first = (*part * nthreads + parts - 1) / parts;
+    int next = ((*part + 1) * nthreads + parts - 1) / parts;
+    *rank = tid - first;
+    *count = next - first;
+}
+
+
+void numaPinThreads()
+{
+    int parts = numaPartitions();
+#pragma omp parallel
+    {
+        int part, rank, count;
+        threadSlot(omp_get_thread_num(), omp_get_num_threads(), parts, &part, &rank, &count);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        vector<int> &cpus = _nodeCpus[part];
+        // spread the node's threads over its cores
+        CPU_SET(cpus[rank % cpus.size()], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            CPU_ZERO(&set);
+            for (size_t c = 0; c < cpus.size(); c++)
+                CPU_SET(cpus[c], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        _threadNode = part;
+    }
+    cout << "NUMA: " << numaNodeCount() << " nodes, " << omp_get_max_threads() << " threads pinned over " << parts << " partitions" << endl;
+}
+
+
+int numaThreadNode()
+{
+    return _threadNode;
+}
+
+
+int numaPartitionOf(size_t row, size_t rows)
+{
+    size_t parts = numaPartitions();
+    return ((row + 1) * parts - 1) / rows;
+}
+
+
+static size_t partitionBegin(size_t rows, int part, int parts)
+{
+    return rows * part / parts;
+}
+
+
+void numaThreadShare(size_t rows, size_t* begin, size_t* end)
+{
+    int parts = numaPartitions();
+    int part, rank, count;
+    threadSlot(omp_get_thread_num(), omp_get_num_threads(), parts, &part, &rank, &count);
+    size_t pb = partitionBegin(rows, part, parts);
+    size_t pe = partitionBegin(rows, part + 1, parts);
+    *begin = pb + (pe - pb) * rank / count;
+    *end = pb + (pe - pb) * (rank + 1) / count;
+}
+
+
+static size_t roundToPage(size_t bytes)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+
+void numaPlaceRows(void* ptr, size_t rows, size_t rowBytes)
+{
+    // bind each partition's pages to its node before anything touches them
+    char* base = (char*) ptr;
+    size_t page = arenaPageSize(ptr);
+    size_t bytes = (rows * rowBytes + page - 1) / page * page;
+    int parts = numaPartitions();
+    if (numaNodeCount() > 1) {
+        for (int p = 0; p < parts; p++) {
+            size_t pb = partitionBegin(rows, p, parts) * rowBytes / page * page;
+            size_t pe = (p == parts - 1) ? bytes : partitionBegin(rows, p + 1, parts) * rowBytes / page * page;
+            if (pe <= pb)
+                continue;
+            int node = _nodeIds[p];
+            vector<unsigned long> mask(node / (8 * sizeof(unsigned long)) + 1, 0);
+            mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+            if (syscall(SYS_mbind, base + pb, pe - pb, MPOL_BIND, &mask[0], mask.size() * 8 * sizeof(unsigned long) + 1, 0) != 0) {
+                std::cout << "mbind failed for partition " << p << " (node " << node << "), relying on first touch" << std::endl;
+            }
+        }
+    }
+
+    // first touch from the pinned threads owning each range
+#pragma omp parallel
+    {
+        size_t begin, end;
+        numaThreadShare(rows, &begin, &end);
+        memset(base + begin * rowBytes, 0, (end - begin) * rowBytes);
+    }
+}
+
+
+float numaPlacementRatio(void* ptr, size_t rows, size_t rowBytes)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = roundToPage(rows * rowBytes) / page;
+    size_t stride = pages > 256 ? pages / 256 : 1;
+    int local = 0, sampled = 0;
+    for (size_t pg = 0; pg < pages; pg += stride) {
+        int node = -1;
+        char* addr = (char*) ptr + pg * page;
+        if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+            continue;
+        size_t row = pg * page / rowBytes;
+        if (row >= rows)
+            row = rows - 1;
+        if (node == _nodeIds[numaPartitionOf(row, rows)])
+            local++;
+        sampled++;
+    }
+    return sampled ? local * 1.0 / sampled : 0;
+}
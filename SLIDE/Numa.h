@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+
+/*
+*  NUMA placement helpers (enabled with NUMA in Config.h). A layer's nodes are split into
+*  contiguous row ranges, one per NUMA node with cpus (node ids as the kernel numbers them, gaps
+*  included); each range is bound to its node, first touched by threads pinned to that node, and the
+*  per-node update sweep runs over the same ranges.
+*  Buffers come from the arena (Arena.h) and must not have been touched before placement.
+*  Talks to the kernel directly (mbind/get_mempolicy), so libnuma is not needed.
+*/
+int numaNodeCount();
+int numaPartitions();
+void numaPinThreads();
+int numaThreadNode();
+int numaPartitionOf(size_t row, size_t rows);
+void numaThreadShare(size_t rows, size_t* begin, size_t* end);
+void numaPlaceRows(void* ptr, size_t rows, size_t rowBytes);
+float numaPlacementRatio(void* ptr, size_t rows, size_t rowBytes);
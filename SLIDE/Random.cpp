@@ -0,0 +1,99 @@
+#include "Random.h"
+#include <random>
+#include <atomic>
+#include <omp.h>
+
+using namespace std;
+
+static uint64_t _seed = 0;
+static bool _seeded = false;
+static bool _fixed = false;
+static atomic<uint64_t> _streamIds[RNG_COMPONENTS];
+
+
+// splitmix64 finalizer
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+
+CounterRng::result_type CounterRng::operator()()
+{
+    return mix(_key + ++_counter * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+
+void setGlobalSeed(uint64_t seed, bool fixed)
+{
+    _seed = seed;
+    _seeded = true;
+    _fixed = fixed;
+}
+
+
+static uint64_t drawSeed()
+{
+    random_device rd;
+    return ((uint64_t) rd() << 32) | rd();
+}
+
+
+uint64_t globalSeed()
+{
+    if (!_seeded) {
+        // drawn once, even if the first calls come from several threads
+        static uint64_t drawn = drawSeed();
+        return drawn;
+    }
+    return _seed;
+}
+
+
+bool seedFixed()
+{
+    return _fixed;
+}
+
+
+uint64_t nextStreamId(RngComponent component)
+{
+    return _streamIds[component].fetch_add(1);
+}
+
+
+// the next stream id of every component, for a training state (Checkpoint.h)
+void streamIds(uint64_t* ids)
+{
+    for (int c = 0; c < RNG_COMPONENTS; c++)
+        ids[c] = _streamIds[c].load();
+}
+
+
+void setStreamIds(const uint64_t* ids)
+{
+    for (int c = 0; c < RNG_COMPONENTS; c++)
+        _streamIds[c] = ids[c];
+}
+
+
+CounterRng rngStream(RngComponent component, uint64_t id)
+{
+    return CounterRng(mix(mix(globalSeed() ^ mix(component)) ^ id));
+}
+
+
+CounterRng& threadRng(RngComponent component)
+{
+    static thread_local CounterRng rngs[RNG_COMPONENTS];
+    static thread_local bool ready[RNG_COMPONENTS] = {};
+    if (!ready[component]) {
+        // ids past any per-sample index
+        rngs[component] = rngStream(component, (1ULL << 63) | omp_get_thread_num());
+        ready[component] = true;
+    }
+    return rngs[component];
+}
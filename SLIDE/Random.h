@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+
+/*
+*  Random numbers for every component (Seed config key). A stream is a counter hashed together with
+*  the global seed, its component and a stream id, so its n-th draw does not depend on what other
+*  streams or threads did. With a fixed seed a single-threaded run repeats exactly; without one the
+*  seed is drawn from random_device once per process.
+*  Streams of objects built in sequence (hashers, tables) take their id from nextStreamId and keep
+*  their key, so that a frozen model (Frozen.h) rebuilds them without the seed; streams
+*  of per-sample draws use the sample's global index, and threadRng is a per-thread stream for
+*  draws without such an index. With a fixed seed the layers also insert nodes into their hash tables
+*  in node order (see Layer::insertRehashed), so the tables, and with them the active sets, do not
+*  depend on thread timing.
+*/
+enum RngComponent
+{
+    RNG_WEIGHTS, RNG_NODE_ORDER, RNG_LSH, RNG_WTA, RNG_DWTA, RNG_MINHASH, RNG_SRP,
+    RNG_PADDING, RNG_SAMPLING, RNG_BUCKET, RNG_NEGATIVES, RNG_COMPONENTS
+};
+
+class CounterRng
+{
+private:
+    uint64_t _key, _counter;
+
+public:
+    typedef uint32_t result_type;
+    CounterRng(uint64_t key = 0) : _key(key), _counter(0) {}
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+    result_type operator()();
+    // a fresh stream's key; CounterRng(key()) repeats it from the start
+    uint64_t key() const { return _key; }
+};
+
+// fixed = false restores a drawn seed (a resumed run, Checkpoint.h) without the fixed-seed behavior
+void setGlobalSeed(uint64_t seed, bool fixed = true);
+uint64_t globalSeed();
+bool seedFixed();
+uint64_t nextStreamId(RngComponent component);
+void streamIds(uint64_t* ids);
+void setStreamIds(const uint64_t* ids);
+CounterRng rngStream(RngComponent component, uint64_t id);
+CounterRng& threadRng(RngComponent component);
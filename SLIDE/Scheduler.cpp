@@ -0,0 +1,103 @@
+#include "Scheduler.h"
+
+using namespace std;
+
+
+Scheduler::Scheduler(int threads)
+{
+    _threads = threads;
+    _deques = new Deque[threads];
+    for (int t = 0; t < threads; t++) {
+        _deques[t]._head = 0;
+        _deques[t]._tail = 0;
+        _deques[t]._idle = 0;
+    }
+    _pending = 0;
+}
+
+
+// every deque can hold all tasks of a run, so pushing never reallocates mid-run; call before seeding
+void Scheduler::reserve(size_t tasks)
+{
+    for (int t = 0; t < _threads; t++) {
+        if (_deques[t]._tasks.size() < tasks + 1) {
+            _deques[t]._tasks.resize(tasks + 1);
+            _deques[t]._head = 0;
+            _deques[t]._tail = 0;
+        }
+    }
+}
+
+
+void Scheduler::seed(int tid, Task task)
+{
+    Deque& d = _deques[tid % _threads];
+    d._tasks[d._tail] = task;
+    d._tail = (d._tail + 1) % d._tasks.size();
+    _pending.fetch_add(1);
+}
+
+
+// follow-up task, onto the calling thread's own deque
+void Scheduler::push(Task task)
+{
+    Deque& d = _deques[omp_get_thread_num()];
+    _pending.fetch_add(1);
+    lock_guard<mutex> guard(d._lock);
+    d._tasks[d._tail] = task;
+    d._tail = (d._tail + 1) % d._tasks.size();
+}
+
+
+// newest task of the own deque
+bool Scheduler::pop(int tid, Task* task)
+{
+    Deque& d = _deques[tid];
+    lock_guard<mutex> guard(d._lock);
+    if (d._head == d._tail)
+        return false;
+    d._tail = (d._tail + d._tasks.size() - 1) % d._tasks.size();
+    *task = d._tasks[d._tail];
+    return true;
+}
+
+
+// oldest task of the next non-empty deque after tid
+bool Scheduler::steal(int tid, Task* task)
+{
+    for (int k = 1; k < _threads; k++) {
+        Deque& d = _deques[(tid + k) % _threads];
+        lock_guard<mutex> guard(d._lock);
+        if (d._head == d._tail)
+            continue;
+        *task = d._tasks[d._head];
+        d._head = (d._head + 1) % d._tasks.size();
+        return true;
+    }
+    return false;
+}
+
+
+double Scheduler::idleMs(int tid)
+{
+    return _deques[tid]._idle;
+}
+
+
+void Scheduler::resetIdle()
+{
+    for (int t = 0; t < _threads; t++)
+        _deques[t]._idle = 0;
+}
+
+
+int Scheduler::threads()
+{
+    return _threads;
+}
+
+
+Scheduler::~Scheduler()
+{
+    delete[] _deques;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <omp.h>
+
+/*
+*  Work-stealing scheduler for the per-sample passes and the node sweep (WORK_STEALING in Config.h).
+*  Every OpenMP thread owns a deque of tasks: it runs its newest task and, once empty, steals the
+*  oldest task of another thread. A task may push follow-up tasks (a sample's next layer) onto the
+*  running thread's deque, so a sample's layers stay in order while the rest of the batch balances.
+*  Time a thread spends without a task is accumulated as idle time until resetIdle.
+*/
+struct Task
+{
+    int _id;    // sample, or chunk of nodes
+    int _stage; // layer step of that sample
+};
+
+class Scheduler
+{
+private:
+    struct Deque
+    {
+        std::mutex _lock;
+        std::vector<Task> _tasks; // ring buffer
+        size_t _head, _tail;
+        double _idle;
+        char _pad[64];
+    };
+    Deque* _deques;
+    int _threads;
+    std::atomic<int> _pending;
+
+    bool pop(int tid, Task* task);
+    bool steal(int tid, Task* task);
+
+public:
+    Scheduler(int threads);
+    void reserve(size_t tasks);
+    void seed(int tid, Task task);
+    void push(Task task);
+    double idleMs(int tid);
+    void resetIdle();
+    int threads();
+    ~Scheduler();
+
+    // runs fn on the seeded tasks and everything they push, until none are left
+    template <typename F>
+    void run(F fn)
+    {
+#pragma omp parallel num_threads(_threads)
+        {
+            int tid = omp_get_thread_num();
+            Task task;
+            while (true) {
+                if (pop(tid, &task) || steal(tid, &task)) {
+                    fn(task);
+                    _pending.fetch_sub(1);
+                    continue;
+                }
+                auto t1 = std::chrono::high_resolution_clock::now();
+                bool found = false;
+                while (_pending.load() > 0) {
+                    if (steal(tid, &task)) {
+                        found = true;
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+                auto t2 = std::chrono::high_resolution_clock::now();
+                _deques[tid]._idle += std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+                if (!found)
+                    break;
+                fn(task);
+                _pending.fetch_sub(1);
+            }
+        }
+    }
+};
@@ -0,0 +1,268 @@
+#include "Timing.h"
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+using namespace std;
+
+const char* const PHASE_NAMES[PHASES] = {"hash", "retrieve", "dedup", "activation", "softmax", "backprop", "update", "rehash"};
+const char* const PERF_NAMES[PERF_EVENTS] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+
+// counters of every thread that has timed something; never freed, so exited threads still count
+static vector<PhaseCounters*> _phaseThreads;
+static mutex _phaseLock;
+static atomic<bool> _perfOn(false);
+// events counted on at least one thread, and whether the failure to count any has been reported
+static atomic<unsigned> _perfCounted(0);
+static atomic<bool> _perfReported(false);
+
+
+PhaseCounters* registerPhaseCounters()
+{
+    PhaseCounters* counters = new PhaseCounters;
+    for (int p = 0; p < PHASES; p++) {
+        counters->_ns[p].store(0);
+        counters->_calls[p].store(0);
+        for (int e = 0; e < PERF_EVENTS; e++)
+            counters->_perf[p][e].store(0);
+    }
+    counters->_active = -1;
+    counters->_perfFd = -2;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        counters->_perfSlot[e] = -1;
+        counters->_perfSince[e] = 0;
+    }
+    lock_guard<mutex> guard(_phaseLock);
+    _phaseThreads.push_back(counters);
+    return counters;
+}
+
+
+static int perfOpen(uint32_t type, uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+
+// the calling thread's event group; the first event that opens leads it, the others join or are left out
+static void perfOpenGroup(PhaseCounters& counters)
+{
+    const uint32_t types[PERF_EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+    const uint64_t configs[PERF_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+    counters._perfFd = -1;
+    int slots = 0, error = 0;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        int fd = perfOpen(types[e], configs[e], counters._perfFd);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        if (counters._perfFd < 0)
+            counters._perfFd = fd;
+        counters._perfSlot[e] = slots++;
+        _perfCounted.fetch_or(1u << e);
+    }
+    if (slots < PERF_EVENTS && !_perfReported.exchange(true)) {
+        cout << "Hardware counters:";
+        for (int e = 0; e < PERF_EVENTS; e++)
+            cout << " " << PERF_NAMES[e] << (counters._perfSlot[e] >= 0 ? "" : " (unavailable)");
+        cout << ", perf_event_open: " << strerror(error) << endl;
+    }
+}
+
+
+bool perfCountersOn()
+{
+    return _perfOn.load(memory_order_relaxed);
+}
+
+
+bool perfEventCounted(int event)
+{
+    return perfCountersOn() && (_perfCounted.load() >> event) & 1;
+}
+
+
+// PerfCounters config key; tries the counters on the calling thread right away so a failure shows at startup
+bool enablePerfCounters()
+{
+    if (!PHASE_TIMING) {
+        cout << "PerfCounters needs PHASE_TIMING 1 in Config.h" << endl;
+        return false;
+    }
+    _perfOn = true;
+    PhaseCounters& counters = phaseCounters();
+    perfSwitch(counters, -1);
+    return counters._perfFd >= 0;
+}
+
+
+void perfSwitch(PhaseCounters& counters, int phase)
+{
+    if (counters._perfFd == -2)
+        perfOpenGroup(counters);
+    if (counters._perfFd < 0)
+        return;
+    uint64_t values[1 + PERF_EVENTS];
+    if (read(counters._perfFd, values, sizeof(values)) < (ssize_t) sizeof(uint64_t))
+        return;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        int slot = counters._perfSlot[e];
+        if (slot < 0 || (uint64_t) slot >= values[0])
+            continue;
+        uint64_t value = values[1 + slot];
+        if (phase >= 0) {
+            atomic<uint64_t>& total = counters._perf[phase][e];
+            total.store(total.load(memory_order_relaxed) + value - counters._perfSince[e], memory_order_relaxed);
+        }
+        counters._perfSince[e] = value;
+    }
+}
+
+
+void phaseTotals(PhaseTotals* totals)
+{
+    memset(totals, 0, sizeof(PhaseTotals));
+    lock_guard<mutex> guard(_phaseLock);
+    for (size_t t = 0; t < _phaseThreads.size(); t++) {
+        for (int p = 0; p < PHASES; p++) {
+            totals->_ns[p] += _phaseThreads[t]->_ns[p].load(memory_order_relaxed);
+            totals->_calls[p] += _phaseThreads[t]->_calls[p].load(memory_order_relaxed);
+            for (int e = 0; e < PERF_EVENTS; e++)
+                totals->_perf[p][e] += _phaseThreads[t]->_perf[p][e].load(memory_order_relaxed);
+        }
+    }
+}
+
+
+PhaseLog::PhaseLog()
+{
+    _csv = false;
+    _every = 0;
+    _batches = 0;
+    memset(&_begin, 0, sizeof(_begin));
+    memset(&_window, 0, sizeof(_window));
+}
+
+
+bool PhaseLog::open(const string& file, int every)
+{
+    if (file == "")
+        return false;
+    if (!PHASE_TIMING) {
+        cout << "PhaseLog needs PHASE_TIMING 1 in Config.h" << endl;
+        return false;
+    }
+    _file.open(file.c_str(), ios_base::app);
+    if (!_file) {
+        cout << "Could not open " << file << endl;
+        return false;
+    }
+    _every = every > 0 ? every : 1;
+    _csv = file.size() >= 4 && file.compare(file.size() - 4, 4, ".csv") == 0;
+    if (_csv && _file.tellp() == 0) {
+        _file << "batch,batches";
+        for (int p = 0; p < PHASES; p++) {
+            _file << "," << PHASE_NAMES[p] << "_ms," << PHASE_NAMES[p] << "_calls";
+            for (int e = 0; e < PERF_EVENTS && perfCountersOn(); e++)
+                _file << "," << PHASE_NAMES[p] << "_" << PERF_NAMES[e];
+        }
+        _file << endl;
+    }
+    return true;
+}
+
+
+void PhaseLog::batchBegin()
+{
+    if (_every > 0)
+        phaseTotals(&_begin);
+}
+
+
+// adds this batch to the window and writes the window out every _every batches; times are summed over threads
+void PhaseLog::batchEnd(long long iter)
+{
+    if (_every == 0)
+        return;
+    PhaseTotals end;
+    phaseTotals(&end);
+    for (int p = 0; p < PHASES; p++) {
+        _window._ns[p] += end._ns[p] - _begin._ns[p];
+        _window._calls[p] += end._calls[p] - _begin._calls[p];
+        for (int e = 0; e < PERF_EVENTS; e++)
+            _window._perf[p][e] += end._perf[p][e] - _begin._perf[p][e];
+    }
+    if (++_batches < _every)
+        return;
+
+    if (_csv) {
+        _file << iter << "," << _batches;
+        for (int p = 0; p < PHASES; p++) {
+            _file << "," << _window._ns[p] / 1e6 << "," << _window._calls[p];
+            for (int e = 0; e < PERF_EVENTS && perfCountersOn(); e++) {
+                _file << ",";
+                if (perfEventCounted(e))
+                    _file << _window._perf[p][e];
+            }
+        }
+        _file << endl;
+    } else {
+        _file << "{\"batch\": " << iter << ", \"batches\": " << _batches << ", \"phases\": {";
+        for (int p = 0; p < PHASES; p++) {
+            _file << (p ? ", " : "") << "\"" << PHASE_NAMES[p] << "\": {\"ms\": " << _window._ns[p] / 1e6
+                  << ", \"calls\": " << _window._calls[p];
+            for (int e = 0; e < PERF_EVENTS && perfCountersOn(); e++) {
+                _file << ", \"" << PERF_NAMES[e] << "\": ";
+                if (perfEventCounted(e))
+                    _file << _window._perf[p][e];
+                else
+                    _file << "null";
+            }
+            _file << "}";
+        }
+        _file << "}}" << endl;
+    }
+    _batches = 0;
+    memset(&_window, 0, sizeof(_window));
+}
+
+
+// one line per phase: time and calls, and with PerfCounters the counts, IPC and misses per 1000 instructions
+void writePhaseProfile(ostream& out)
+{
+    if (!PHASE_TIMING)
+        return;
+    PhaseTotals totals;
+    phaseTotals(&totals);
+    for (int p = 0; p < PHASES; p++) {
+        out << "Phase " << PHASE_NAMES[p] << ": " << totals._ns[p] / 1e6 << " ms in " << totals._calls[p] << " calls";
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            if (perfEventCounted(e))
+                out << ", " << PERF_NAMES[e] << " " << totals._perf[p][e];
+        }
+        uint64_t instructions = totals._perf[p][PERF_INSTRUCTIONS];
+        if (perfEventCounted(PERF_CYCLES) && perfEventCounted(PERF_INSTRUCTIONS) && totals._perf[p][PERF_CYCLES] > 0)
+            out << ", IPC " << instructions * 1.0 / totals._perf[p][PERF_CYCLES];
+        for (int e = PERF_LLC_MISSES; e < PERF_EVENTS; e++) {
+            if (perfEventCounted(e) && perfEventCounted(PERF_INSTRUCTIONS) && instructions > 0)
+                out << ", " << PERF_NAMES[e] << " per 1k instructions " << totals._perf[p][e] * 1000.0 / instructions;
+        }
+        out << endl;
+    }
+}
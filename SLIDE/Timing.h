@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include "Config.h"
+
+/*
+*  Per-phase timing of the training hot path (PHASE_TIMING in Config.h). A PHASE_SCOPE charges the
+*  time until the end of its block to a phase in the calling thread's counters. Scopes nest: an inner
+*  one pauses the outer, so every nanosecond goes to exactly one phase, two clock reads per scope.
+*  The counters of all threads are summed per ProcessInput batch and logged every PhaseLogEvery
+*  batches (PhaseLog / PhaseLogEvery config keys) as JSON lines, or as CSV for a .csv file.
+*  With PHASE_TIMING 0 the scopes compile to nothing.
+*
+*  PerfCounters=1 also counts cycles, instructions, last level cache misses and dTLB load misses per
+*  phase, with a perf_event_open group per thread (user space only, one read() per scope boundary).
+*  The phases cover the main kernels: Node::getActivation (activation), Node::backPropagate (backprop),
+*  the Adam sweep (update), the DWTA hashing (hash) and the LSH bucket lookups (retrieve). An event the
+*  machine or perf_event_paranoid does not allow is left out and reported as null; without any, only
+*  the times are kept. The totals go to the PhaseLog and, once per epoch, to the training log.
+*/
+enum Phase { PHASE_HASH, PHASE_RETRIEVE, PHASE_DEDUP, PHASE_ACTIVATION, PHASE_SOFTMAX, PHASE_BACKPROP,
+             PHASE_UPDATE, PHASE_REHASH, PHASES };
+
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_DTLB_MISSES, PERF_EVENTS };
+
+extern const char* const PHASE_NAMES[PHASES];
+extern const char* const PERF_NAMES[PERF_EVENTS];
+
+struct PhaseTotals
+{
+    uint64_t _ns[PHASES], _calls[PHASES], _perf[PHASES][PERF_EVENTS];
+};
+
+// one thread's counters, written only by that thread
+struct PhaseCounters
+{
+    std::atomic<uint64_t> _ns[PHASES], _calls[PHASES], _perf[PHASES][PERF_EVENTS];
+    int _active; // phase being timed, -1 for none
+    std::chrono::steady_clock::time_point _since;
+    int _perfFd; // leader of the thread's event group, -1 if none could be opened, -2 before the first try
+    int _perfSlot[PERF_EVENTS]; // position of each event in a group read, -1 for one not counted
+    uint64_t _perfSince[PERF_EVENTS];
+    char _pad[64]; // keeps the next thread's counters off this cache line
+};
+
+PhaseCounters* registerPhaseCounters();
+// sum over all threads since the start
+void phaseTotals(PhaseTotals* totals);
+
+bool enablePerfCounters();
+bool perfCountersOn();
+bool perfEventCounted(int event);
+// reads the thread's event group and charges what was counted since the last call to phase, if any
+void perfSwitch(PhaseCounters& counters, int phase);
+// per phase totals since the start, for the training log
+void writePhaseProfile(std::ostream& out);
+
+
+inline PhaseCounters& phaseCounters()
+{
+    static thread_local PhaseCounters* counters = registerPhaseCounters();
+    return *counters;
+}
+
+
+class PhaseTimer
+{
+private:
+    PhaseCounters& _counters;
+    int _outer;
+
+    static void charge(PhaseCounters& counters, int phase, std::chrono::steady_clock::time_point now)
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - counters._since).count();
+        counters._ns[phase].store(counters._ns[phase].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    }
+
+public:
+    explicit PhaseTimer(Phase phase) : _counters(phaseCounters())
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        _outer = _counters._active;
+        if (_outer >= 0)
+            charge(_counters, _outer, now);
+        if (perfCountersOn())
+            perfSwitch(_counters, _outer);
+        _counters._active = phase;
+        _counters._since = now;
+        _counters._calls[phase].store(_counters._calls[phase].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    ~PhaseTimer()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        charge(_counters, _counters._active, now);
+        if (perfCountersOn())
+            perfSwitch(_counters, _counters._active);
+        _counters._active = _outer;
+        _counters._since = now;
+    }
+};
+
+#if PHASE_TIMING
+#define PHASE_SCOPE_JOIN(a, b) a##b
+#define PHASE_SCOPE_NAME(line) PHASE_SCOPE_JOIN(phaseTimer, line)
+#define PHASE_SCOPE(phase) PhaseTimer PHASE_SCOPE_NAME(__LINE__)(phase)
+#else
+#define PHASE_SCOPE(phase)
+#endif
+
+
+// what Network::ProcessInput logs: the sums of the batches since the last line
+class PhaseLog
+{
+private:
+    std::ofstream _file;
+    bool _csv;
+    int _every, _batches;
+    PhaseTotals _begin, _window;
+
+public:
+    PhaseLog();
+    bool open(const std::string& file, int every);
+    void batchBegin();
+    void batchEnd(long long iter);
+};
@@ -0,0 +1,273 @@
+#include "Workers.h"
+#include "Arena.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <cerrno>
+#include <cstdlib>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <omp.h>
+
+using namespace std;
+
+// lives in an anonymous shared mapping made before the fork
+struct WorkerControl {
+    atomic<int> _arrived;
+    atomic<int> _generation;
+    atomic<int> _failed; // set by worker 0 once a worker has died
+};
+
+static WorkerControl* _control = NULL;
+static pid_t _launcher = 0;
+static int _rank = 0;
+static int _workers = 1;
+static vector<pid_t> _children;
+static int _shard = 0;
+static int _shards = 1;
+// shard 0: the socket to every shard (index 0 unused); other shards: [0] is the socket to shard 0
+static vector<int> _shardSockets;
+
+
+// worker rank's share of the cores this process may run on
+void pinWorker(int rank, int workers)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    vector<int> cpus;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed))
+            cpus.push_back(c);
+    }
+
+    size_t begin = cpus.size() * rank / workers;
+    size_t end = cpus.size() * (rank + 1) / workers;
+    if (end == begin)
+        end = begin + 1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t c = begin; c < end && c < cpus.size(); c++)
+        CPU_SET(cpus[c], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        cout << "Worker " << rank << ": could not pin to its cores" << endl;
+    omp_set_num_threads(end - begin);
+    cout << "Worker " << rank << " of " << workers << ": pid " << getpid() << ", cpus " << cpus[begin] << "-" << cpus[end - 1] << endl;
+}
+
+
+int launchWorkers(int workers)
+{
+    if (workers <= 1)
+        return 0;
+    _workers = workers;
+    void* mem = mmap(NULL, sizeof(WorkerControl), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        cout << "Could not map the worker control block, training in one process" << endl;
+        _workers = 1;
+        return 0;
+    }
+    _control = new (mem) WorkerControl();
+    _control->_arrived = 0;
+    _control->_generation = 0;
+    _control->_failed = 0;
+    _launcher = getpid();
+
+    string prefix = "/slide-" + to_string(getpid());
+    for (int w = 1; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            _rank = w;
+            _children.clear();
+            // do not outlive the launcher
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            break;
+        }
+        if (pid < 0) {
+            cout << "fork failed for worker " << w << endl;
+            continue;
+        }
+        _children.push_back(pid);
+    }
+
+    pinWorker(_rank, _workers);
+    arenaShare(prefix.c_str(), _rank == 0);
+    return _rank;
+}
+
+
+int workerRank()
+{
+    return _rank;
+}
+
+
+int workerCount()
+{
+    return _workers;
+}
+
+
+/*
+* A worker that died before arriving would keep the others waiting for ever: worker 0 watches its
+* children while it waits, the others worker 0. Whoever notices exits with an error, and worker 0's
+* exit takes the remaining workers down with it (PR_SET_PDEATHSIG).
+*/
+static void checkWorkers()
+{
+    if (_rank != 0) {
+        if (_control->_failed.load() || getppid() != _launcher) {
+            cout << "Worker " << _rank << ": another worker is gone, stopping" << endl;
+            exit(1);
+        }
+        return;
+    }
+    for (size_t c = 0; c < _children.size(); c++) {
+        int status;
+        if (waitpid(_children[c], &status, WNOHANG) == _children[c]) {
+            cout << "Worker process " << _children[c] << " exited before reaching the other workers, stopping" << endl;
+            _control->_failed = 1;
+            exit(1);
+        }
+    }
+}
+
+
+void workerBarrier()
+{
+    if (_control == NULL)
+        return;
+    int generation = _control->_generation.load();
+    if (_control->_arrived.fetch_add(1) == _workers - 1) {
+        _control->_arrived = 0;
+        _control->_generation.fetch_add(1);
+    } else {
+        while (_control->_generation.load() == generation) {
+            checkWorkers();
+            usleep(100);
+        }
+    }
+}
+
+
+// all workers hold the shared parameters, so nothing is left in /dev/shm even if one crashes
+void workersAttached()
+{
+    if (_control == NULL)
+        return;
+    workerBarrier();
+    if (_rank == 0)
+        arenaUnlinkShared();
+}
+
+
+void waitForWorkers()
+{
+    for (size_t c = 0; c < _children.size(); c++) {
+        int status;
+        waitpid(_children[c], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            cout << "Worker process " << _children[c] << " did not exit cleanly" << endl;
+    }
+    _children.clear();
+}
+
+
+int launchShards(int shards)
+{
+    if (shards <= 1)
+        return 0;
+    _shards = shards;
+    _shardSockets.assign(shards, -1);
+    for (int s = 1; s < shards; s++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            cout << "Could not create the socket for shard " << s << endl;
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            // keep only the own end towards shard 0
+            for (int o = 1; o < s; o++)
+                close(_shardSockets[o]);
+            close(fds[0]);
+            _shardSockets.assign(1, fds[1]);
+            _shard = s;
+            _children.clear();
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            break;
+        }
+        close(fds[1]);
+        if (pid < 0) {
+            // every shard owns part of the output layer, so there is no running without one
+            cout << "fork failed for shard " << s << endl;
+            exit(1);
+        }
+        _shardSockets[s] = fds[0];
+        _children.push_back(pid);
+    }
+
+    pinWorker(_shard, _shards);
+    return _shard;
+}
+
+
+int shardRank()
+{
+    return _shard;
+}
+
+
+int shardCount()
+{
+    return _shards;
+}
+
+
+void shardRange(size_t nodes, int shard, size_t* begin, size_t* end)
+{
+    *begin = nodes * shard / _shards;
+    *end = nodes * (shard + 1) / _shards;
+}
+
+
+void shardSend(int shard, const void* data, size_t bytes)
+{
+    int fd = _shard == 0 ? _shardSockets[shard] : _shardSockets[0];
+    const char* p = (const char*) data;
+    while (bytes > 0) {
+        ssize_t n = write(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            cout << "Shard " << _shard << ": lost the connection" << endl;
+            exit(1);
+        }
+        p += n;
+        bytes -= n;
+    }
+}
+
+
+bool shardRecv(int shard, void* data, size_t bytes)
+{
+    int fd = _shard == 0 ? _shardSockets[shard] : _shardSockets[0];
+    char* p = (char*) data;
+    while (bytes > 0) {
+        ssize_t n = read(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+
+/*
+*  Data-parallel training with several processes on one host (Workers / SyncPeriod config keys).
+*  launchWorkers forks before any OpenMP region runs and pins every worker to its own slice of the
+*  cores; worker w then trains on every Workers-th batch starting at w. Weights, biases and Adam
+*  state live in /dev/shm (arenaShare in Arena.h) and are updated HOGWILD-style by all workers;
+*  gradients, per-sample training state and LSH tables are private to each worker.
+*  Worker 0 is the launching process: it builds the parameters first, evaluates and saves.
+*/
+int launchWorkers(int workers);
+int workerRank();
+int workerCount();
+void workerBarrier();
+void workersAttached();
+void waitForWorkers();
+void pinWorker(int rank, int workers);
+
+/*
+*  Model-parallel output layer (Shards config key). launchShards forks the shard processes the same way,
+*  each connected to shard 0 (the launching process, which also runs the hidden layers) by a Unix
+*  socket pair. Shard s holds nodes shardRange(s) of the last layer together with their LSH tables;
+*  the exchange itself is in Network (serveShard). shardSend / shardRecv move raw bytes between shard 0
+*  and shard s (from a shard, s is ignored), shardRecv returns false once the peer has gone.
+*/
+int launchShards(int shards);
+int shardRank();
+int shardCount();
+void shardRange(size_t nodes, int shard, size_t* begin, size_t* end);
+void shardSend(int shard, const void* data, size_t bytes);
+bool shardRecv(int shard, void* data, size_t bytes);
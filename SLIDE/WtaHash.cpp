@@ -7,17 +7,26 @@
 #include <algorithm>
 #include <map>
 #include "Config.h"
+#include "Random.h"
+#include "Ledger.h"
 using namespace std;
 
 
-WtaHash::WtaHash(int numHashes, int noOfBitsToHash)
+// bytes of the permutation table, for the memory ledger
+size_t WtaHash::footprint(int numHashes, int noOfBitsToHash)
+{
+    size_t permute = ceil(numHashes * binsize * 1.0 / noOfBitsToHash);
+    return sizeof(int) * noOfBitsToHash * permute;
+}
+
+
+WtaHash::WtaHash(int numHashes, int noOfBitsToHash, CounterRng gen)
 {
 
     _numhashes = numHashes;
     _rangePow = noOfBitsToHash;
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    _key = gen.key();
 
     int permute = ceil(_numhashes*binsize*1.0/noOfBitsToHash);
 
@@ -28,20 +37,31 @@ WtaHash::WtaHash(int numHashes, int noOfBitsToHash)
         n_array[i] = i;
     }
     for (int p=0; p<permute ;p++) {
-        std::shuffle(n_array, n_array+_rangePow, rd);
+        std::shuffle(n_array, n_array+_rangePow, gen);
         std::copy ( n_array, n_array+_rangePow, _indices+(p*_rangePow) );
     }
     delete [] n_array;
+    _ledgerLayer = ledgerLayer();
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, footprint(_numhashes, _rangePow));
 }
 
 
 int * WtaHash::getHash(float* data)
+{
+    int *hashes = new int[_numhashes];
+    getHash(data, hashes);
+    return hashes;
+}
+
+
+void WtaHash::getHash(float* data, int* hashes)
 {
 
     // binsize is the number of times the range is larger than the total number of hashes we need.
 
-    int *hashes = new int[_numhashes];
-    float *values = new float[_numhashes];
+    static thread_local vector<float> valueScratch;
+    valueScratch.resize(_numhashes);
+    float *values = &valueScratch[0];
 
     for (int i = 0; i < _numhashes; i++)
     {
@@ -54,18 +74,25 @@ int * WtaHash::getHash(float* data)
     {
         for (int j=0; j< binsize; j++){
             if (values[i] < data[_indices[i*binsize+j]]) {
-                values[i] = data[i*binsize+j];
+                values[i] = data[_indices[i*binsize+j]];
                 hashes[i] = _indices[i*binsize+j];
             }
         }
 
     }
 
-    delete[] values;
-    return hashes;
+}
+
+
+// key of the stream the parameters were drawn from
+uint64_t WtaHash::key() const
+{
+    return _key;
 }
 
 
 WtaHash::~WtaHash()
 {
+    delete [] _indices;
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, -(long long) footprint(_numhashes, _rangePow));
 }
@@ -8,6 +8,7 @@
 #include <vector>
 #include <string.h>
 #include "MurmurHash.h"
+#include "Random.h"
 /*
 *  Algorithm from the paper The Power of Comparative Reasoning. Jay Yagnik, Dennis Strelow, David A. Ross, Ruei-sung Lin
 
@@ -17,8 +18,13 @@ class WtaHash
 {
 private:
     int *_indices, _numhashes, _rangePow;
+    uint64_t _key;
+    int _ledgerLayer;
 public:
-    WtaHash(int numHashes, int noOfBitsToHash);
+    WtaHash(int numHashes, int noOfBitsToHash, CounterRng gen = rngStream(RNG_WTA, nextStreamId(RNG_WTA)));
+    static size_t footprint(int numHashes, int noOfBitsToHash);
+    uint64_t key() const;
     int * getHash(float* data);
+    void getHash(float* data, int* hashes);
     ~WtaHash();
 };
\ No newline at end of file
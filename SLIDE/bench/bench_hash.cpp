@@ -0,0 +1,231 @@
+#include "../Config.h"
+#include "../Random.h"
+#include "../WtaHash.h"
+#include "../DensifiedWtaHash.h"
+#include "../DensifiedMinhash.h"
+#include "../srp.h"
+#include "../LSH.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+
+/*
+*  bench_hash: times the hash functions and the LSH tables on the layer shapes of Config_amz.csv and
+*  prints one JSON document, so that runs can be diffed to catch regressions. Every benchmark calls the
+*  non-allocating overload training uses on a fixed set of random inputs until at least the given time
+*  has passed, and reports ns per call and hash codes (K * L per call) per second. The tables are filled
+*  with the layer's node count and take as much memory as in training, 6.7 GB for the output layer of
+*  Amazon-670K; a maximum RangePow makes them smaller, and the range_pow of each result is the one used.
+*  Usage: bench_hash [ms per benchmark] [output file, - for stdout] [max RangePow]
+*/
+
+using namespace std;
+
+// a layer of Config_amz.csv. nnz is the non-zeros of the layer's input: the data's for the first
+// layer, sizesOfLayers times Sparsity of the layer below for the others.
+struct HashCase
+{
+    const char* _layer;
+    int _dim, _nnz, _K, _L, _rangePow, _nodes;
+};
+
+static const HashCase CASES[] = {
+    {"amz_layer_0", 135909, 16, 2, 20, 6, 128},
+    {"amz_layer_0", 135909, 64, 2, 20, 6, 128},
+    {"amz_layer_0", 135909, 256, 2, 20, 6, 128},
+    {"amz_layer_1", 128, 128, 6, 50, 18, 670091},
+};
+
+const int INPUTS = 256; // inputs per case, cycled through
+const int CLOCK_EVERY = 16;
+
+struct Input
+{
+    vector<int> _indices;
+    vector<float> _values, _dense;
+};
+
+struct BenchResult
+{
+    string _name;
+    HashCase _case;
+    long long _ops;
+    double _nsPerOp;
+};
+
+static volatile int benchSink;
+
+
+// calls op(i) for i = 0, 1, ... (modulo INPUTS) until ms have passed, checking the clock every CLOCK_EVERY calls
+static BenchResult runBench(const string& name, const HashCase& c, int ms, const function<void(int)>& op)
+{
+    for (int i = 0; i < CLOCK_EVERY; i++) // warm up caches and the hashers' per-thread scratch
+        op(i);
+    long long ops = 0;
+    auto t1 = chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        for (int i = 0; i < CLOCK_EVERY; i++)
+            op((ops + i) % INPUTS);
+        ops += CLOCK_EVERY;
+        elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t1).count();
+    } while (elapsed < ms * 1e6);
+    BenchResult result = {name, c, ops, elapsed / ops};
+    return result;
+}
+
+
+static vector<Input> makeInputs(const HashCase& c, CounterRng& gen)
+{
+    vector<Input> inputs(INPUTS);
+    vector<int> all(c._dim);
+    for (int i = 0; i < c._dim; i++)
+        all[i] = i;
+    uniform_real_distribution<float> value(0, 1);
+    for (int n = 0; n < INPUTS; n++) {
+        Input& input = inputs[n];
+        // partial shuffle: the first nnz ids are a uniform sample, sorted as in the data files
+        for (int i = 0; i < c._nnz; i++)
+            swap(all[i], all[i + gen() % (c._dim - i)]);
+        input._indices.assign(all.begin(), all.begin() + c._nnz);
+        sort(input._indices.begin(), input._indices.end());
+        input._dense.assign(c._dim, 0);
+        for (int i = 0; i < c._nnz; i++) {
+            input._values.push_back(value(gen));
+            input._dense[input._indices[i]] = input._values.back();
+        }
+    }
+    return inputs;
+}
+
+
+static void benchCase(HashCase c, int ms, int maxRangePow, vector<BenchResult>& results)
+{
+    c._rangePow = min(c._rangePow, maxRangePow);
+    int numHashes = c._K * c._L;
+    CounterRng gen(c._nnz); // the inputs are drawn apart from the hashers' streams
+    vector<Input> inputs = makeInputs(c, gen);
+    vector<int> hashes(numHashes);
+
+    // constructed as Layer::drawHashers does
+    WtaHash wta(numHashes, c._dim);
+    DensifiedWtaHash dwta(numHashes, c._dim);
+    DensifiedMinhash minhash(numHashes, c._dim);
+    vector<int> binids(c._dim);
+    minhash.getMap(c._dim, &binids[0]);
+    SparseRandomProjection srp(c._dim, numHashes, Ratio);
+
+    results.push_back(runBench("WtaHash::getHash", c, ms, [&] (int i) {
+        wta.getHash(&inputs[i]._dense[0], &hashes[0]);
+        benchSink = hashes[0];
+    }));
+    results.push_back(runBench("DensifiedWtaHash::getHash", c, ms, [&] (int i) {
+        dwta.getHash(&inputs[i]._indices[0], &inputs[i]._values[0], c._nnz, &hashes[0]);
+        benchSink = hashes[0];
+    }));
+    results.push_back(runBench("DensifiedWtaHash::getHashEasy", c, ms, [&] (int i) {
+        dwta.getHashEasy(&inputs[i]._dense[0], c._dim, TOPK, &hashes[0]);
+        benchSink = hashes[0];
+    }));
+    results.push_back(runBench("DensifiedMinhash::getHash", c, ms, [&] (int i) {
+        minhash.getHash(&inputs[i]._indices[0], &inputs[i]._values[0], &binids[0], c._nnz, &hashes[0]);
+        benchSink = hashes[0];
+    }));
+    results.push_back(runBench("DensifiedMinhash::getHashEasy", c, ms, [&] (int i) {
+        minhash.getHashEasy(&binids[0], &inputs[i]._dense[0], c._dim, TOPK, &hashes[0]);
+        benchSink = hashes[0];
+    }));
+    results.push_back(runBench("SparseRandomProjection::getHash", c, ms, [&] (int i) {
+        srp.getHash(&inputs[i]._dense[0], c._dim, &hashes[0]);
+        benchSink = hashes[0];
+    }));
+    results.push_back(runBench("SparseRandomProjection::getHashSparse", c, ms, [&] (int i) {
+        srp.getHashSparse(&inputs[i]._indices[0], &inputs[i]._values[0], c._nnz, &hashes[0]);
+        benchSink = hashes[0];
+    }));
+
+    // the tables are fed the codes of the configured hash function, as in training
+    vector<int> codes((size_t) INPUTS * numHashes);
+    for (int i = 0; i < INPUTS; i++) {
+        int* h = &codes[(size_t) i * numHashes];
+        if (HashFunction == 1)
+            wta.getHash(&inputs[i]._dense[0], h);
+        else if (HashFunction == 2)
+            dwta.getHash(&inputs[i]._indices[0], &inputs[i]._values[0], c._nnz, h);
+        else if (HashFunction == 3)
+            minhash.getHash(&inputs[i]._indices[0], &inputs[i]._values[0], &binids[0], c._nnz, h);
+        else
+            srp.getHashSparse(&inputs[i]._indices[0], &inputs[i]._values[0], c._nnz, h);
+    }
+    LSH lsh(c._K, c._L, c._rangePow);
+    vector<int> indices((size_t) INPUTS * c._L);
+    results.push_back(runBench("LSH::hashesToIndex", c, ms, [&] (int i) {
+        lsh.hashesToIndex(&codes[(size_t) i * numHashes], &indices[(size_t) i * c._L]);
+        benchSink = indices[(size_t) i * c._L];
+    }));
+    // keep the indices in range whatever the hash function's code width
+    for (size_t i = 0; i < indices.size(); i++)
+        indices[i] &= (1 << c._rangePow) - 1;
+
+    vector<int> secondIndices(c._L);
+    int id = 0;
+    results.push_back(runBench("LSH::add", c, ms, [&] (int i) {
+        lsh.add(&indices[(size_t) i * c._L], id, &secondIndices[0]);
+        id = id + 1 < c._nodes ? id + 1 : 0;
+        benchSink = secondIndices[0];
+    }));
+    lsh.clear();
+    for (int n = 0; n < c._nodes; n++)
+        lsh.add(&indices[(size_t) (n % INPUTS) * c._L], n, &secondIndices[0]);
+    vector<int*> buckets(c._L);
+    results.push_back(runBench("LSH::retrieveRaw", c, ms, [&] (int i) {
+        lsh.retrieveRaw(&indices[(size_t) i * c._L], &buckets[0]);
+        benchSink = buckets[0] != NULL;
+    }));
+}
+
+
+int main(int argc, char* argv[])
+{
+    int ms = argc > 1 ? max(1, atoi(argv[1])) : 200;
+    int maxRangePow = argc > 3 ? max(1, atoi(argv[3])) : 30;
+    setGlobalSeed(1);
+
+    vector<BenchResult> results;
+    for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); c++)
+        benchCase(CASES[c], ms, maxRangePow, results);
+
+    ostringstream json;
+    json << "{\n  \"benchmark\": \"bench_hash\",\n  \"ms_per_benchmark\": " << ms << ",\n"
+         << "  \"config\": {\"HashFunction\": " << HashFunction << ", \"binsize\": " << binsize << ", \"TOPK\": " << TOPK
+         << ", \"Ratio\": " << Ratio << ", \"BUCKETSIZE\": " << BUCKETSIZE << ", \"FIFO\": " << FIFO << "},\n"
+         << "  \"results\": [\n";
+    for (size_t r = 0; r < results.size(); r++) {
+        const BenchResult& result = results[r];
+        const HashCase& c = result._case;
+        json << "    {\"name\": \"" << result._name << "\", \"layer\": \"" << c._layer << "\", \"dim\": " << c._dim
+             << ", \"nnz\": " << c._nnz << ", \"K\": " << c._K << ", \"L\": " << c._L << ", \"range_pow\": " << c._rangePow
+             << ", \"ops\": " << result._ops << ", \"ns_per_op\": " << result._nsPerOp
+             << ", \"hashes_per_sec\": " << (long long) (c._K * c._L * 1e9 / result._nsPerOp) << "}"
+             << (r + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+
+    if (argc > 2 && string(argv[2]) != "-") {
+        ofstream out(argv[2]);
+        out << json.str();
+        if (!out) {
+            cout << "Could not write " << argv[2] << endl;
+            return 1;
+        }
+    }
+    else
+        cout << json.str();
+    return 0;
+}
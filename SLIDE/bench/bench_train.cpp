@@ -0,0 +1,341 @@
+#include "../Config.h"
+#include "../Network.h"
+#include "../AliasTable.h"
+#include "../Random.h"
+#include "../Timing.h"
+#include <omp.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+/*
+*  bench_train: end-to-end training throughput without a dataset. Batches of sparse samples are
+*  generated in memory: Nnz features drawn uniformly from InputDim with values in (0, 1], and
+*  LabelsPerSample labels drawn from Classes with Zipfian frequencies (rank r has weight 1 / r^Zipf).
+*  For every thread count a fresh two-layer Network trains on Batches batches with ProcessInput, then
+*  predictClass runs over TestBatches others. Reported per run: samples/sec of training and of
+*  prediction, the time of each phase and the peak RSS. The training time includes the batches that
+*  rehash or rebuild the tables, whose time is also given alone. A build with PHASE_TIMING adds the
+*  training time of every hot path phase, summed over threads (see Timing.h), and PerfCounters=1 its
+*  hardware counters where the machine allows them. The library's own log goes to stdout and the
+*  results to Output as JSON.
+*  Usage: bench_train [key=value ...], the keys and their defaults being those of BenchConfig below.
+*  K, L, RangePow and Sparsity are per layer as in the config files, Threads is a list (default 1, 2, 4,
+*  ... up to the number of cores).
+*/
+
+using namespace std;
+
+struct BenchConfig
+{
+    int _inputDim = 135909, _nnz = 64, _labelsPerSample = 4, _classes = 100000, _hidden = 128;
+    float _zipf = 1.0;
+    int _batchSize = 128, _batches = 50, _testBatches = 10;
+    int _rehash = 6400, _rebuild = 128000; // in samples, as in the config files
+    float _lr = 0.0001;
+    long long _seed = 1;
+    vector<int> _K = {2, 6}, _L = {20, 50}, _rangePow = {6, 14};
+    vector<float> _sparsity = {1, 0.005, 1, 1};
+    vector<int> _threads;
+    int _perfCounters = 0;
+    string _output = "bench_train.json";
+};
+
+struct Batch
+{
+    vector<vector<int> > _indices, _labels;
+    vector<vector<float> > _values;
+    vector<int*> _indexPtrs, _labelPtrs;
+    vector<float*> _valuePtrs;
+    vector<int> _sizes, _labelSizes;
+};
+
+struct RunResult
+{
+    int _threads;
+    double _initMs, _generateMs, _trainMs, _rehashMs, _predictMs;
+    int _rehashBatches, _correct;
+    long _peakRssKb;
+    PhaseTotals _phases; // of the training batches
+};
+
+
+template <class T>
+static vector<T> parseList(const string& value)
+{
+    vector<T> list;
+    stringstream stream(value);
+    string item;
+    while (getline(stream, item, ','))
+        list.push_back((T) atof(item.c_str()));
+    return list;
+}
+
+
+static bool parseArg(BenchConfig& config, const string& arg)
+{
+    size_t eq = arg.find('=');
+    if (eq == string::npos)
+        return false;
+    string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+    if (key == "InputDim") config._inputDim = atoi(value.c_str());
+    else if (key == "Nnz") config._nnz = atoi(value.c_str());
+    else if (key == "LabelsPerSample") config._labelsPerSample = atoi(value.c_str());
+    else if (key == "Classes") config._classes = atoi(value.c_str());
+    else if (key == "Hidden") config._hidden = atoi(value.c_str());
+    else if (key == "Zipf") config._zipf = atof(value.c_str());
+    else if (key == "Batchsize") config._batchSize = atoi(value.c_str());
+    else if (key == "Batches") config._batches = atoi(value.c_str());
+    else if (key == "TestBatches") config._testBatches = atoi(value.c_str());
+    else if (key == "Rehash") config._rehash = atoi(value.c_str());
+    else if (key == "Rebuild") config._rebuild = atoi(value.c_str());
+    else if (key == "Lr") config._lr = atof(value.c_str());
+    else if (key == "Seed") config._seed = atoll(value.c_str());
+    else if (key == "K") config._K = parseList<int>(value);
+    else if (key == "L") config._L = parseList<int>(value);
+    else if (key == "RangePow") config._rangePow = parseList<int>(value);
+    else if (key == "Sparsity") config._sparsity = parseList<float>(value);
+    else if (key == "Threads") config._threads = parseList<int>(value);
+    else if (key == "PerfCounters") config._perfCounters = atoi(value.c_str());
+    else if (key == "Output") config._output = value;
+    else return false;
+    return true;
+}
+
+
+static void makeBatch(const BenchConfig& config, const AliasTable& labels, CounterRng& gen, Batch& batch)
+{
+    int n = config._batchSize;
+    batch._indices.assign(n, vector<int>());
+    batch._values.assign(n, vector<float>());
+    batch._labels.assign(n, vector<int>());
+    batch._indexPtrs.resize(n);
+    batch._valuePtrs.resize(n);
+    batch._labelPtrs.resize(n);
+    batch._sizes.resize(n);
+    batch._labelSizes.resize(n);
+    uniform_int_distribution<int> feature(0, config._inputDim - 1);
+    uniform_real_distribution<float> value(0, 1);
+    for (int s = 0; s < n; s++) {
+        vector<int>& indices = batch._indices[s];
+        while ((int) indices.size() < min(config._nnz, config._inputDim)) {
+            indices.push_back(feature(gen));
+            if ((int) indices.size() == config._nnz) {
+                sort(indices.begin(), indices.end());
+                indices.erase(unique(indices.begin(), indices.end()), indices.end());
+            }
+        }
+        for (size_t i = 0; i < indices.size(); i++)
+            batch._values[s].push_back(1 - value(gen));
+        vector<int>& sample = batch._labels[s];
+        while ((int) sample.size() < min(config._labelsPerSample, config._classes)) {
+            int label = labels.sample(gen);
+            if (find(sample.begin(), sample.end(), label) == sample.end())
+                sample.push_back(label);
+        }
+        batch._indexPtrs[s] = &indices[0];
+        batch._valuePtrs[s] = &batch._values[s][0];
+        batch._labelPtrs[s] = &sample[0];
+        batch._sizes[s] = indices.size();
+        batch._labelSizes[s] = sample.size();
+    }
+}
+
+
+// peak RSS since the last resetPeakRss, in kB (VmHWM), 0 where /proc does not have it
+static long peakRssKb()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    return 0;
+}
+
+
+static void resetPeakRss()
+{
+    ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+}
+
+
+static double msSince(chrono::steady_clock::time_point t1)
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t1).count() / 1000.0;
+}
+
+
+static RunResult run(const BenchConfig& config, int threads)
+{
+    RunResult result;
+    memset(&result, 0, sizeof(result));
+    result._threads = threads;
+    omp_set_num_threads(threads);
+    setGlobalSeed(config._seed);
+    resetPeakRss();
+
+    // Zipfian label frequencies
+    vector<double> weights(config._classes);
+    for (int c = 0; c < config._classes; c++)
+        weights[c] = 1.0 / pow(c + 1.0, config._zipf);
+    AliasTable labels;
+    labels.build(weights);
+
+    auto t1 = chrono::steady_clock::now();
+    CounterRng gen(config._seed);
+    vector<Batch> train(config._batches), test(config._testBatches);
+    for (size_t b = 0; b < train.size(); b++)
+        makeBatch(config, labels, gen, train[b]);
+    for (size_t b = 0; b < test.size(); b++)
+        makeBatch(config, labels, gen, test[b]);
+    result._generateMs = msSince(t1);
+
+    t1 = chrono::steady_clock::now();
+    // the network takes over these two, as from main.cpp
+    int* sizesOfLayers = new int[2];
+    sizesOfLayers[0] = config._hidden;
+    sizesOfLayers[1] = config._classes;
+    NodeType* layersTypes = new NodeType[2];
+    layersTypes[0] = NodeType::ReLU;
+    layersTypes[1] = NodeType::Softmax;
+    vector<int> K(config._K), L(config._L), rangePow(config._rangePow);
+    vector<float> sparsity(config._sparsity);
+    cnpy::npz_t arr;
+    Network* network = new Network(sizesOfLayers, layersTypes, 2, config._batchSize, config._lr, config._inputDim,
+                                   &K[0], &L[0], &rangePow[0], &sparsity[0], arr);
+    network->setSyncPeriod(1);
+    network->setNegativeSampling(NEGATIVES_UNIFORM, 0.75);
+    result._initMs = msSince(t1);
+
+    // rehash and rebuild as main.cpp decides them
+    int rehashBatches = max(1, config._rehash / config._batchSize), rebuildBatches = max(1, config._rebuild / config._batchSize);
+    PhaseTotals before;
+    phaseTotals(&before);
+    for (int b = 0; b < config._batches; b++) {
+        Batch& batch = train[b];
+        bool rehash = (Mode == 1 || Mode == 4) && b % rehashBatches == rehashBatches - 1;
+        bool rebuild = (Mode == 1 || Mode == 4) && b % rebuildBatches == rehashBatches - 1;
+        t1 = chrono::steady_clock::now();
+        network->ProcessInput(&batch._indexPtrs[0], &batch._valuePtrs[0], &batch._sizes[0], &batch._labelPtrs[0],
+                              &batch._labelSizes[0], b, rehash, rebuild);
+        double ms = msSince(t1);
+        result._trainMs += ms;
+        if (rehash || rebuild) {
+            result._rehashMs += ms;
+            result._rehashBatches++;
+        }
+    }
+    network->flushUpdates();
+    phaseTotals(&result._phases);
+    for (int p = 0; p < PHASES; p++) {
+        result._phases._ns[p] -= before._ns[p];
+        result._phases._calls[p] -= before._calls[p];
+        for (int e = 0; e < PERF_EVENTS; e++)
+            result._phases._perf[p][e] -= before._perf[p][e];
+    }
+
+    t1 = chrono::steady_clock::now();
+    for (int b = 0; b < config._testBatches; b++) {
+        Batch& batch = test[b];
+        result._correct += network->predictClass(&batch._indexPtrs[0], &batch._valuePtrs[0], &batch._sizes[0],
+                                                 &batch._labelPtrs[0], &batch._labelSizes[0]);
+    }
+    result._predictMs = msSince(t1);
+    result._peakRssKb = peakRssKb();
+    delete network;
+    return result;
+}
+
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    for (int a = 1; a < argc; a++) {
+        if (!parseArg(config, argv[a])) {
+            cout << "Unknown argument " << argv[a] << endl;
+            return 1;
+        }
+    }
+    if (config._K.size() < 2 || config._L.size() < 2 || config._rangePow.size() < 2 || config._sparsity.size() < 4) {
+        cout << "K, L and RangePow need 2 values and Sparsity 4, as for numLayer=2" << endl;
+        return 1;
+    }
+    if (config._threads.empty()) {
+        int cores = omp_get_max_threads();
+        for (int t = 1; t < cores; t *= 2)
+            config._threads.push_back(t);
+        config._threads.push_back(cores);
+    }
+    if (config._perfCounters)
+        enablePerfCounters();
+
+    vector<RunResult> results;
+    for (size_t t = 0; t < config._threads.size(); t++) {
+        RunResult result = run(config, max(1, config._threads[t]));
+        results.push_back(result);
+        double samples = (double) config._batches * config._batchSize;
+        cout << "bench_train: " << result._threads << " threads, " << samples / result._trainMs * 1000 << " samples/s training, "
+             << (double) config._testBatches * config._batchSize / result._predictMs * 1000 << " samples/s prediction, peak RSS "
+             << result._peakRssKb / 1024 << " MB" << endl;
+    }
+
+    ofstream json(config._output.c_str());
+    json << "{\n  \"benchmark\": \"bench_train\",\n"
+         << "  \"config\": {\"InputDim\": " << config._inputDim << ", \"Nnz\": " << config._nnz
+         << ", \"LabelsPerSample\": " << config._labelsPerSample << ", \"Classes\": " << config._classes
+         << ", \"Zipf\": " << config._zipf << ", \"Hidden\": " << config._hidden << ", \"Batchsize\": " << config._batchSize
+         << ", \"Batches\": " << config._batches << ", \"TestBatches\": " << config._testBatches
+         << ", \"K\": [" << config._K[0] << ", " << config._K[1] << "], \"L\": [" << config._L[0] << ", " << config._L[1]
+         << "], \"RangePow\": [" << config._rangePow[0] << ", " << config._rangePow[1]
+         << "], \"HashFunction\": " << HashFunction << ", \"Mode\": " << Mode << "},\n  \"runs\": [\n";
+    for (size_t r = 0; r < results.size(); r++) {
+        const RunResult& result = results[r];
+        json << "    {\"threads\": " << result._threads
+             << ", \"train_samples_per_sec\": " << config._batches * config._batchSize / result._trainMs * 1000
+             << ", \"predict_samples_per_sec\": " << config._testBatches * config._batchSize / result._predictMs * 1000
+             << ", \"phases_ms\": {\"generate\": " << result._generateMs << ", \"init\": " << result._initMs
+             << ", \"train\": " << result._trainMs << ", \"rehash\": " << result._rehashMs
+             << ", \"predict\": " << result._predictMs << "}";
+        if (PHASE_TIMING) {
+            json << ", \"hot_path_ms\": {";
+            for (int p = 0; p < PHASES; p++)
+                json << (p ? ", " : "") << "\"" << PHASE_NAMES[p] << "\": " << result._phases._ns[p] / 1e6;
+            json << "}";
+        }
+        if (perfCountersOn()) {
+            json << ", \"hot_path_counters\": {";
+            for (int p = 0; p < PHASES; p++) {
+                json << (p ? ", " : "") << "\"" << PHASE_NAMES[p] << "\": {";
+                for (int e = 0; e < PERF_EVENTS; e++) {
+                    json << (e ? ", " : "") << "\"" << PERF_NAMES[e] << "\": ";
+                    if (perfEventCounted(e))
+                        json << result._phases._perf[p][e];
+                    else
+                        json << "null";
+                }
+                json << "}";
+            }
+            json << "}";
+        }
+        json << ", \"rehash_batches\": " << result._rehashBatches
+             << ", \"p_at_1\": " << result._correct * 1.0 / max(1, config._testBatches * config._batchSize)
+             << ", \"peak_rss_mb\": " << result._peakRssKb / 1024.0 << "}" << (r + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+    if (!json) {
+        cout << "Could not write " << config._output << endl;
+        return 1;
+    }
+    cout << "bench_train: results in " << config._output << endl;
+    return 0;
+}
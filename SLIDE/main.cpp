@@ -17,6 +17,10 @@
 #include<map>
 #include<string>
 #include "Config.h"
+#include "Workers.h"
+#include "Random.h"
+#include "Checkpoint.h"
+#include "Ledger.h"
 
 int *RangePow;
 int *K;
@@ -33,6 +37,20 @@ int totRecordsTest = 10000;
 float Lr = 0.0001;
 int Epoch = 5;
 int Stepsize = 20;
+int Workers = 1;
+int SyncPeriod = 1;
+int Shards = 1;
+long long Seed = -1;
+int AsyncCheckpoint = 0;
+int CheckpointEvery = 0;
+string Resume = "";
+int CheckpointRows = 0;
+int CheckpointCompression = 0;
+string PhaseLogFile = "";
+int PhaseLogEvery = 100;
+int PerfCounters = 0;
+int Negatives = NEGATIVES_UNIFORM;
+float NegativePower = 0.75;
 int *sizesOfLayers;
 int numLayer = 3;
 string trainData = "";
@@ -40,6 +58,7 @@ string testData = "";
 string Weights = "";
 string savedWeights = "";
 string logFile = "";
+string FrozenModel = "";
 using namespace std;
 int globalTime = 0;
 
@@ -180,6 +199,38 @@ void parseconfig(string filename)
         {
             Stepsize = atoi(trim(second).c_str());
         }
+        else if (trim(first) == "Workers")
+        {
+            Workers = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "SyncPeriod")
+        {
+            SyncPeriod = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "Shards")
+        {
+            Shards = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "Seed")
+        {
+            Seed = atoll(trim(second).c_str());
+        }
+        else if (trim(first) == "Negatives")
+        {
+            string mode = trim(second);
+            if (mode == "frequency")
+                Negatives = NEGATIVES_FREQUENCY;
+            else if (mode == "power")
+                Negatives = NEGATIVES_POWER;
+            else if (mode == "uniform")
+                Negatives = NEGATIVES_UNIFORM;
+            else
+                cout << "Unknown Negatives " << mode << ", using uniform" << endl;
+        }
+        else if (trim(first) == "NegativePower")
+        {
+            NegativePower = atof(trim(second).c_str());
+        }
         else if (trim(first) == "numLayer")
         {
             numLayer = atoi(trim(second).c_str());
@@ -202,6 +253,42 @@ void parseconfig(string filename)
                 i++;
             }
         }
+        else if (trim(first) == "AsyncCheckpoint")
+        {
+            AsyncCheckpoint = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "CheckpointEvery")
+        {
+            CheckpointEvery = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "CheckpointRows")
+        {
+            CheckpointRows = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "CheckpointCompression")
+        {
+            CheckpointCompression = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "PhaseLog")
+        {
+            PhaseLogFile = trim(second).c_str();
+        }
+        else if (trim(first) == "PhaseLogEvery")
+        {
+            PhaseLogEvery = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "PerfCounters")
+        {
+            PerfCounters = atoi(trim(second).c_str());
+        }
+        else if (trim(first) == "resume")
+        {
+            Resume = trim(second).c_str();
+        }
+        else if (trim(first) == "FrozenModel")
+        {
+            FrozenModel = trim(second).c_str();
+        }
         else if (trim(first) == "trainData")
         {
             trainData = trim(second).c_str();
@@ -228,6 +315,8 @@ void parseconfig(string filename)
 
 void EvalDataSVM(int numBatchesTest,  Network* _mynet, int iter){
     int totCorrect = 0;
+    // summed P@1 .. P@5 of all test samples
+    float totPrecision[5] = {0, 0, 0, 0, 0};
     int debugnumber = 0;
     std::ifstream testfile(testData);
     string str;
@@ -309,8 +398,11 @@ void EvalDataSVM(int numBatchesTest,  Network* _mynet, int iter){
         }
 
         std::cout << Batchsize << " records, with "<< num_features << " features and " << num_labels << " labels" << std::endl;
-        auto correctPredict = _mynet->predictClass(records, values, sizes, labels, labelsize);
-        totCorrect += correctPredict;
+        float precision[5];
+        _mynet->precisionAtK(records, values, sizes, labels, labelsize, 5, precision);
+        for (int r = 0; r < 5; r++)
+            totPrecision[r] += precision[r];
+        totCorrect = (int) totPrecision[0];
         std::cout <<" iter "<< i << ": " << totCorrect*1.0/(Batchsize*(i+1)) << " correct" << std::endl;
 
         delete[] sizes;
@@ -324,20 +416,54 @@ void EvalDataSVM(int numBatchesTest,  Network* _mynet, int iter){
 
     }
     testfile.close();
-    cout << "over all " << totCorrect * 1.0 / (numBatchesTest*Batchsize) << endl;
-    outputFile << iter << " " << globalTime/1000 << " " << totCorrect * 1.0 / (numBatchesTest*Batchsize) << endl;
+    int samples = numBatchesTest*Batchsize;
+    cout << "over all " << totCorrect * 1.0 / samples << endl;
+    cout << "P@1 " << totPrecision[0] / samples << " P@3 " << totPrecision[2] / samples << " P@5 " << totPrecision[4] / samples << endl;
+    outputFile << iter << " " << globalTime/1000 << " " << totCorrect * 1.0 / samples << " " << totPrecision[2] / samples << " " << totPrecision[4] / samples << endl;
+
+}
 
+// savedweight for serving and LOADWEIGHT, and with resume the training state to continue from batch iter
+void SaveCheckpoint(Network* _mynet, long long iter){
+    if (AsyncCheckpoint) {
+        _mynet->saveWeightsAsync(savedWeights, Resume, iter);
+        return;
+    }
+    if (savedWeights != "")
+        _mynet->saveWeights(savedWeights);
+    if (Resume != "")
+        _mynet->saveState(Resume, iter);
 }
 
-void ReadDataSVM(size_t numBatches,  Network* _mynet, int epoch){
+
+// from batch firstBatch of the epoch on, the earlier ones were trained before the run was resumed
+void ReadDataSVM(size_t numBatches,  Network* _mynet, int epoch, size_t firstBatch){
     std::ifstream file(trainData);
     std::string str;
     //skipe header
     std::getline( file, str );
-    for (size_t i = 0; i < numBatches; i++) {
-        if((i+epoch*numBatches)%Stepsize==0) {
+    int rank = workerRank();
+    int workers = workerCount();
+    for (size_t i = 0; i < firstBatch; i++) {
+        for (int count = 0; count < Batchsize && std::getline(file, str); count++);
+    }
+    for (size_t i = firstBatch; i < numBatches; i++) {
+        if((i+epoch*numBatches)%Stepsize==0 && rank == 0) {
             EvalDataSVM(20, _mynet, epoch*numBatches+i);
         }
+        // checkpoints within the epoch as well, every CheckpointEvery batches. Tested before the Workers
+        // skip, so that rank 0 counts every batch and not only its own; the epoch's first batch follows
+        // the checkpoint of the epoch before (or the one resumed from).
+        if (rank == 0 && CheckpointEvery > 0 && i > firstBatch && (epoch*numBatches+i)%CheckpointEvery == 0) {
+            SaveCheckpoint(_mynet, epoch*numBatches+i);
+        }
+        // with several workers, each trains on every workers-th batch
+        if ((i+epoch*numBatches)%workers != (size_t) rank) {
+            for (int count = 0; count < Batchsize && std::getline(file, str); count++);
+            continue;
+        }
+        // rehash/rebuild follow the batches this worker has seen
+        size_t step = (epoch*numBatches+i)/workers;
         int **records = new int *[Batchsize];
         float **values = new float *[Batchsize];
         int *sizes = new int[Batchsize];
@@ -403,13 +529,13 @@ void ReadDataSVM(size_t numBatches,  Network* _mynet, int epoch){
 
         bool rehash = false;
         bool rebuild = false;
-        if ((epoch*numBatches+i)%(Rehash/Batchsize) == ((size_t)Rehash/Batchsize-1)){
+        if (step%(Rehash/Batchsize) == ((size_t)Rehash/Batchsize-1)){
             if(Mode==1 || Mode==4) {
                 rehash = true;
             }
         }
 
-        if ((epoch*numBatches+i)%(Rebuild/Batchsize) == ((size_t)Rehash/Batchsize-1)){
+        if (step%(Rebuild/Batchsize) == ((size_t)Rehash/Batchsize-1)){
             if(Mode==1 || Mode==4) {
                 rebuild = true;
             }
@@ -443,12 +569,69 @@ void ReadDataSVM(size_t numBatches,  Network* _mynet, int epoch){
 }
 
 
+/*
+* runme <config> --dry-run: the memory ledger of the network the config describes, from the layer
+* shapes alone. With Shards it is shard 0's, holding the hidden layers and the largest part of the output layer.
+*/
+void DryRun(const char* config)
+{
+    if (Seed >= 0) {
+        setGlobalSeed(Seed);
+    }
+    for (int i = 0; i < numLayer; i++) {
+        size_t nodes = sizesOfLayers[i];
+        if (Shards > 1 && i == numLayer - 1) {
+            nodes = (nodes + Shards - 1) / Shards;
+        }
+        size_t bytes[LEDGER_CATEGORIES];
+        Layer::footprint(nodes, i == 0 ? InputDim : sizesOfLayers[i - 1], i, Batchsize, K[i], L[i], RangePow[i], Sparsity[i], bytes);
+        for (int c = 0; c < LEDGER_CATEGORIES; c++) {
+            ledgerCharge(i, (LedgerCategory) c, bytes[c]);
+        }
+    }
+    ledgerReport("of " + string(config) + " (dry run, nothing allocated)");
+}
+
+
 int main(int argc, char* argv[])
 {
     //***********************************
     // Parse Config File
     //***********************************
     parseconfig(argv[1]);
+    if (Shards > 1 && (Workers > 1 || numLayer < 2)) {
+        cout << "Shards needs Workers=1 and a hidden layer, training with one shard" << endl;
+        Shards = 1;
+    }
+    if (argc > 2 && string(argv[2]) == "--dry-run") {
+        DryRun(argv[1]);
+        return 0;
+    }
+    // forks here, before any OpenMP region
+    int rank = launchWorkers(Workers);
+    int shard = launchShards(Shards);
+    // a run preempted earlier continues from its training state, each shard from its own file
+    string stateFile = "";
+    StateHeader state;
+    long long startIter = 0;
+    if (Resume != "") {
+        string file = shard == 0 ? Resume : Resume + ".shard" + to_string(shard);
+        if (readStateHeader(file.c_str(), &state)) {
+            // the batch count only gives the data position with the same batches
+            if (state._batchSize != Batchsize) {
+                cout << "Training state " << file << " was saved with Batchsize " << state._batchSize << endl;
+                return 1;
+            }
+            stateFile = file;
+            startIter = state._iter;
+        }
+    }
+    // the shards' parts of the output layer start from different weights
+    if (stateFile != "") {
+        setGlobalSeed(state._seed, state._seedFixed);
+    } else if (Seed >= 0) {
+        setGlobalSeed(Seed + shard);
+    }
 
     //***********************************
     // Initialize Network
@@ -463,34 +646,76 @@ int main(int argc, char* argv[])
     layersTypes[numLayer-1] = NodeType::Softmax;
 
     cnpy::npz_t arr;
-    if (LOADWEIGHT) {
-        arr = cnpy::npz_load(Weights);
+    if (LOADWEIGHT && stateFile == "") {
+        arr = loadCheckpoint(Weights);
     }
     auto t1 = std::chrono::high_resolution_clock::now();
-    Network *_mynet = new Network(sizesOfLayers, layersTypes, numLayer, Batchsize, Lr, InputDim, K, L, RangePow, Sparsity, arr);
+    // worker 0 creates and initializes the shared parameters, the others attach once it is done
+    if (rank != 0) {
+        workerBarrier();
+    }
+    Network *_mynet = new Network(sizesOfLayers, layersTypes, numLayer, Batchsize, Lr, InputDim, K, L, RangePow, Sparsity, arr, stateFile);
+    if (rank == 0) {
+        workerBarrier();
+    }
+    workersAttached();
+    _mynet->setSyncPeriod(SyncPeriod);
+    _mynet->setCheckpointFormat(CheckpointRows, CheckpointCompression);
+    // one log for the run, other workers train the same phases
+    if (PerfCounters)
+        enablePerfCounters();
+    if (rank == 0 && shard == 0)
+        _mynet->setPhaseLog(PhaseLogFile, PhaseLogEvery);
+    _mynet->setNegativeSampling(Negatives, NegativePower);
     auto t2 = std::chrono::high_resolution_clock::now();
     float timeDiffInMiliseconds = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
     std::cout << "Network Initialization takes " << timeDiffInMiliseconds/1000 << " milliseconds" << std::endl;
 
+    // the other shards only answer shard 0's requests for their part of the output layer
+    if (shard != 0) {
+        _mynet->serveShard();
+        delete _mynet;
+        return 0;
+    }
+
     //***********************************
     // Start Training
     //***********************************
 
-    for (int e=0; e< Epoch; e++) {
-        ofstream outputFile(logFile,  std::ios_base::app);
-        outputFile<<"Epoch "<<e<<endl;
+    for (int e=startIter/numBatches; e< Epoch; e++) {
+        if (rank == 0) {
+            ofstream outputFile(logFile,  std::ios_base::app);
+            outputFile<<"Epoch "<<e<<endl;
+        }
         // train
-        ReadDataSVM(numBatches, _mynet, e);
+        ReadDataSVM(numBatches, _mynet, e, e == startIter/numBatches ? startIter%numBatches : 0);
 
+        if (rank != 0) {
+            continue;
+        }
         // test
         if(e==Epoch-1) {
             EvalDataSVM(numBatchesTest, _mynet, (e+1)*numBatches);
         }else{
             EvalDataSVM(50, _mynet, (e+1)*numBatches);
         }
-        _mynet->saveWeights(savedWeights);
+        if (PHASE_TIMING) {
+            ofstream outputFile(logFile,  std::ios_base::app);
+            writePhaseProfile(outputFile);
+        }
+        SaveCheckpoint(_mynet, (e+1)*numBatches);
 
     }
+    if (rank == 0)
+        _mynet->finishCheckpoint();
+    // the final model for serving, see Frozen.h
+    if (rank == 0 && FrozenModel != "") {
+        _mynet->exportFrozen(FrozenModel);
+    }
+    if (rank == 0) {
+        _mynet->stopShards();
+        waitForWorkers();
+    }
 
     delete [] RangePow;
     delete [] K;
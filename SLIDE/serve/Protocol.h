@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+
+/*
+*  Wire format between slide_server and its clients over a Unix stream socket, native byte order.
+*  A client sends requests back to back on one connection: a RequestHeader followed by _nnz int32
+*  feature ids and _nnz float values. The server answers each with a ResponseHeader carrying the same
+*  _id, followed by _count int32 labels and _count float scores (softmax probabilities, best first).
+*  Answers may come out of order when requests of one connection land in different micro-batches.
+*  A header with _nnz == STATS_REQUEST asks for the server's counters instead: the answer is a
+*  ResponseHeader with _count 0 followed by one ServeStats.
+*/
+const uint32_t STATS_REQUEST = 0xFFFFFFFF;
+// largest request the server accepts, to bound what a broken client can make it allocate
+const uint32_t MAX_REQUEST_NNZ = 1 << 24;
+
+struct RequestHeader
+{
+    uint32_t _id;
+    uint32_t _nnz;
+    uint32_t _k;
+};
+
+struct ResponseHeader
+{
+    uint32_t _id;
+    uint32_t _count;
+};
+
+// counters of the last reporting window (latency from a request's arrival to its answer) and totals
+struct ServeStats
+{
+    double _qps;
+    double _p50Us, _p99Us;
+    double _avgBatch;
+    uint64_t _requests, _batches;
+};
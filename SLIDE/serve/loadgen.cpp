@@ -0,0 +1,199 @@
+#include "Protocol.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+*  slide_loadgen: drives slide_server with the samples of an SVM file (the training data format,
+*  header line first) and reports client-side QPS, p50 / p99 latency and P@1 against the file's
+*  labels, then the server's own counters.
+*  Usage: slide_loadgen <socket> <data file> [connections] [requests] [k] [in flight per connection]
+*/
+
+using namespace std;
+
+struct Sample
+{
+    vector<int> _labels, _indices;
+    vector<float> _values;
+};
+
+
+static bool readFully(int fd, void* data, size_t bytes)
+{
+    char* p = (char*) data;
+    while (bytes > 0) {
+        ssize_t n = read(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+static bool writeFully(int fd, const void* data, size_t bytes)
+{
+    const char* p = (const char*) data;
+    while (bytes > 0) {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+static int connectTo(const char* path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*) &address, sizeof(address)) != 0) {
+        cout << "Could not connect to " << path << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+    return fd;
+}
+
+
+// "l1,l2 i:v i:v ..." per line, as main.cpp reads it
+static vector<Sample> readSamples(const char* path)
+{
+    vector<Sample> samples;
+    ifstream file(path);
+    string str;
+    getline(file, str);
+    while (getline(file, str)) {
+        Sample sample;
+        size_t space = str.find(' ');
+        string labels = str.substr(0, space);
+        char* pch = strtok(&labels[0], ",");
+        while (pch != NULL) {
+            sample._labels.push_back(atoi(pch));
+            pch = strtok(NULL, ",");
+        }
+        string features = space == string::npos ? "" : str.substr(space + 1);
+        pch = strtok(&features[0], " :");
+        for (int track = 0; pch != NULL; track++) {
+            if (track % 2 == 0)
+                sample._indices.push_back(atoi(pch));
+            else
+                sample._values.push_back(atof(pch));
+            pch = strtok(NULL, " :");
+        }
+        if (!sample._indices.empty() && sample._indices.size() == sample._values.size())
+            samples.push_back(sample);
+    }
+    return samples;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        cout << "Usage: slide_loadgen <socket> <data file> [connections] [requests] [k] [in flight per connection]" << endl;
+        return 1;
+    }
+    const char* path = argv[1];
+    int connections = argc > 3 ? max(1, atoi(argv[3])) : 4;
+    int requests = argc > 4 ? max(1, atoi(argv[4])) : 10000;
+    uint32_t k = argc > 5 ? max(1, atoi(argv[5])) : 5;
+    int inFlight = argc > 6 ? max(1, atoi(argv[6])) : 1;
+
+    vector<Sample> samples = readSamples(argv[2]);
+    if (samples.empty()) {
+        cout << "No samples in " << argv[2] << endl;
+        return 1;
+    }
+    cout << samples.size() << " samples, " << requests << " requests over " << connections << " connections, "
+         << inFlight << " in flight each" << endl;
+
+    vector<vector<float> > latencies(connections);
+    atomic<int> correct(0), answered(0);
+    auto t1 = chrono::steady_clock::now();
+    vector<thread> clients;
+    for (int c = 0; c < connections; c++) {
+        clients.push_back(thread([&, c] ()
+        {
+            int fd = connectTo(path);
+            int share = requests / connections + (c < requests % connections);
+            vector<chrono::steady_clock::time_point> sent(share);
+            vector<int> labels(k);
+            vector<float> scores(k);
+            int next = 0;
+            for (int done = 0; done < share; done++) {
+                // keep inFlight requests outstanding, sample of request r is r-th of this connection's stride
+                for (; next < share && next < done + inFlight; next++) {
+                    const Sample& sample = samples[((size_t) next * connections + c) % samples.size()];
+                    RequestHeader header = {(uint32_t) next, (uint32_t) sample._indices.size(), k};
+                    sent[next] = chrono::steady_clock::now();
+                    if (!writeFully(fd, &header, sizeof(header))
+                            || !writeFully(fd, sample._indices.data(), sample._indices.size() * sizeof(int))
+                            || !writeFully(fd, sample._values.data(), sample._values.size() * sizeof(float))) {
+                        cout << "Connection " << c << " lost" << endl;
+                        return;
+                    }
+                }
+                ResponseHeader response;
+                if (!readFully(fd, &response, sizeof(response)) || response._count > k
+                        || !readFully(fd, labels.data(), response._count * sizeof(int))
+                        || !readFully(fd, scores.data(), response._count * sizeof(float))) {
+                    cout << "Connection " << c << " lost" << endl;
+                    return;
+                }
+                latencies[c].push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sent[response._id]).count());
+                const Sample& sample = samples[((size_t) response._id * connections + c) % samples.size()];
+                if (response._count > 0 && find(sample._labels.begin(), sample._labels.end(), labels[0]) != sample._labels.end())
+                    correct++;
+                answered++;
+            }
+            close(fd);
+        }));
+    }
+    for (size_t c = 0; c < clients.size(); c++)
+        clients[c].join();
+    auto t2 = chrono::steady_clock::now();
+
+    vector<float> all;
+    for (int c = 0; c < connections; c++)
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+    sort(all.begin(), all.end());
+    double seconds = chrono::duration_cast<chrono::microseconds>(t2 - t1).count() / 1e6;
+    if (!all.empty()) {
+        cout << "client: QPS " << all.size() / seconds << " p50 " << all[all.size() / 2] << " us p99 " << all[all.size() * 99 / 100]
+             << " us, P@1 " << correct * 1.0 / answered << endl;
+    }
+
+    // the server publishes its counters once per StatsPeriod
+    int fd = connectTo(path);
+    RequestHeader header = {0, STATS_REQUEST, 0};
+    ResponseHeader response;
+    ServeStats stats;
+    if (writeFully(fd, &header, sizeof(header)) && readFully(fd, &response, sizeof(response)) && readFully(fd, &stats, sizeof(stats))) {
+        cout << "server: QPS " << stats._qps << " p50 " << stats._p50Us << " us p99 " << stats._p99Us << " us, "
+             << stats._avgBatch << " requests per batch, " << stats._requests << " requests in " << stats._batches << " batches" << endl;
+    }
+    close(fd);
+    return 0;
+}
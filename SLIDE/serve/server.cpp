@@ -0,0 +1,461 @@
+#include "../Network.h"
+#include "../Config.h"
+#include "../Random.h"
+#include "../Checkpoint.h"
+#include "Protocol.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <omp.h>
+
+/*
+*  slide_server: answers top-k queries for a trained model over a Unix socket (see Protocol.h).
+*  Takes the training config file; the network is built from its layer keys and loaded from
+*  Checkpoint (by default savedweight). Every connection has a reader thread that queues its
+*  requests; ServeThreads batchers each take up to MaxBatch queued requests, waiting at most
+*  MaxWaitUs after the oldest one arrived, and run them through Network::predictTopK with their
+*  own InferenceContext. QPS and p50 / p99 latency are printed every StatsPeriod seconds.
+*/
+
+using namespace std;
+
+int *RangePow;
+int *K;
+int *L;
+float *Sparsity;
+int *sizesOfLayers;
+int numLayer = 3;
+int InputDim = 784;
+float Lr = 0.0001;
+long long Seed = -1;
+string Checkpoint = "";
+string FrozenModel = "";
+string Socket = "/tmp/slide.sock";
+int MaxBatch = 64;
+int MaxWaitUs = 1000;
+int TopK = 5;
+int ServeThreads = 1;
+int StatsPeriod = 10;
+
+
+string trim(string& str)
+{
+    size_t first = str.find_first_not_of(' ');
+    size_t last = str.find_last_not_of(' ');
+    return str.substr(first, (last - first + 1));
+}
+
+
+template <typename T>
+T* parseList(string value, T (*parse)(const char*))
+{
+    T* list = new T[numLayer * 2];
+    char *pch = strtok(&value[0], ",");
+    for (int i = 0; pch != NULL && i < numLayer * 2; i++) {
+        list[i] = parse(pch);
+        pch = strtok(NULL, ",");
+    }
+    return list;
+}
+
+
+int parseInt(const char* s)
+{
+    return atoi(s);
+}
+
+
+float parseFloat(const char* s)
+{
+    return atof(s);
+}
+
+
+// the training config's keys the network needs, and the serving keys; everything else is ignored
+void parseconfig(string filename)
+{
+    std::ifstream file(filename);
+    if(!file)
+    {
+        cout<<"Error Config file not found: Given Filename "<< filename << endl;
+    }
+    std::string str;
+    while (getline(file, str))
+    {
+        if (str.find("#") != std::string::npos || trim(str).length() < 3)
+            continue;
+
+        int index = str.find_first_of("=");
+        string first = str.substr(0, index);
+        string second = str.substr(index + 1, str.length());
+        first = trim(first);
+        second = trim(second);
+
+        if (first == "RangePow")
+            RangePow = parseList(second, parseInt);
+        else if (first == "K")
+            K = parseList(second, parseInt);
+        else if (first == "L")
+            L = parseList(second, parseInt);
+        else if (first == "Sparsity")
+            Sparsity = parseList(second, parseFloat);
+        else if (first == "sizesOfLayers")
+            sizesOfLayers = parseList(second, parseInt);
+        else if (first == "numLayer")
+            numLayer = atoi(second.c_str());
+        else if (first == "InputDim")
+            InputDim = atoi(second.c_str());
+        else if (first == "Lr")
+            Lr = atof(second.c_str());
+        else if (first == "Seed")
+            Seed = atoll(second.c_str());
+        else if (first == "savedweight" && Checkpoint == "")
+            Checkpoint = second;
+        else if (first == "Checkpoint")
+            Checkpoint = second;
+        else if (first == "FrozenModel")
+            FrozenModel = second;
+        else if (first == "Socket")
+            Socket = second;
+        else if (first == "MaxBatch")
+            MaxBatch = max(1, atoi(second.c_str()));
+        else if (first == "MaxWaitUs")
+            MaxWaitUs = max(0, atoi(second.c_str()));
+        else if (first == "TopK")
+            TopK = max(1, atoi(second.c_str()));
+        else if (first == "ServeThreads")
+            ServeThreads = max(1, atoi(second.c_str()));
+        else if (first == "StatsPeriod")
+            StatsPeriod = max(1, atoi(second.c_str()));
+    }
+}
+
+
+// closed once the reader and every queued request of the connection are done with it
+struct Connection
+{
+    int _fd;
+    mutex _writeLock;
+    Connection(int fd) : _fd(fd) {}
+    ~Connection() { close(_fd); }
+};
+
+struct Pending
+{
+    shared_ptr<Connection> _connection;
+    uint32_t _id, _k;
+    vector<int> _indices;
+    vector<float> _values;
+    chrono::steady_clock::time_point _arrival;
+};
+
+static mutex _queueLock;
+static condition_variable _queueReady;
+static deque<Pending*> _queue;
+
+// latencies (us) of the current window, and the last published window
+static mutex _statsLock;
+static vector<float> _latencies;
+static uint64_t _windowBatches = 0;
+static ServeStats _published;
+
+
+static bool readFully(int fd, void* data, size_t bytes)
+{
+    char* p = (char*) data;
+    while (bytes > 0) {
+        ssize_t n = read(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+// a client that went away only loses its answers
+static bool writeFully(int fd, const void* data, size_t bytes)
+{
+    const char* p = (const char*) data;
+    while (bytes > 0) {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+static void readRequests(shared_ptr<Connection> connection)
+{
+    RequestHeader header;
+    while (readFully(connection->_fd, &header, sizeof(header))) {
+        if (header._nnz == STATS_REQUEST) {
+            ServeStats stats;
+            {
+                lock_guard<mutex> guard(_statsLock);
+                stats = _published;
+            }
+            ResponseHeader response = {header._id, 0};
+            lock_guard<mutex> guard(connection->_writeLock);
+            writeFully(connection->_fd, &response, sizeof(response));
+            writeFully(connection->_fd, &stats, sizeof(stats));
+            continue;
+        }
+        if (header._nnz > MAX_REQUEST_NNZ) {
+            cout << "Request with " << header._nnz << " features, closing the connection" << endl;
+            return;
+        }
+
+        Pending* pending = new Pending;
+        pending->_connection = connection;
+        pending->_id = header._id;
+        pending->_k = header._k > 0 ? min(header._k, (uint32_t) sizesOfLayers[numLayer - 1]) : TopK;
+        pending->_indices.resize(header._nnz);
+        pending->_values.resize(header._nnz);
+        if (!readFully(connection->_fd, pending->_indices.data(), header._nnz * sizeof(int))
+                || !readFully(connection->_fd, pending->_values.data(), header._nnz * sizeof(float))) {
+            delete pending;
+            return;
+        }
+
+        // the forward pass expects ascending, distinct ids within the input dimension; ids out of range get
+        // no labels, the others are sorted and a repeated id is merged into one feature with the summed value
+        bool valid = header._nnz > 0;
+        bool sorted = true;
+        for (uint32_t f = 0; f < header._nnz; f++) {
+            valid &= pending->_indices[f] >= 0 && pending->_indices[f] < InputDim;
+            sorted &= f == 0 || pending->_indices[f - 1] < pending->_indices[f];
+        }
+        if (valid && !sorted) {
+            vector<pair<int, float> > features(header._nnz);
+            for (uint32_t f = 0; f < header._nnz; f++)
+                features[f] = make_pair(pending->_indices[f], pending->_values[f]);
+            sort(features.begin(), features.end());
+            size_t unique = 0;
+            for (uint32_t f = 0; f < header._nnz; f++) {
+                if (unique > 0 && pending->_indices[unique - 1] == features[f].first) {
+                    pending->_values[unique - 1] += features[f].second;
+                    continue;
+                }
+                pending->_indices[unique] = features[f].first;
+                pending->_values[unique] = features[f].second;
+                unique++;
+            }
+            pending->_indices.resize(unique);
+            pending->_values.resize(unique);
+        }
+        if (!valid) {
+            ResponseHeader response = {header._id, 0};
+            lock_guard<mutex> guard(connection->_writeLock);
+            writeFully(connection->_fd, &response, sizeof(response));
+            delete pending;
+            continue;
+        }
+
+        pending->_arrival = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> guard(_queueLock);
+            _queue.push_back(pending);
+        }
+        _queueReady.notify_one();
+    }
+}
+
+
+// up to MaxBatch requests, once there are that many or the oldest has waited MaxWaitUs
+static void takeBatch(vector<Pending*>& batch)
+{
+    batch.clear();
+    unique_lock<mutex> lock(_queueLock);
+    while (_queue.empty())
+        _queueReady.wait(lock);
+    auto deadline = _queue.front()->_arrival + chrono::microseconds(MaxWaitUs);
+    while ((int) _queue.size() < MaxBatch && chrono::steady_clock::now() < deadline)
+        _queueReady.wait_until(lock, deadline);
+    while (!_queue.empty() && (int) batch.size() < MaxBatch) {
+        batch.push_back(_queue.front());
+        _queue.pop_front();
+    }
+}
+
+
+static void runBatches(const Network* network, int threads)
+{
+    omp_set_num_threads(threads);
+    InferenceContext context;
+    vector<Pending*> batch;
+    vector<int*> indices;
+    vector<float*> values;
+    vector<int> lengths, topLabels;
+    vector<float> topScores, latencies;
+    while (true) {
+        takeBatch(batch);
+        int size = batch.size();
+        uint32_t k = 0;
+        indices.resize(size);
+        values.resize(size);
+        lengths.resize(size);
+        for (int i = 0; i < size; i++) {
+            indices[i] = batch[i]->_indices.data();
+            values[i] = batch[i]->_values.data();
+            lengths[i] = batch[i]->_indices.size();
+            k = max(k, batch[i]->_k);
+        }
+        topLabels.resize(size * k);
+        topScores.resize(size * k);
+        network->predictTopK(context, indices.data(), values.data(), lengths.data(), size, k, topLabels.data(), topScores.data());
+
+        latencies.clear();
+        for (int i = 0; i < size; i++) {
+            Pending* pending = batch[i];
+            uint32_t count = 0;
+            while (count < pending->_k && topLabels[i * k + count] >= 0)
+                count++;
+            ResponseHeader response = {pending->_id, count};
+            {
+                lock_guard<mutex> guard(pending->_connection->_writeLock);
+                int fd = pending->_connection->_fd;
+                writeFully(fd, &response, sizeof(response))
+                        && writeFully(fd, &topLabels[i * k], count * sizeof(int))
+                        && writeFully(fd, &topScores[i * k], count * sizeof(float));
+            }
+            latencies.push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - pending->_arrival).count());
+            delete pending;
+        }
+
+        lock_guard<mutex> guard(_statsLock);
+        _latencies.insert(_latencies.end(), latencies.begin(), latencies.end());
+        _windowBatches++;
+    }
+}
+
+
+static void publishStats()
+{
+    auto windowStart = chrono::steady_clock::now();
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(StatsPeriod));
+        auto now = chrono::steady_clock::now();
+        lock_guard<mutex> guard(_statsLock);
+        double seconds = chrono::duration_cast<chrono::microseconds>(now - windowStart).count() / 1e6;
+        size_t n = _latencies.size();
+        ServeStats stats = _published;
+        stats._qps = n / seconds;
+        stats._p50Us = 0;
+        stats._p99Us = 0;
+        stats._avgBatch = _windowBatches ? n * 1.0 / _windowBatches : 0;
+        if (n > 0) {
+            nth_element(_latencies.begin(), _latencies.begin() + n / 2, _latencies.end());
+            stats._p50Us = _latencies[n / 2];
+            nth_element(_latencies.begin(), _latencies.begin() + n * 99 / 100, _latencies.end());
+            stats._p99Us = _latencies[n * 99 / 100];
+        }
+        stats._requests += n;
+        stats._batches += _windowBatches;
+        _published = stats;
+        _latencies.clear();
+        _windowBatches = 0;
+        windowStart = now;
+        if (n > 0)
+            cout << "QPS " << stats._qps << " p50 " << stats._p50Us << " us p99 " << stats._p99Us << " us, "
+                 << stats._avgBatch << " requests per batch, " << stats._requests << " requests in total" << endl;
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        cout << "Usage: slide_server <config file>" << endl;
+        return 1;
+    }
+    parseconfig(argv[1]);
+    if (Seed >= 0) {
+        setGlobalSeed(Seed);
+    }
+
+    // per-request state lives in the batchers' contexts, the network's own batch size does not matter
+    auto t1 = chrono::steady_clock::now();
+    Network* network;
+    cnpy::npz_t arr;
+    if (FrozenModel != "") {
+        // mapped and used in place, layer sizes included
+        network = new Network(FrozenModel, 1);
+        InputDim = network->getLayer(0)->getAllNodes()[0]._dim;
+        sizesOfLayers = new int[network->getLayerCount()];
+        numLayer = network->getLayerCount();
+        for (int i = 0; i < numLayer; i++)
+            sizesOfLayers[i] = network->getLayer(i)->_noOfNodes;
+    } else {
+        NodeType* layersTypes = new NodeType[numLayer];
+        for (int i=0; i<numLayer-1; i++){
+            layersTypes[i] = NodeType::ReLU;
+        }
+        layersTypes[numLayer-1] = NodeType::Softmax;
+
+        // the network reads its parameters in place, so arr lives as long as it
+        cout << "Loading " << Checkpoint << endl;
+        arr = loadCheckpoint(Checkpoint);
+        if (!arr.count("w_layer_0")) {
+            cout << Checkpoint << " holds no model" << endl;
+            return 1;
+        }
+        network = new Network(sizesOfLayers, layersTypes, numLayer, 1, Lr, InputDim, K, L, RangePow, Sparsity, arr);
+    }
+    auto t2 = chrono::steady_clock::now();
+    cout << "Model ready in " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << " ms" << endl;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, Socket.c_str(), sizeof(address.sun_path) - 1);
+    unlink(Socket.c_str());
+    if (listener < 0 || ::bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        cout << "Could not listen on " << Socket << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int threads = max(1, omp_get_max_threads() / ServeThreads);
+    for (int t = 0; t < ServeThreads; t++)
+        thread(runBatches, network, threads).detach();
+    thread(publishStats).detach();
+    cout << "Serving on " << Socket << ": batches of up to " << MaxBatch << " within " << MaxWaitUs << " us, "
+         << ServeThreads << " batchers with " << threads << " threads each" << endl;
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            cout << "accept failed: " << strerror(errno) << endl;
+            break;
+        }
+        thread(readRequests, make_shared<Connection>(fd)).detach();
+    }
+    close(listener);
+    return 0;
+}
@@ -1,11 +1,21 @@
 #include "srp.h"
 #include <iostream>
 #include <algorithm>
+#include "Random.h"
 #include <cmath>
+#include "Ledger.h"
 
 using namespace std;
 
-SparseRandomProjection::SparseRandomProjection(size_t dimension, size_t numOfHashes, int ratio) {
+
+// bytes of the sampled inputs and signs of every hash, for the memory ledger
+size_t SparseRandomProjection::footprint(size_t dimension, size_t numOfHashes, int ratio)
+{
+    size_t samSize = ceil(1.0 * dimension / ratio);
+    return numOfHashes * (sizeof(short*) + sizeof(int*) + samSize * (sizeof(short) + sizeof(int)));
+}
+
+SparseRandomProjection::SparseRandomProjection(size_t dimension, size_t numOfHashes, int ratio, CounterRng gen) {
     _dim = dimension;
     _numhashes = numOfHashes;
     _samSize = ceil(1.0*_dim / ratio);
@@ -15,17 +25,17 @@ SparseRandomProjection::SparseRandomProjection(size_t dimension, size_t numOfHas
         a[i] = i;
     }
 
-    srand(time(0));
+    _key = gen.key();
     _randBits = new short *[_numhashes];
     _indices = new int *[_numhashes];
 
     for (size_t i = 0; i < _numhashes; i++) {
-        random_shuffle(a, a+_dim);
+        std::shuffle(a, a+_dim, gen);
         _randBits[i] = new short[_samSize];
         _indices[i] = new int[_samSize];
         for (size_t j = 0; j < _samSize; j++) {
             _indices[i][j] = a[j];
-            int curr = rand();
+            int curr = gen();
             if (curr % 2 == 0) {
                 _randBits[i][j] = 1;
             } else {
@@ -35,12 +45,20 @@ SparseRandomProjection::SparseRandomProjection(size_t dimension, size_t numOfHas
         std::sort(_indices[i], _indices[i]+_samSize);
     }
     delete [] a;
+    _ledgerLayer = ledgerLayer();
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, footprint(_dim, _numhashes, ratio));
 }
 
 
 int *SparseRandomProjection::getHash(float *vector, int length) {
-    // length should be = to _dim
     int *hashes = new int[_numhashes];
+    getHash(vector, length, hashes);
+    return hashes;
+}
+
+
+void SparseRandomProjection::getHash(float *vector, int length, int *hashes) {
+    // length should be = to _dim
 
  // #pragma omp parallel for
     for (size_t i = 0; i < _numhashes; i++) {
@@ -55,12 +73,17 @@ int *SparseRandomProjection::getHash(float *vector, int length) {
         }
         hashes[i] = (s >= 0 ? 0 : 1);
     }
-    return hashes;
 }
 
 
 int *SparseRandomProjection::getHashSparse(int* indices, float *values, size_t length) {
     int *hashes = new int[_numhashes];
+    getHashSparse(indices, values, length, hashes);
+    return hashes;
+}
+
+
+void SparseRandomProjection::getHashSparse(int* indices, float *values, size_t length, int *hashes) {
 
     for (size_t p = 0; p < _numhashes; p++) {
         double s = 0;
@@ -86,8 +109,13 @@ int *SparseRandomProjection::getHashSparse(int* indices, float *values, size_t l
         }
         hashes[p] = (s >= 0 ? 0 : 1);
     }
+}
 
-    return hashes;
+
+// key of the stream the parameters were drawn from
+uint64_t SparseRandomProjection::key() const
+{
+    return _key;
 }
 
 
@@ -98,4 +126,5 @@ SparseRandomProjection::~SparseRandomProjection() {
     }
     delete[]   _randBits;
     delete[]   _indices;
+    ledgerCharge(_ledgerLayer, LEDGER_HASHERS, -(long long) (_numhashes * (sizeof(short*) + sizeof(int*) + _samSize * (sizeof(short) + sizeof(int)))));
 }
@@ -1,5 +1,6 @@
 #include <vector>
 #pragma once
+#include "Random.h"
 using namespace std;
 
 class SparseRandomProjection 
@@ -8,10 +9,16 @@ private:
 	size_t _dim;
 	size_t _numhashes, _samSize;
 	short ** _randBits;
+	uint64_t _key;
 	int ** _indices;
+	int _ledgerLayer;
 public:
-	SparseRandomProjection(size_t dimention, size_t numOfHashes, int ratio);
+	SparseRandomProjection(size_t dimention, size_t numOfHashes, int ratio, CounterRng gen = rngStream(RNG_SRP, nextStreamId(RNG_SRP)));
+	static size_t footprint(size_t dimention, size_t numOfHashes, int ratio);
+	uint64_t key() const;
 	int * getHash(float * vector, int length);
+	void getHash(float * vector, int length, int* hashes);
 	int * getHashSparse(int* indices, float *values, size_t length);
+	void getHashSparse(int* indices, float *values, size_t length, int* hashes);
 	~SparseRandomProjection();
 };